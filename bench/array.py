@@ -0,0 +1,6 @@
+a = [float(i) for i in range(100000)]
+b = [x * 0.5 for x in a]
+x = 0.0
+for _ in range(200):
+    x += sum(p * (p + q) for p, q in zip(a, b))
+print(x)
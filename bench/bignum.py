@@ -0,0 +1,6 @@
+f = 1
+n = 3000
+while not n < 2:
+    f = f * n
+    n = n - 1
+print(0 < f)
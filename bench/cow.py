@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# checks that changing a shared list, table or string copies it and leaves the other holders as they were
+# run under the stack VM with and without the jit and under the register VM
+#
+#     bench/cow.py --slx ./slx
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+# each check prints one value, a changed copy has to leave what it was copied from alone
+source = """
+(def a (list 1 2 3))
+(def b (list-set a 0 9))
+(print (index a 0))
+(print (index b 0))
+(def t (table-set (table) "x" 1))
+(def u (table-set t "x" 9))
+(print (index t "x"))
+(print (index u "x"))
+(def f (fn (l) (list-set l 1 5)))
+(def i 0)
+(while (lt i 500) (def i (add i (index (f a) 1))))
+(print (index a 1))
+(def d (freeze a))
+(def e (list-set d 2 4))
+(print (index d 2))
+(print (index e 2))
+(print (index (list-set (list 1 2 3) 2 7) 2))
+(def s "ab")
+(def w (add (add s "c") "d"))
+(print s)
+(print w)
+"""
+
+expected = ["1", "9", "1", "9", "2", "3", "4", "7", "ab", "abcd"]
+
+modes = [[], ["--no-jit"], ["--reg"]]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--slx", default="./slx", help="the slanex binary")
+    args = parser.parse_args()
+
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "cow.slx")
+        with open(path, "w") as f:
+            f.write(source)
+        for extra in modes:
+            done = subprocess.run([args.slx] + extra + [path], stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                text=True)
+            got = done.stdout.split()
+            name = " ".join(extra) or "default"
+            print("%-10s %s" % (name, "ok" if got == expected else "FAILED"))
+            if got != expected:
+                print("expected %s\ngot      %s" % (" ".join(expected), done.stdout.strip()))
+                failed += 1
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,6 @@
+x = 0.0
+n = 1000000
+while not n < 1:
+    x = x * 0.999 + 0.001
+    n = n - 1
+print(x)
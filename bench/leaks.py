@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# runs each workload under an address sanitizer build of slanex and fails if any of them leaks
+# the stack VM is run without the jit, which is where a handler's locals can outlive it
+#
+#     g++ -std=c++17 -O1 -g -fsanitize=address -pthread main.cpp -o slx-asan -lgmp
+#     bench/leaks.py --slx ./slx-asan
+#
+# pass --reg or --profile after -- to hand them to slanex as well
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.dont_write_bytecode = True
+import parse
+from run import workloads
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+
+def check(name, slx, extra, tmp):
+    source = os.path.join(here, name + ".slx")
+    if name == "parse":
+        # fewer forms than the timed run, the sanitizer makes each one slow
+        source = os.path.join(tmp, "parse.slx")
+        with open(source, "w") as f:
+            f.write(parse.slx_source(parse.lines // 10))
+    env = dict(os.environ, ASAN_OPTIONS="detect_leaks=1")
+    done = subprocess.run([slx, "--no-jit"] + extra + [source], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+        text=True, env=env)
+    if done.returncode != 0 or "Sanitizer" in done.stderr:
+        return done.stderr.strip() or "exit code %d" % done.returncode
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--slx", default="./slx-asan", help="slanex built with -fsanitize=address")
+    parser.add_argument("--only", action="append", help="check just this workload, can be given more than once")
+    parser.add_argument("extra", nargs="*", help="flags passed on to slanex")
+    args = parser.parse_args()
+
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        for name in args.only or list(workloads):
+            error = check(name, args.slx, args.extra, tmp)
+            print("%-10s %s" % (name, "ok" if error is None else "FAILED"))
+            if error is not None:
+                print(error)
+                failed += 1
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
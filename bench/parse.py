@@ -0,0 +1,16 @@
+# the large file parsing workload, run.py writes slx_source to a file for slanex
+# run directly it compiles and runs the same program as python source
+
+lines = 200000
+
+
+def slx_source(n):
+    return "".join("(def v%d (add %d (mul 3 4)))\n" % (i, i) for i in range(n))
+
+
+def py_source(n):
+    return "".join("v%d = %d + 3 * 4\n" % (i, i) for i in range(n))
+
+
+if __name__ == "__main__":
+    exec(compile(py_source(lines), "parse", "exec"))
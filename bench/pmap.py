@@ -0,0 +1,10 @@
+from multiprocessing import Pool
+
+
+def fib(n):
+    return n if n < 2 else fib(n - 1) + fib(n - 2)
+
+
+if __name__ == "__main__":
+    with Pool() as pool:
+        print(sum(pool.map(fib, [22] * 32)))
@@ -0,0 +1,9 @@
+from fractions import Fraction
+
+x = Fraction(0)
+step = Fraction(1, 40)
+n = 200000
+while not n < 1:
+    x = x + step
+    n = n - 1
+print(x)
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# runs each workload under slanex and its python reference
+# prints one json object with the best wall time, ops/sec, phase times and peak rss of each
+#
+#     bench/run.py --slx ./slx --repeat 3 > before.json
+#
+# pass --cache or --no-opt after -- to hand them to slanex
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.dont_write_bytecode = True
+import parse
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+# what one op is for each workload, and how many the workload does
+workloads = {
+    "fib": ("call of fib", 242785),
+    "while": ("loop iteration", 3000000),
+    "table": ("table build and lookup", 200000),
+    "bignum": ("bignum multiply", 2999),
+    "rational": ("rational add", 200000),
+    "double": ("double multiply and add", 1000000),
+    "string": ("string append", 20000),
+    "parse": ("top level form", parse.lines),
+    "map": ("call of fib", 1834016),
+    "pmap": ("call of fib", 1834016),
+    "yield": ("resume and yield", 1000000),
+    "array": ("item of an add and a dot of doubles", 20000000),
+}
+
+
+def timed(cmd):
+    start = time.perf_counter()
+    done = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    return time.perf_counter() - start, done
+
+
+def stats_of(stderr):
+    for line in reversed(stderr.splitlines()):
+        line = line.strip()
+        if line.startswith("{"):
+            return json.loads(line)
+    return None
+
+
+def bench(name, slx, python, repeat, extra, tmp):
+    what, ops = workloads[name]
+    source = os.path.join(here, name + ".slx")
+    if name == "parse":
+        source = os.path.join(tmp, "parse.slx")
+        if not os.path.exists(source):
+            with open(source, "w") as f:
+                f.write(parse.slx_source(parse.lines))
+    best = None
+    stats = None
+    for _ in range(repeat):
+        took, done = timed([slx, "--stats"] + extra + [source])
+        if done.returncode != 0:
+            return {"name": name, "error": done.stderr.strip()}
+        if best is None or took < best:
+            best = took
+            stats = stats_of(done.stderr)
+    ref = None
+    if python:
+        for _ in range(repeat):
+            took, done = timed([python, os.path.join(here, name + ".py")])
+            if ref is None or took < ref:
+                ref = took
+    result = {
+        "name": name,
+        "op": what,
+        "ops": ops,
+        "seconds": best,
+        "ops_per_sec": ops / best if best else None,
+        "phases": stats,
+        "peak_rss_kb": stats["peak_rss_kb"] if stats else None,
+        "python_seconds": ref,
+        "x_python": best / ref if ref else None,
+    }
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--slx", default="./slx", help="the slanex binary")
+    parser.add_argument("--python", default=sys.executable, help="python for the references, empty to skip them")
+    parser.add_argument("--repeat", type=int, default=3, help="runs of each, the fastest is kept")
+    parser.add_argument("--only", action="append", help="run just this workload, can be given more than once")
+    parser.add_argument("extra", nargs="*", help="flags passed on to slanex")
+    args = parser.parse_args()
+
+    names = args.only or list(workloads)
+    with tempfile.TemporaryDirectory() as tmp:
+        results = [bench(name, args.slx, args.python, args.repeat, args.extra, tmp) for name in names]
+    json.dump({"slx": args.slx, "flags": args.extra, "results": results}, sys.stdout, indent=4)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
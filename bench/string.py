@@ -0,0 +1,6 @@
+s = ""
+n = 20000
+while not n < 1:
+    s = s + "ab"
+    n = n - 1
+print(s)
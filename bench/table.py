@@ -0,0 +1,4 @@
+i = 0
+while i < 200000:
+    i = {"k": i + 1, "j": i}["k"]
+print(i)
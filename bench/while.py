@@ -0,0 +1,6 @@
+i = 0
+s = 0
+while i < 3000000:
+    i = i + 1
+    s = s + i
+print(s)
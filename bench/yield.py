@@ -0,0 +1,7 @@
+def gen(i, n):
+    while i < n:
+        i = i + 1
+        yield i
+
+
+print(sum(gen(0, 1000000)))
@@ -0,0 +1,1061 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// arrays hold machine ints, doubles or bytes packed in one buffer, the kernels below run over the buffers
+// each kernel is written once over a lane type, a plain number or a gcc vector of 32 bytes
+// on x86-64 the vectors are built twice, for the sse2 every x86-64 has and for avx2, and array_pick takes one
+// define LANG_NO_SIMD to build the plain loops only
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(LANG_NO_SIMD)
+#define LANG_SIMD
+#endif
+
+#define ARRAY_INLINE __attribute__((always_inline)) inline
+
+namespace lang
+{
+    // one lane at a time, what is built when there is no simd
+    // u64 is for adding machine ints, mul for multiplying them and i64 for comparing them
+    struct array_plain
+    {
+        using u64 = uint64_t;
+        using mul = uint64_t;
+        using i64 = int64_t;
+        using f64 = double;
+        using u8 = uint8_t;
+    };
+
+#ifdef LANG_SIMD
+    typedef uint64_t array_u64x4 __attribute__((vector_size(32)));
+    typedef int64_t array_i64x4 __attribute__((vector_size(32)));
+    typedef double array_f64x4 __attribute__((vector_size(32)));
+    typedef uint8_t array_u8x32 __attribute__((vector_size(32)));
+
+    // 32 bytes at a time in two registers, sse2 has no 64 bit multiply or compare
+    // and gcc does those a lane at a time with extra moves, so machine ints are multiplied and compared plainly
+    struct array_sse2_lanes
+    {
+        using u64 = array_u64x4;
+        using mul = uint64_t;
+        using i64 = int64_t;
+        using f64 = array_f64x4;
+        using u8 = array_u8x32;
+    };
+
+    // 32 bytes at a time in one avx2 register, the 64 bit multiply is made of 32 bit ones
+    struct array_avx2_lanes
+    {
+        using u64 = array_u64x4;
+        using mul = array_u64x4;
+        using i64 = array_i64x4;
+        using f64 = array_f64x4;
+        using u8 = array_u8x32;
+    };
+#endif
+
+    // vectors only go by reference, without avx a 32 byte vector passed by value would change the abi
+    template<typename V, typename T>
+    ARRAY_INLINE void array_load(V &v, const T *p)
+    {
+        memcpy(&v, p, sizeof(V));
+    }
+
+    template<typename V, typename T>
+    ARRAY_INLINE void array_store(T *p, const V &v)
+    {
+        memcpy(p, &v, sizeof(V));
+    }
+
+    template<typename T, typename V>
+    ARRAY_INLINE T array_lane(const V &v, uint64_t k)
+    {
+        T t;
+        memcpy(&t, reinterpret_cast<const char *>(&v) + k * sizeof(T), sizeof(T));
+        return t;
+    }
+
+    // sums and dot products keep this many running sums, item i goes to sum i % array_ways
+    // every lane type adds in that order, so a double sum is the same whichever kernel ran
+    const uint64_t array_ways = 8;
+
+    // the running sums in a fixed order, then the items left over in order
+    template<typename T, typename V>
+    ARRAY_INLINE T array_fold(const V *acc, T tail)
+    {
+        T part[array_ways];
+        memcpy(part, acc, sizeof(part));
+        return (((part[0] + part[1]) + (part[2] + part[3])) + ((part[4] + part[5]) + (part[6] + part[7]))) + tail;
+    }
+
+    template<typename V, typename T>
+    ARRAY_INLINE T array_sum(const T *p, uint64_t n)
+    {
+        const uint64_t w = sizeof(V) / sizeof(T);
+        V acc[array_ways / w] = {};
+        uint64_t i = 0;
+        for (; i + array_ways <= n; i += array_ways)
+        {
+            for (uint64_t k = 0; k < array_ways / w; k++)
+            {
+                V x;
+                array_load(x, p + i + k * w);
+                acc[k] += x;
+            }
+        }
+        T tail = 0;
+        for (; i < n; i++)
+        {
+            tail += p[i];
+        }
+        return array_fold<T>(acc, tail);
+    }
+
+    template<typename V, typename T>
+    ARRAY_INLINE T array_dot(const T *a, const T *b, uint64_t n)
+    {
+        const uint64_t w = sizeof(V) / sizeof(T);
+        V acc[array_ways / w] = {};
+        uint64_t i = 0;
+        for (; i + array_ways <= n; i += array_ways)
+        {
+            for (uint64_t k = 0; k < array_ways / w; k++)
+            {
+                V x, y;
+                array_load(x, a + i + k * w);
+                array_load(y, b + i + k * w);
+                acc[k] += x * y;
+            }
+        }
+        T tail = 0;
+        for (; i < n; i++)
+        {
+            tail += a[i] * b[i];
+        }
+        return array_fold<T>(acc, tail);
+    }
+
+    // bytes are added as 16 bit lanes of 64 bit words, each round adds at most 510 to a lane
+    // so 128 rounds go by before the lanes are emptied into the total
+    template<typename V>
+    ARRAY_INLINE uint64_t array_sum_bytes(const uint8_t *p, uint64_t n)
+    {
+        const uint64_t low = 0x00ff00ff00ff00ffULL;
+        uint64_t total = 0;
+        uint64_t i = 0;
+        while (i + sizeof(V) <= n)
+        {
+            V acc = {};
+            for (uint64_t r = 0; r < 128 && i + sizeof(V) <= n; r++, i += sizeof(V))
+            {
+                V w;
+                array_load(w, p + i);
+                acc += (w & low) + ((w >> 8) & low);
+            }
+            for (uint64_t k = 0; k < sizeof(V) / 8; k++)
+            {
+                uint64_t v = array_lane<uint64_t>(acc, k);
+                total += (v & 0xffff) + ((v >> 16) & 0xffff) + ((v >> 32) & 0xffff) + (v >> 48);
+            }
+        }
+        for (; i < n; i++)
+        {
+            total += p[i];
+        }
+        return total;
+    }
+
+    // n is at least 1, a nan is passed over unless it is the first item, which is what the plain loop does
+    template<typename V, typename T>
+    ARRAY_INLINE void array_range(const T *p, uint64_t n, T &lo, T &hi)
+    {
+        const uint64_t w = sizeof(V) / sizeof(T);
+        lo = p[0];
+        hi = p[0];
+        uint64_t i = 0;
+        if (n >= w)
+        {
+            V vlo, vhi, v;
+            array_load(vlo, p);
+            vhi = vlo;
+            for (i = w; i + w <= n; i += w)
+            {
+                array_load(v, p + i);
+                vlo = v < vlo ? v : vlo;
+                vhi = v > vhi ? v : vhi;
+            }
+            for (uint64_t k = 0; k < w; k++)
+            {
+                T x = array_lane<T>(vlo, k);
+                T y = array_lane<T>(vhi, k);
+                lo = x < lo ? x : lo;
+                hi = y > hi ? y : hi;
+            }
+        }
+        for (; i < n; i++)
+        {
+            lo = p[i] < lo ? p[i] : lo;
+            hi = p[i] > hi ? p[i] : hi;
+        }
+    }
+
+    struct array_add_fn
+    {
+        template<typename V>
+        ARRAY_INLINE void operator()(V &x, const V &y) const
+        {
+            x += y;
+        }
+    };
+
+    struct array_sub_fn
+    {
+        template<typename V>
+        ARRAY_INLINE void operator()(V &x, const V &y) const
+        {
+            x -= y;
+        }
+    };
+
+    struct array_mul_fn
+    {
+        template<typename V>
+        ARRAY_INLINE void operator()(V &x, const V &y) const
+        {
+            x *= y;
+        }
+    };
+
+    struct array_div_fn
+    {
+        template<typename V>
+        ARRAY_INLINE void operator()(V &x, const V &y) const
+        {
+            x /= y;
+        }
+    };
+
+    // out[i] = a[i] op b[i], or a[i] op b[0] for every i when one is set, f does x op= y
+    template<typename V, typename T, typename F>
+    ARRAY_INLINE void array_zip(const T *a, const T *b, bool one, T *out, uint64_t n, F f)
+    {
+        const uint64_t w = sizeof(V) / sizeof(T);
+        uint64_t i = 0;
+        V x, y;
+        T t;
+        if (one)
+        {
+            y = V{} + b[0];
+            for (; i + w <= n; i += w)
+            {
+                array_load(x, a + i);
+                f(x, y);
+                array_store(out + i, x);
+            }
+            for (; i < n; i++)
+            {
+                t = a[i];
+                f(t, b[0]);
+                out[i] = t;
+            }
+            return;
+        }
+        for (; i + w <= n; i += w)
+        {
+            array_load(x, a + i);
+            array_load(y, b + i);
+            f(x, y);
+            array_store(out + i, x);
+        }
+        for (; i < n; i++)
+        {
+            t = a[i];
+            f(t, b[i]);
+            out[i] = t;
+        }
+    }
+
+    template<typename V, typename T>
+    ARRAY_INLINE void array_zip_op(array_op op, const T *a, const T *b, bool one, T *out, uint64_t n)
+    {
+        switch (op)
+        {
+            case ARRAY_ADD:
+                array_zip<V>(a, b, one, out, n, array_add_fn());
+                break;
+            case ARRAY_SUB:
+                array_zip<V>(a, b, one, out, n, array_sub_fn());
+                break;
+            case ARRAY_MUL:
+                array_zip<V>(a, b, one, out, n, array_mul_fn());
+                break;
+            case ARRAY_DIV:
+                array_zip<V>(a, b, one, out, n, array_div_fn());
+                break;
+            default:
+                break;
+        }
+    }
+
+    // the kernels built for one lane type, machine ints are added and multiplied as unsigned so they wrap
+    template<typename L>
+    struct array_level
+    {
+        static ARRAY_INLINE int64_t sum_ints(const int64_t *p, uint64_t n)
+        {
+            return array_sum<typename L::u64>(reinterpret_cast<const uint64_t *>(p), n);
+        }
+
+        static ARRAY_INLINE double sum_doubles(const double *p, uint64_t n)
+        {
+            return array_sum<typename L::f64>(p, n);
+        }
+
+        static ARRAY_INLINE uint64_t sum_bytes(const uint8_t *p, uint64_t n)
+        {
+            return array_sum_bytes<typename L::u64>(p, n);
+        }
+
+        static ARRAY_INLINE void range_ints(const int64_t *p, uint64_t n, int64_t &lo, int64_t &hi)
+        {
+            array_range<typename L::i64>(p, n, lo, hi);
+        }
+
+        static ARRAY_INLINE void range_doubles(const double *p, uint64_t n, double &lo, double &hi)
+        {
+            array_range<typename L::f64>(p, n, lo, hi);
+        }
+
+        static ARRAY_INLINE void range_bytes(const uint8_t *p, uint64_t n, uint8_t &lo, uint8_t &hi)
+        {
+            array_range<typename L::u8>(p, n, lo, hi);
+        }
+
+        static ARRAY_INLINE void op_ints(array_op op, const int64_t *a, const int64_t *b, bool one, int64_t *out, uint64_t n)
+        {
+            const uint64_t *ua = reinterpret_cast<const uint64_t *>(a);
+            const uint64_t *ub = reinterpret_cast<const uint64_t *>(b);
+            uint64_t *uout = reinterpret_cast<uint64_t *>(out);
+            if (op == ARRAY_MUL)
+            {
+                array_zip_op<typename L::mul>(op, ua, ub, one, uout, n);
+            }
+            else
+            {
+                array_zip_op<typename L::u64>(op, ua, ub, one, uout, n);
+            }
+        }
+
+        static ARRAY_INLINE void op_doubles(array_op op, const double *a, const double *b, bool one, double *out, uint64_t n)
+        {
+            array_zip_op<typename L::f64>(op, a, b, one, out, n);
+        }
+
+        static ARRAY_INLINE int64_t dot_ints(const int64_t *a, const int64_t *b, uint64_t n)
+        {
+            return array_dot<typename L::mul>(reinterpret_cast<const uint64_t *>(a), reinterpret_cast<const uint64_t *>(b), n);
+        }
+
+        static ARRAY_INLINE double dot_doubles(const double *a, const double *b, uint64_t n)
+        {
+            return array_dot<typename L::f64>(a, b, n);
+        }
+    };
+
+#ifdef LANG_SIMD
+    // the same kernels again with avx2 turned on, gcc inlines the level into each so the vectors become ymm registers
+    // fma is left off so the doubles round the way the other levels round
+    struct array_avx2
+    {
+        using level = array_level<array_avx2_lanes>;
+
+        __attribute__((target("avx2"))) static int64_t sum_ints(const int64_t *p, uint64_t n)
+        {
+            return level::sum_ints(p, n);
+        }
+
+        __attribute__((target("avx2"))) static double sum_doubles(const double *p, uint64_t n)
+        {
+            return level::sum_doubles(p, n);
+        }
+
+        __attribute__((target("avx2"))) static uint64_t sum_bytes(const uint8_t *p, uint64_t n)
+        {
+            return level::sum_bytes(p, n);
+        }
+
+        __attribute__((target("avx2"))) static void range_ints(const int64_t *p, uint64_t n, int64_t &lo, int64_t &hi)
+        {
+            level::range_ints(p, n, lo, hi);
+        }
+
+        __attribute__((target("avx2"))) static void range_doubles(const double *p, uint64_t n, double &lo, double &hi)
+        {
+            level::range_doubles(p, n, lo, hi);
+        }
+
+        __attribute__((target("avx2"))) static void range_bytes(const uint8_t *p, uint64_t n, uint8_t &lo, uint8_t &hi)
+        {
+            level::range_bytes(p, n, lo, hi);
+        }
+
+        __attribute__((target("avx2"))) static void op_ints(array_op op, const int64_t *a, const int64_t *b, bool one,
+            int64_t *out, uint64_t n)
+        {
+            level::op_ints(op, a, b, one, out, n);
+        }
+
+        __attribute__((target("avx2"))) static void op_doubles(array_op op, const double *a, const double *b, bool one,
+            double *out, uint64_t n)
+        {
+            level::op_doubles(op, a, b, one, out, n);
+        }
+
+        __attribute__((target("avx2"))) static int64_t dot_ints(const int64_t *a, const int64_t *b, uint64_t n)
+        {
+            return level::dot_ints(a, b, n);
+        }
+
+        __attribute__((target("avx2"))) static double dot_doubles(const double *a, const double *b, uint64_t n)
+        {
+            return level::dot_doubles(a, b, n);
+        }
+    };
+#endif
+
+    // what the array builtins call, one set of kernels picked when the program starts
+    struct array_kernels
+    {
+        const char *name;
+        int64_t (*sum_ints)(const int64_t *, uint64_t);
+        double (*sum_doubles)(const double *, uint64_t);
+        uint64_t (*sum_bytes)(const uint8_t *, uint64_t);
+        void (*range_ints)(const int64_t *, uint64_t, int64_t &, int64_t &);
+        void (*range_doubles)(const double *, uint64_t, double &, double &);
+        void (*range_bytes)(const uint8_t *, uint64_t, uint8_t &, uint8_t &);
+        void (*op_ints)(array_op, const int64_t *, const int64_t *, bool, int64_t *, uint64_t);
+        void (*op_doubles)(array_op, const double *, const double *, bool, double *, uint64_t);
+        int64_t (*dot_ints)(const int64_t *, const int64_t *, uint64_t);
+        double (*dot_doubles)(const double *, const double *, uint64_t);
+    };
+
+    template<typename K>
+    array_kernels array_kernels_of(const char *name)
+    {
+        return {name, K::sum_ints, K::sum_doubles, K::sum_bytes, K::range_ints, K::range_doubles, K::range_bytes,
+            K::op_ints, K::op_doubles, K::dot_ints, K::dot_doubles};
+    }
+
+    // the kernels of the named level, false when it is not built or this cpu does not have it
+    bool array_level_named(const std::string &name, array_kernels &out)
+    {
+        if (name == "plain")
+        {
+            out = array_kernels_of<array_level<array_plain>>("plain");
+            return true;
+        }
+#ifdef LANG_SIMD
+        if (name == "sse2")
+        {
+            out = array_kernels_of<array_level<array_sse2_lanes>>("sse2");
+            return true;
+        }
+        __builtin_cpu_init();
+        if (name == "avx2" && __builtin_cpu_supports("avx2"))
+        {
+            out = array_kernels_of<array_avx2>("avx2");
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // the widest level this cpu runs
+    array_kernels array_pick()
+    {
+        array_kernels ret;
+        for (const char *name: {"avx2", "sse2", "plain"})
+        {
+            if (array_level_named(name, ret))
+            {
+                break;
+            }
+        }
+        return ret;
+    }
+
+    // --simd changes it before anything runs, the kernels are the same on every thread
+    array_kernels array_simd = array_pick();
+
+    const uint64_t array_types = (1 << ANY_TYPE_INTS) | (1 << ANY_TYPE_DOUBLES) | (1 << ANY_TYPE_BYTES);
+
+    bool is_array(const anything &a)
+    {
+        return a.type == ANY_TYPE_INTS || a.type == ANY_TYPE_DOUBLES || a.type == ANY_TYPE_BYTES;
+    }
+
+    uint64_t array_size(const anything &a)
+    {
+        switch (a.type)
+        {
+            case ANY_TYPE_INTS: return any_ref<std::vector<int64_t>>(a).size();
+            case ANY_TYPE_DOUBLES: return any_ref<std::vector<double>>(a).size();
+            default: return any_ref<std::vector<uint8_t>>(a).size();
+        }
+    }
+
+    // item i of an array as a number value, i is in range
+    anything array_item(const anything &a, uint64_t i)
+    {
+        switch (a.type)
+        {
+            case ANY_TYPE_INTS: return make_small_int(any_ref<std::vector<int64_t>>(a)[i]);
+            case ANY_TYPE_DOUBLES: return make_any<ANY_TYPE_DOUBLE, double>(any_ref<std::vector<double>>(a)[i]);
+            default: return make_small_int(any_ref<std::vector<uint8_t>>(a)[i]);
+        }
+    }
+
+    fn_ret array_index(const anything &a, int64_t i)
+    {
+        if (i < 0 || uint64_t(i) >= array_size(a))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("index "s
+                + std::to_string(i) + " is out of range"));
+        }
+        return array_item(a, i);
+    }
+
+    // ints[1 2 3], the kind comes first so it does not read as a list
+    std::string array_str(const anything &a)
+    {
+        std::string ret = any_type_name(a.type) + "[";
+        uint64_t size = array_size(a);
+        for (uint64_t i = 0; i < size; i++)
+        {
+            if (i != 0)
+            {
+                ret += " ";
+            }
+            if (a.type == ANY_TYPE_DOUBLES)
+            {
+                ret += double_str(any_ref<std::vector<double>>(a)[i]);
+            }
+            else
+            {
+                ret += std::to_string(array_item(a, i).num);
+            }
+        }
+        return ret + "]";
+    }
+
+    // the items of an ints or bytes array as machine ints, in a itself when it is ints and in keep otherwise
+    const int64_t *array_ints_of(const anything &a, std::vector<int64_t> &keep)
+    {
+        if (a.type == ANY_TYPE_INTS)
+        {
+            return any_ref<std::vector<int64_t>>(a).data();
+        }
+        const std::vector<uint8_t> &from = any_ref<std::vector<uint8_t>>(a);
+        keep.assign(from.begin(), from.end());
+        return keep.data();
+    }
+
+    // the items of any array as doubles, the same way
+    const double *array_doubles_of(const anything &a, std::vector<double> &keep)
+    {
+        if (a.type == ANY_TYPE_DOUBLES)
+        {
+            return any_ref<std::vector<double>>(a).data();
+        }
+        if (a.type == ANY_TYPE_INTS)
+        {
+            const std::vector<int64_t> &from = any_ref<std::vector<int64_t>>(a);
+            keep.assign(from.begin(), from.end());
+        }
+        else
+        {
+            const std::vector<uint8_t> &from = any_ref<std::vector<uint8_t>>(a);
+            keep.assign(from.begin(), from.end());
+        }
+        return keep.data();
+    }
+
+    // a op b where one or both are arrays, the other one a number that goes with every item
+    // ints stay ints and wrap like machine ints do, a double, a rational, a bignum or div makes doubles
+    // bytes are done as ints so adding two of them does not wrap at 256
+    fn_ret array_binary(const char *name, array_op op, anything a, anything b)
+    {
+        if (!is_array(a))
+        {
+            if (op == ARRAY_ADD || op == ARRAY_MUL)
+            {
+                std::swap(a, b);
+            }
+            else
+            {
+                // a number on the left of sub or div is spread to the size of the array
+                double d;
+                if (!to_double(a, d))
+                {
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::type_error(name, {"int", "rat", "double", "ints",
+                        "doubles", "bytes"}));
+                }
+                if (is_small_int(a) && b.type != ANY_TYPE_DOUBLES)
+                {
+                    a = make_any<ANY_TYPE_INTS, std::vector<int64_t>>(std::vector<int64_t>(array_size(b), a.num));
+                }
+                else
+                {
+                    a = make_any<ANY_TYPE_DOUBLES, std::vector<double>>(std::vector<double>(array_size(b), d));
+                }
+            }
+        }
+        uint64_t size = array_size(a);
+        bool one = !is_array(b);
+        double scalar = 0;
+        if (one && !to_double(b, scalar))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::type_error(name, {"int", "rat", "double", "ints",
+                "doubles", "bytes"}));
+        }
+        if (!one && array_size(b) != size)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot "s + name + " arrays of "
+                + std::to_string(size) + " and " + std::to_string(array_size(b)) + " items"));
+        }
+        if (op == ARRAY_DIV || a.type == ANY_TYPE_DOUBLES || b.type == ANY_TYPE_DOUBLES || (one && !is_small_int(b)))
+        {
+            std::vector<double> keep_a;
+            std::vector<double> keep_b;
+            const double *pa = array_doubles_of(a, keep_a);
+            const double *pb = one ? &scalar : array_doubles_of(b, keep_b);
+            std::vector<double> out(size);
+            array_simd.op_doubles(op, pa, pb, one, out.data(), size);
+            return make_any<ANY_TYPE_DOUBLES, std::vector<double>>(std::move(out));
+        }
+        std::vector<int64_t> keep_a;
+        std::vector<int64_t> keep_b;
+        const int64_t *pa = array_ints_of(a, keep_a);
+        const int64_t *pb = one ? &b.num : array_ints_of(b, keep_b);
+        std::vector<int64_t> out(size);
+        array_simd.op_ints(op, pa, pb, one, out.data(), size);
+        return make_any<ANY_TYPE_INTS, std::vector<int64_t>>(std::move(out));
+    }
+
+    // (add a b c) is ((a + b) + c) the way number_wrap folds, a is an array or b is the only other one
+    fn_ret array_arith(const char *name, array_op op, aty2 args)
+    {
+        anything got = args[0];
+        for (uint64_t i = 1; i < args.size(); i++)
+        {
+            got = array_binary(name, op, got, args[i]);
+            if (is_a_any<ANY_TYPE_ERROR>(got))
+            {
+                break;
+            }
+        }
+        return got;
+    }
+
+    // (ints x) of a list of machine ints or of another array, doubles are rounded toward zero
+    fn_ret builtin_ints(state *s, args_view args)
+    {
+        anything &from = args[0];
+        std::vector<int64_t> out;
+        if (is_a_any<ANY_TYPE_LIST>(from))
+        {
+            const std::vector<anything> &l = any_ref<std::vector<anything>>(from);
+            out.reserve(l.size());
+            for (const anything &a: l)
+            {
+                if (!is_small_int(a))
+                {
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("ints takes machine ints, not "s
+                        + (a.type == ANY_TYPE_INT ? "a bignum" : any_type_name(a.type))));
+                }
+                out.push_back(a.num);
+            }
+        }
+        else if (is_a_any<ANY_TYPE_DOUBLES>(from))
+        {
+            const std::vector<double> &l = any_ref<std::vector<double>>(from);
+            out.reserve(l.size());
+            for (double d: l)
+            {
+                // 2^63 is the first double past the largest machine int, nans fail both
+                if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0))
+                {
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot make a machine int of "s
+                        + double_str(d)));
+                }
+                out.push_back(int64_t(d));
+            }
+        }
+        else
+        {
+            std::vector<int64_t> keep;
+            const int64_t *p = array_ints_of(from, keep);
+            out.assign(p, p + array_size(from));
+        }
+        return make_any<ANY_TYPE_INTS, std::vector<int64_t>>(std::move(out));
+    }
+
+    // (doubles x) of a list of numbers or of another array
+    fn_ret builtin_doubles(state *s, args_view args)
+    {
+        anything &from = args[0];
+        std::vector<double> out;
+        if (is_a_any<ANY_TYPE_LIST>(from))
+        {
+            const std::vector<anything> &l = any_ref<std::vector<anything>>(from);
+            out.resize(l.size());
+            for (uint64_t i = 0; i < l.size(); i++)
+            {
+                if (!to_double(l[i], out[i]))
+                {
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("doubles takes numbers, not "s
+                        + any_type_name(l[i].type)));
+                }
+            }
+        }
+        else
+        {
+            std::vector<double> keep;
+            const double *p = array_doubles_of(from, keep);
+            out.assign(p, p + array_size(from));
+        }
+        return make_any<ANY_TYPE_DOUBLES, std::vector<double>>(std::move(out));
+    }
+
+    // (bytes x) of the text of a str, or of a list or array of ints from 0 to 255
+    fn_ret builtin_bytes(state *s, args_view args)
+    {
+        anything &from = args[0];
+        if (is_a_any<ANY_TYPE_STR>(from))
+        {
+            const std::string &str = any_ref<std::string>(from);
+            return make_any<ANY_TYPE_BYTES, std::vector<uint8_t>>(std::vector<uint8_t>(str.begin(), str.end()));
+        }
+        if (is_a_any<ANY_TYPE_BYTES>(from))
+        {
+            return from;
+        }
+        std::vector<int64_t> got;
+        if (is_a_any<ANY_TYPE_LIST>(from))
+        {
+            anything ints = builtin_ints(s, args);
+            if (is_a_any<ANY_TYPE_ERROR>(ints))
+            {
+                return ints;
+            }
+            got = any_ref<std::vector<int64_t>>(ints);
+        }
+        else
+        {
+            got = any_ref<std::vector<int64_t>>(from);
+        }
+        std::vector<uint8_t> out(got.size());
+        for (uint64_t i = 0; i < got.size(); i++)
+        {
+            if (got[i] < 0 || got[i] > 255)
+            {
+                return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("a byte cannot be "s
+                    + std::to_string(got[i])));
+            }
+            out[i] = got[i];
+        }
+        return make_any<ANY_TYPE_BYTES, std::vector<uint8_t>>(std::move(out));
+    }
+
+    // (iota n) is ints from 0 to n-1
+    fn_ret builtin_iota(state *s, args_view args)
+    {
+        if (!is_small_int(args[0]) || args[0].num < 0)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("iota takes a size of 0 or more"s));
+        }
+        std::vector<int64_t> out(args[0].num);
+        for (uint64_t i = 0; i < out.size(); i++)
+        {
+            out[i] = i;
+        }
+        return make_any<ANY_TYPE_INTS, std::vector<int64_t>>(std::move(out));
+    }
+
+    fn_ret builtin_array_list(state *s, args_view args)
+    {
+        uint64_t size = array_size(args[0]);
+        std::vector<anything> out;
+        out.reserve(size);
+        for (uint64_t i = 0; i < size; i++)
+        {
+            out.push_back(array_item(args[0], i));
+        }
+        return make_any<ANY_TYPE_LIST, std::vector<anything>>(std::move(out));
+    }
+
+    fn_ret builtin_array_size(state *s, args_view args)
+    {
+        return make_small_int(array_size(args[0]));
+    }
+
+    // machine ints wrap, doubles are added in the order array_ways gives
+    fn_ret builtin_array_sum(state *s, args_view args)
+    {
+        anything &a = args[0];
+        switch (a.type)
+        {
+            case ANY_TYPE_INTS:
+            {
+                const std::vector<int64_t> &v = any_ref<std::vector<int64_t>>(a);
+                return make_small_int(array_simd.sum_ints(v.data(), v.size()));
+            }
+            case ANY_TYPE_DOUBLES:
+            {
+                const std::vector<double> &v = any_ref<std::vector<double>>(a);
+                return make_any<ANY_TYPE_DOUBLE, double>(array_simd.sum_doubles(v.data(), v.size()));
+            }
+            default:
+            {
+                const std::vector<uint8_t> &v = any_ref<std::vector<uint8_t>>(a);
+                return make_small_int(array_simd.sum_bytes(v.data(), v.size()));
+            }
+        }
+    }
+
+    // the smallest and the largest item of a, false for an empty array
+    bool array_range_of(const anything &a, anything &lo, anything &hi)
+    {
+        if (array_size(a) == 0)
+        {
+            return false;
+        }
+        switch (a.type)
+        {
+            case ANY_TYPE_INTS:
+            {
+                const std::vector<int64_t> &v = any_ref<std::vector<int64_t>>(a);
+                int64_t l, h;
+                array_simd.range_ints(v.data(), v.size(), l, h);
+                lo = make_small_int(l);
+                hi = make_small_int(h);
+                return true;
+            }
+            case ANY_TYPE_DOUBLES:
+            {
+                const std::vector<double> &v = any_ref<std::vector<double>>(a);
+                double l, h;
+                array_simd.range_doubles(v.data(), v.size(), l, h);
+                lo = make_any<ANY_TYPE_DOUBLE, double>(l);
+                hi = make_any<ANY_TYPE_DOUBLE, double>(h);
+                return true;
+            }
+            default:
+            {
+                const std::vector<uint8_t> &v = any_ref<std::vector<uint8_t>>(a);
+                uint8_t l, h;
+                array_simd.range_bytes(v.data(), v.size(), l, h);
+                lo = make_small_int(l);
+                hi = make_small_int(h);
+                return true;
+            }
+        }
+    }
+
+    fn_ret builtin_array_min(state *s, args_view args)
+    {
+        anything lo, hi;
+        if (!array_range_of(args[0], lo, hi))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("array-min of an empty array"s));
+        }
+        return lo;
+    }
+
+    fn_ret builtin_array_max(state *s, args_view args)
+    {
+        anything lo, hi;
+        if (!array_range_of(args[0], lo, hi))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("array-max of an empty array"s));
+        }
+        return hi;
+    }
+
+    // ints and bytes give a machine int that wraps, a doubles array on either side gives a double
+    fn_ret builtin_array_dot(state *s, args_view args)
+    {
+        anything &a = args[0];
+        anything &b = args[1];
+        uint64_t size = array_size(a);
+        if (array_size(b) != size)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot dot arrays of "s
+                + std::to_string(size) + " and " + std::to_string(array_size(b)) + " items"));
+        }
+        if (a.type == ANY_TYPE_DOUBLES || b.type == ANY_TYPE_DOUBLES)
+        {
+            std::vector<double> keep_a;
+            std::vector<double> keep_b;
+            const double *pa = array_doubles_of(a, keep_a);
+            const double *pb = array_doubles_of(b, keep_b);
+            return make_any<ANY_TYPE_DOUBLE, double>(array_simd.dot_doubles(pa, pb, size));
+        }
+        std::vector<int64_t> keep_a;
+        std::vector<int64_t> keep_b;
+        const int64_t *pa = array_ints_of(a, keep_a);
+        const int64_t *pb = array_ints_of(b, keep_b);
+        return make_small_int(array_simd.dot_ints(pa, pb, size));
+    }
+
+    // a sorted copy, nans go last and bytes are counted rather than compared
+    fn_ret builtin_array_sort(state *s, args_view args)
+    {
+        anything &a = args[0];
+        switch (a.type)
+        {
+            case ANY_TYPE_INTS:
+            {
+                std::vector<int64_t> out = any_ref<std::vector<int64_t>>(a);
+                std::sort(out.begin(), out.end());
+                return make_any<ANY_TYPE_INTS, std::vector<int64_t>>(std::move(out));
+            }
+            case ANY_TYPE_DOUBLES:
+            {
+                std::vector<double> out = any_ref<std::vector<double>>(a);
+                std::vector<double>::iterator nans = std::partition(out.begin(), out.end(), [](double d) {
+                    return !std::isnan(d);
+                });
+                std::sort(out.begin(), nans);
+                return make_any<ANY_TYPE_DOUBLES, std::vector<double>>(std::move(out));
+            }
+            default:
+            {
+                const std::vector<uint8_t> &from = any_ref<std::vector<uint8_t>>(a);
+                uint64_t counts[256] = {};
+                for (uint8_t b: from)
+                {
+                    counts[b] ++;
+                }
+                std::vector<uint8_t> out;
+                out.reserve(from.size());
+                for (uint64_t b = 0; b < 256; b++)
+                {
+                    out.insert(out.end(), counts[b], uint8_t(b));
+                }
+                return make_any<ANY_TYPE_BYTES, std::vector<uint8_t>>(std::move(out));
+            }
+        }
+    }
+
+    // the kernel add, sub, mul or div stands for, ARRAY_NONE for any other function
+    array_op array_op_of(state *s, const anything &fn)
+    {
+        if (!is_a_any<ANY_TYPE_FUNC>(fn))
+        {
+            return ARRAY_NONE;
+        }
+        if (fn.val() == s->quick_fns[QUICK_ADD])
+        {
+            return ARRAY_ADD;
+        }
+        if (fn.val() == s->quick_fns[QUICK_SUB])
+        {
+            return ARRAY_SUB;
+        }
+        if (fn.val() == s->quick_fns[QUICK_MUL])
+        {
+            return ARRAY_MUL;
+        }
+        anything *div = s->globals[0].find(make_any<ANY_TYPE_STR, std::string>("div"));
+        if (div != nullptr && div->val() == fn.val())
+        {
+            return ARRAY_DIV;
+        }
+        return ARRAY_NONE;
+    }
+
+    // (array-map f a) or (array-map f a b) with f a builtin
+    // add, sub, mul and div of the arithmetic builtins run as kernels over the whole array
+    // any other builtin is called on each item, the results are ints while each fits a machine int and doubles after
+    fn_ret builtin_array_map(state *s, args_view args)
+    {
+        anything fn = args[0];
+        bool two = args.size() == 3;
+        if (!is_a_any<ANY_TYPE_FUNC>(fn) && !is_a_any<ANY_TYPE_NATIVE>(fn))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("array-map takes a builtin, not "s
+                + any_type_name(fn.type)));
+        }
+        array_op op = array_op_of(s, fn);
+        if (two && op != ARRAY_NONE)
+        {
+            return array_binary(op == ARRAY_DIV ? "div" : "array-map", op, args[1], args[2]);
+        }
+        uint64_t size = array_size(args[1]);
+        if (two && is_array(args[2]) && array_size(args[2]) != size)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot array-map arrays of "s
+                + std::to_string(size) + " and " + std::to_string(array_size(args[2])) + " items"));
+        }
+        std::vector<int64_t> ints;
+        std::vector<double> doubles;
+        bool as_doubles = false;
+        ints.reserve(size);
+        for (uint64_t i = 0; i < size; i++)
+        {
+            anything call[2] = {array_item(args[1], i), two && is_array(args[2]) ? array_item(args[2], i) : args[args.size()-1]};
+            args_view view = {call, args.size()-1};
+            anything got = is_a_any<ANY_TYPE_NATIVE>(fn) ? s->call_native(fn.native, view) : s->call_func(fn, call, view.size());
+            if (is_a_any<ANY_TYPE_ERROR>(got))
+            {
+                return got;
+            }
+            if (!as_doubles && is_small_int(got))
+            {
+                ints.push_back(got.num);
+                continue;
+            }
+            if (!as_doubles)
+            {
+                as_doubles = true;
+                doubles.assign(ints.begin(), ints.end());
+                doubles.reserve(size);
+            }
+            double d;
+            if (!to_double(got, d))
+            {
+                return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("array-map needs numbers back, not "s
+                    + any_type_name(got.type)));
+            }
+            doubles.push_back(d);
+        }
+        if (as_doubles)
+        {
+            return make_any<ANY_TYPE_DOUBLES, std::vector<double>>(std::move(doubles));
+        }
+        return make_any<ANY_TYPE_INTS, std::vector<int64_t>>(std::move(ints));
+    }
+
+    // which kernels the array builtins run, avx2, sse2 or plain
+    fn_ret builtin_array_simd(state *s, args_view args)
+    {
+        return make_any<ANY_TYPE_STR, std::string>(array_simd.name);
+    }
+
+    native_fn native_ints = {"ints", builtin_ints, 1, 1, {(1 << ANY_TYPE_LIST) | array_types}};
+    native_fn native_doubles = {"doubles", builtin_doubles, 1, 1, {(1 << ANY_TYPE_LIST) | array_types}};
+    native_fn native_bytes = {"bytes", builtin_bytes, 1, 1, {(1 << ANY_TYPE_STR) | (1 << ANY_TYPE_LIST)
+        | (1 << ANY_TYPE_INTS) | (1 << ANY_TYPE_BYTES)}};
+    native_fn native_iota = {"iota", builtin_iota, 1, 1, {1 << ANY_TYPE_INT}};
+    native_fn native_array_list = {"array-list", builtin_array_list, 1, 1, {array_types}};
+    native_fn native_array_size = {"array-size", builtin_array_size, 1, 1, {array_types}};
+    native_fn native_array_sum = {"array-sum", builtin_array_sum, 1, 1, {array_types}};
+    native_fn native_array_min = {"array-min", builtin_array_min, 1, 1, {array_types}};
+    native_fn native_array_max = {"array-max", builtin_array_max, 1, 1, {array_types}};
+    native_fn native_array_dot = {"array-dot", builtin_array_dot, 2, 2, {array_types, array_types}};
+    native_fn native_array_sort = {"array-sort", builtin_array_sort, 1, 1, {array_types}};
+    native_fn native_array_map = {"array-map", builtin_array_map, 2, 3, {0, array_types}};
+    native_fn native_array_simd = {"array-simd", builtin_array_simd, 0, 0, {}};
+}
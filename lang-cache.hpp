@@ -0,0 +1,689 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <cstdio>
+#include <cstring>
+
+namespace lang
+{
+    // a .slxc file is, in native byte order:
+    //     "SLXC" u32 version
+    //     u64 source hash, u64 source size, u64 compile passes as cache_passes gives them
+    //     u64 count, then each global name as u64 size and bytes, in slot order
+    //     u64 count, then each constant as u64 any_type and its encoding
+    //     u64 count, then the end of each top level form in ops
+    //     u64 count, then each op as u64 type, helper, extra
+    const char cache_magic[4] = {'S', 'L', 'X', 'C'};
+    const uint32_t cache_version = 4;
+
+    // what running a file compiled to, kept so it can be run again without compiling
+    struct cache_image
+    {
+        opcode_vec ops; // as optimize left them, before run quickened anything
+        std::vector<uint64_t> forms; // end of each top level form in ops
+        bool complete = false; // every form compiled and ran
+    };
+
+    // fnv-1a
+    uint64_t cache_hash(const char *begin, const char *end)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (const char *c = begin; c != end; c++)
+        {
+            h ^= uint8_t(*c);
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // the passes that change the ops an image holds, a file made with other ones is compiled again
+    // fold is left out since run_file turns it off for every file it caches, quicken and jit only act at run time
+    uint64_t cache_passes(const opt_flags &opts)
+    {
+        return uint64_t(opts.peephole) | uint64_t(opts.superinstructions) << 1 | uint64_t(opts.jump_threading) << 2;
+    }
+
+    struct cache_writer
+    {
+        std::string out;
+
+        void u64(uint64_t n)
+        {
+            out.append(reinterpret_cast<const char *>(&n), sizeof(n));
+        }
+
+        void bytes(const char *data, uint64_t size)
+        {
+            u64(size);
+            out.append(data, size);
+        }
+
+        void mpz(mpz_srcptr z)
+        {
+            std::string raw((mpz_sizeinbase(z, 2)+7)/8, '\0');
+            size_t count = 0;
+            mpz_export(&raw[0], &count, -1, 1, 0, 0, z);
+            u64(mpz_sgn(z) < 0);
+            bytes(raw.data(), count);
+        }
+
+        // false for constants that have no encoding
+        bool value(const anything &a)
+        {
+            u64(a.type);
+            switch (a.type)
+            {
+                case ANY_TYPE_INT:
+                {
+                    u64(a.boxed ? 1 : 0);
+                    if (a.boxed)
+                    {
+                        mpz(static_cast<mpz_int *>(a.val())->backend().data());
+                    }
+                    else
+                    {
+                        u64(a.num);
+                    }
+                    return true;
+                }
+                case ANY_TYPE_RAT:
+                {
+                    mpq_srcptr q = static_cast<mpq_rational *>(a.val())->backend().data();
+                    mpz(mpq_numref(q));
+                    mpz(mpq_denref(q));
+                    return true;
+                }
+                case ANY_TYPE_STR:
+                {
+                    std::string &s = *static_cast<std::string *>(a.val());
+                    bytes(s.data(), s.size());
+                    return true;
+                }
+                case ANY_TYPE_BOOL:
+                {
+                    u64(a.flag);
+                    return true;
+                }
+                case ANY_TYPE_DOUBLE:
+                {
+                    uint64_t bits;
+                    memcpy(&bits, &a.dbl, sizeof(bits));
+                    u64(bits);
+                    return true;
+                }
+                case ANY_TYPE_NONE:
+                {
+                    return true;
+                }
+                default:
+                {
+                    return false;
+                }
+            }
+        }
+    };
+
+    // every read checks the bounds, a short or damaged file just fails to load
+    struct cache_reader
+    {
+        const char *cur;
+        const char *end;
+        bool ok = true;
+
+        uint64_t u64()
+        {
+            uint64_t n = 0;
+            if (uint64_t(end-cur) < sizeof(n))
+            {
+                ok = false;
+                return 0;
+            }
+            memcpy(&n, cur, sizeof(n));
+            cur += sizeof(n);
+            return n;
+        }
+
+        std::string_view bytes()
+        {
+            uint64_t size = u64();
+            if (!ok || uint64_t(end-cur) < size)
+            {
+                ok = false;
+                return std::string_view();
+            }
+            std::string_view ret(cur, size);
+            cur += size;
+            return ret;
+        }
+
+        void mpz(mpz_ptr z)
+        {
+            bool neg = u64() != 0;
+            std::string_view raw = bytes();
+            mpz_import(z, raw.size(), -1, 1, 0, 0, raw.data());
+            if (neg)
+            {
+                mpz_neg(z, z);
+            }
+        }
+
+        anything value()
+        {
+            anything ret;
+            ret.type = u64();
+            switch (ret.type)
+            {
+                case ANY_TYPE_INT:
+                {
+                    if (u64() == 0)
+                    {
+                        ret.num = u64();
+                        return ret;
+                    }
+                    mpz_int z;
+                    mpz(z.backend().data());
+                    return make_any<ANY_TYPE_INT, mpz_int>(z);
+                }
+                case ANY_TYPE_RAT:
+                {
+                    mpz_int num;
+                    mpz_int den;
+                    mpz(num.backend().data());
+                    mpz(den.backend().data());
+                    if (den == 0)
+                    {
+                        ok = false;
+                        return ret;
+                    }
+                    return make_any<ANY_TYPE_RAT, mpq_rational>(mpq_rational(num, den));
+                }
+                case ANY_TYPE_STR:
+                {
+                    return make_any<ANY_TYPE_STR, std::string>(std::string(bytes()));
+                }
+                case ANY_TYPE_BOOL:
+                {
+                    return make_any<ANY_TYPE_BOOL, bool>(u64() != 0);
+                }
+                case ANY_TYPE_DOUBLE:
+                {
+                    uint64_t bits = u64();
+                    double d;
+                    memcpy(&d, &bits, sizeof(d));
+                    return make_any<ANY_TYPE_DOUBLE, double>(d);
+                }
+                case ANY_TYPE_NONE:
+                {
+                    return make_any<ANY_TYPE_NONE, none>(none());
+                }
+                default:
+                {
+                    ok = false;
+                    return ret;
+                }
+            }
+        }
+    };
+
+    // false when the image cannot be written, nothing is left behind then
+    bool cache_save(const state &s, const cache_image &image, uint64_t hash, uint64_t source_size, const std::string &path)
+    {
+        cache_writer w;
+        w.out.append(cache_magic, 4);
+        w.out.append(reinterpret_cast<const char *>(&cache_version), sizeof(cache_version));
+        w.u64(hash);
+        w.u64(source_size);
+        w.u64(cache_passes(s.opts));
+        w.u64(s.global_names.size());
+        for (const std::string &name: s.global_names)
+        {
+            w.bytes(name.data(), name.size());
+        }
+        w.u64(s.helpers.size());
+        for (const anything &value: s.helpers)
+        {
+            if (!w.value(value))
+            {
+                return false;
+            }
+        }
+        w.u64(image.forms.size());
+        for (uint64_t end: image.forms)
+        {
+            w.u64(end);
+        }
+        w.u64(image.ops.size());
+        for (const opcode &op: image.ops)
+        {
+            w.u64(op.type);
+            w.u64(op.helper);
+            w.u64(op.extra);
+        }
+        // written to the side and renamed so a reader never sees half a file
+        std::string tmp = path + ".tmp";
+        bool written;
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            f.write(w.out.data(), w.out.size());
+            // close flushes, so a full disk shows up here rather than in the destructor
+            f.close();
+            written = !f.fail();
+        }
+        if (!written || std::rename(tmp.c_str(), path.c_str()) != 0)
+        {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // what run takes for granted about the code it is given, checked by following every path through it
+    // a fn body is the JMP over it, ARGC, an optional BEGIN_SPACE and the ops up to where the JMP goes,
+    // bodies nest and each op belongs to the innermost one, or to the top level of its form
+    struct cache_checker
+    {
+        const opcode_vec &ops;
+        std::vector<uint64_t> owner; // ARGC place of the body each op is in, 0 for the top level
+        std::vector<uint64_t> frame; // locals of the body whose ARGC is at each place
+        std::vector<int64_t> depth; // values on the stack before each op, past the locals in a body, -1 if not reached
+        std::vector<uint64_t> calls; // ARGC places of the bodies DEFUN ops make fns of
+
+        // finds the bodies and the frame each makes, false when they overlap or ask for an absurd frame
+        bool bodies()
+        {
+            owner.assign(ops.size(), 0);
+            frame.assign(ops.size(), 0);
+            std::vector<std::pair<uint64_t, uint64_t>> open; // ARGC place and last op of each open body
+            for (uint64_t i = 0; i < ops.size(); i++)
+            {
+                while (open.size() > 0 && open[open.size()-1].second < i)
+                {
+                    open.pop_back();
+                }
+                const opcode &op = ops[i];
+                if (op.type == OPCODE_TYPE_ARGC)
+                {
+                    if (i == 0 || ops[i-1].type != OPCODE_TYPE_JMP || ops[i-1].helper < i
+                        || (open.size() > 0 && ops[i-1].helper > open[open.size()-1].second))
+                    {
+                        return false;
+                    }
+                    uint64_t last = ops[i-1].helper;
+                    frame[i] = op.helper;
+                    if (i+1 <= last && ops[i+1].type == OPCODE_TYPE_BEGIN_SPACE)
+                    {
+                        // each local past the parameters is made by a store in the body
+                        if (ops[i+1].helper > last-i)
+                        {
+                            return false;
+                        }
+                        frame[i] += ops[i+1].helper;
+                    }
+                    open.push_back({i, last});
+                }
+                else if (op.type == OPCODE_TYPE_BEGIN_SPACE && (i == 0 || ops[i-1].type != OPCODE_TYPE_ARGC))
+                {
+                    return false;
+                }
+                owner[i] = open.size() > 0 ? open[open.size()-1].first : 0;
+            }
+            return true;
+        }
+
+        // follows the code of one form or fn body from entry, body is its ARGC place or 0 for a form
+        // a form stops when it gets to end, a body only at a RET
+        bool paths(uint64_t entry, uint64_t body, uint64_t end)
+        {
+            if (depth[entry] != -1)
+            {
+                return true;
+            }
+            depth[entry] = 0;
+            std::vector<uint64_t> todo = {entry};
+            while (todo.size() > 0)
+            {
+                uint64_t i = todo[todo.size()-1];
+                todo.pop_back();
+                const opcode &op = ops[i];
+                if (owner[i] != body)
+                {
+                    return false;
+                }
+                int64_t need = 0; // values the op takes off the stack or reads
+                int64_t change = 0;
+                bool falls = true;
+                bool jumps = false;
+                switch (op.type)
+                {
+                    case OPCODE_TYPE_PUSH_VAL:
+                    case OPCODE_TYPE_PUSH_NAME:
+                    case OPCODE_TYPE_LOAD_GLOBAL:
+                    {
+                        change = 1;
+                        break;
+                    }
+                    case OPCODE_TYPE_LOAD_LOCAL:
+                    case OPCODE_TYPE_STORE_LOCAL:
+                    case OPCODE_TYPE_STORE_LOCAL_POP:
+                    {
+                        if (body == 0 || op.helper >= frame[body])
+                        {
+                            return false;
+                        }
+                        need = op.type == OPCODE_TYPE_LOAD_LOCAL ? 0 : 1;
+                        change = op.type == OPCODE_TYPE_LOAD_LOCAL ? 1 : op.type == OPCODE_TYPE_STORE_LOCAL ? 0 : -1;
+                        break;
+                    }
+                    case OPCODE_TYPE_STORE_GLOBAL:
+                    {
+                        need = 1;
+                        break;
+                    }
+                    case OPCODE_TYPE_STORE_GLOBAL_POP:
+                    case OPCODE_TYPE_POP:
+                    {
+                        need = 1;
+                        change = -1;
+                        break;
+                    }
+                    // the fn and its arguments are replaced by what it gives
+                    case OPCODE_TYPE_TAIL_CALL:
+                    case OPCODE_TYPE_FUNC_CALL:
+                    case OPCODE_TYPE_FUNC_CALL_TOP:
+                    {
+                        if (op.type == OPCODE_TYPE_TAIL_CALL && body == 0)
+                        {
+                            return false;
+                        }
+                        need = op.helper+1;
+                        change = -int64_t(op.helper);
+                        break;
+                    }
+                    case OPCODE_TYPE_CALL_GLOBAL_TOP:
+                    {
+                        need = op.extra;
+                        change = 1-int64_t(op.extra);
+                        break;
+                    }
+                    case OPCODE_TYPE_JMP_IF:
+                    case OPCODE_TYPE_JMP_IF_NOT:
+                    {
+                        need = 1;
+                        change = -1;
+                        jumps = true;
+                        break;
+                    }
+                    case OPCODE_TYPE_JMP:
+                    {
+                        falls = false;
+                        jumps = true;
+                        break;
+                    }
+                    case OPCODE_TYPE_DEFUN:
+                    {
+                        // a fn starts at the JMP over its body, run goes on from the ARGC after it
+                        if (op.helper+1 >= ops.size() || ops[op.helper].type != OPCODE_TYPE_JMP
+                            || ops[op.helper+1].type != OPCODE_TYPE_ARGC)
+                        {
+                            return false;
+                        }
+                        calls.push_back(op.helper+1);
+                        change = 1;
+                        break;
+                    }
+                    case OPCODE_TYPE_RET:
+                    {
+                        if (body == 0)
+                        {
+                            return false;
+                        }
+                        falls = false;
+                        break;
+                    }
+                    // a body is only entered by a call, and its locals are made before anything is pushed
+                    case OPCODE_TYPE_ARGC:
+                    {
+                        if (i != entry)
+                        {
+                            return false;
+                        }
+                        break;
+                    }
+                    case OPCODE_TYPE_BEGIN_SPACE:
+                    {
+                        need = -depth[i];
+                        break;
+                    }
+                    case OPCODE_TYPE_END_SPACE:
+                    case OPCODE_TYPE_NOP:
+                    {
+                        break;
+                    }
+                    default:
+                    {
+                        return false;
+                    }
+                }
+                if (depth[i] < need)
+                {
+                    return false;
+                }
+                int64_t after = depth[i] + change;
+                std::vector<uint64_t> nexts;
+                if (falls)
+                {
+                    nexts.push_back(i+1);
+                }
+                if (jumps)
+                {
+                    nexts.push_back(op.helper+1);
+                }
+                for (uint64_t next: nexts)
+                {
+                    // run stops once a form gets to its end, a jump out of it would run on into other code
+                    if (body == 0 && next == end)
+                    {
+                        continue;
+                    }
+                    if (next >= ops.size() || (body == 0 && (next < entry || next > end)))
+                    {
+                        return false;
+                    }
+                    if (depth[next] == -1)
+                    {
+                        depth[next] = after;
+                        todo.push_back(next);
+                    }
+                    else if (depth[next] != after)
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        // forms holds the end of each form, the first starts at first
+        bool check(const std::vector<uint64_t> &forms, uint64_t first)
+        {
+            if (!bodies())
+            {
+                return false;
+            }
+            depth.assign(ops.size(), -1);
+            uint64_t start = first;
+            for (uint64_t end: forms)
+            {
+                if (end < start || (start != end && !paths(start, 0, end)))
+                {
+                    return false;
+                }
+                start = end;
+            }
+            while (calls.size() > 0)
+            {
+                uint64_t entry = calls[calls.size()-1];
+                calls.pop_back();
+                if (!paths(entry, entry, 0))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // fills the globals and constants of a state that has compiled nothing yet, and the ops and forms of image
+    // false when the data is not a cache of this source, nothing is changed then
+    bool cache_load(state &s, cache_image &image, uint64_t hash, uint64_t source_size, const char *begin, const char *end)
+    {
+        if (s.global_names.size() != 0 || s.helpers.size() != 0 || s.opcodes.size() != s.call_place+1)
+        {
+            return false;
+        }
+        uint32_t version = 0;
+        if (uint64_t(end-begin) < 4+sizeof(version) || memcmp(begin, cache_magic, 4) != 0)
+        {
+            return false;
+        }
+        memcpy(&version, begin+4, sizeof(version));
+        cache_reader r = {begin+4+sizeof(version), end};
+        if (version != cache_version || r.u64() != hash || r.u64() != source_size || r.u64() != cache_passes(s.opts))
+        {
+            return false;
+        }
+        std::vector<std::string> names;
+        uint64_t nglobals = r.u64();
+        for (uint64_t i = 0; i < nglobals && r.ok; i++)
+        {
+            names.push_back(std::string(r.bytes()));
+        }
+        std::vector<anything> helpers;
+        uint64_t nhelpers = r.u64();
+        for (uint64_t i = 0; i < nhelpers && r.ok; i++)
+        {
+            helpers.push_back(r.value());
+        }
+        std::vector<uint64_t> forms;
+        uint64_t nforms = r.u64();
+        for (uint64_t i = 0; i < nforms && r.ok; i++)
+        {
+            forms.push_back(r.u64());
+        }
+        uint64_t nops = r.u64();
+        if (!r.ok || nops > uint64_t(end-r.cur)/24)
+        {
+            return false;
+        }
+        opcode_vec ops(nops);
+        for (uint64_t i = 0; i < nops; i++)
+        {
+            opcode &op = ops[i];
+            uint64_t type = r.u64();
+            op.helper = r.u64();
+            op.extra = r.u64();
+            if (type >= OPCODE_TYPE_COUNT)
+            {
+                return false;
+            }
+            op.type = opcode_type(type);
+            // the operands that index something have to be in range for run
+            switch (op.type)
+            {
+                case OPCODE_TYPE_PUSH_VAL:
+                case OPCODE_TYPE_PUSH_NAME:
+                {
+                    if (op.helper >= nhelpers)
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                case OPCODE_TYPE_LOAD_GLOBAL:
+                case OPCODE_TYPE_STORE_GLOBAL:
+                case OPCODE_TYPE_STORE_GLOBAL_POP:
+                {
+                    if (op.helper >= nglobals)
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                case OPCODE_TYPE_CALL_GLOBAL_TOP:
+                {
+                    // extra is the argument count, and every argument is pushed by an op of its own
+                    if (op.helper >= nglobals || op.extra > nops)
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                case OPCODE_TYPE_JMP:
+                case OPCODE_TYPE_JMP_IF:
+                case OPCODE_TYPE_JMP_IF_NOT:
+                case OPCODE_TYPE_DEFUN:
+                {
+                    if (op.helper+1 > nops)
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                case OPCODE_TYPE_FUNC_CALL:
+                case OPCODE_TYPE_FUNC_CALL_TOP:
+                case OPCODE_TYPE_TAIL_CALL:
+                {
+                    // helper is the argument count, kept small here so cache_checker can count with it
+                    if (op.helper > nops)
+                    {
+                        return false;
+                    }
+                    break;
+                }
+                case OPCODE_TYPE_POP:
+                case OPCODE_TYPE_RET:
+                case OPCODE_TYPE_BEGIN_SPACE:
+                case OPCODE_TYPE_END_SPACE:
+                case OPCODE_TYPE_NOP:
+                // checked against the frame of their body by cache_checker
+                case OPCODE_TYPE_LOAD_LOCAL:
+                case OPCODE_TYPE_STORE_LOCAL:
+                case OPCODE_TYPE_STORE_LOCAL_POP:
+                case OPCODE_TYPE_ARGC:
+                {
+                    break;
+                }
+                // the ops quicken makes, an image is saved before run rewrites anything
+                default:
+                {
+                    return false;
+                }
+            }
+        }
+        uint64_t last = 0;
+        for (uint64_t form_end: forms)
+        {
+            if (form_end < last || form_end > nops)
+            {
+                return false;
+            }
+            last = form_end;
+        }
+        if (!r.ok || r.cur != end || last != nops)
+        {
+            return false;
+        }
+        cache_checker checker = {ops};
+        if (!checker.check(forms, s.call_place+1))
+        {
+            return false;
+        }
+        for (std::string &name: names)
+        {
+            s.intern_global(name);
+        }
+        s.helpers = std::move(helpers);
+        image.ops = std::move(ops);
+        image.forms = std::move(forms);
+        return true;
+    }
+}
@@ -0,0 +1,615 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// swapcontext saves the signal mask with a syscall each switch, on x86-64 only the registers the abi keeps are switched
+// define LANG_NO_CORO_SWITCH to use ucontext everywhere
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(LANG_NO_CORO_SWITCH)
+#define LANG_CORO_SWITCH
+// saves the callee saved registers, mxcsr and the x87 control word on this stack and its top in *from
+// then takes them back off the stack at to and returns to where that stack left off
+extern "C" void lang_coro_jump(void **from, void *to);
+asm(R"(
+    .text
+    .globl lang_coro_jump
+    .type lang_coro_jump, @function
+lang_coro_jump:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size lang_coro_jump, .-lang_coro_jump
+)");
+#else
+#include <ucontext.h>
+#endif
+
+namespace lang
+{
+    // a coroutine is a call with a C stack of its own, so it can stop inside a builtin and go on later
+    // the VM keeps its stacks in the state, switching to a coroutine swaps them with the ones it keeps
+    // (coro f args ...) makes one that resume and yield drive, (async f args ...) one the event loop drives
+    // a coroutine dropped while it is stopped is not unwound, only its VM stacks are freed
+
+    enum coro_status
+    {
+        CORO_NEW,
+        CORO_SUSPENDED,
+        CORO_RUNNING,
+        CORO_DONE,
+        CORO_FAILED,
+    };
+
+    // run does not recurse on user calls, this is only for builtins and the calls they make
+    const uint64_t coro_stack_size = 256 << 10;
+
+    // the stacks of ended coroutines, so making one is not an mmap each time
+    // each has a page below it that faults, an overflow crashes instead of writing over something
+    struct coro_stack_pool
+    {
+        std::vector<char *> free;
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        char *take();
+        void give(char *);
+        ~coro_stack_pool();
+    };
+
+    thread_local coro_stack_pool coro_stacks;
+
+    struct coro_state: std::enable_shared_from_this<coro_state>
+    {
+        state *owner;
+        anything fn;
+        std::vector<anything> args;
+        coro_status status = CORO_NEW;
+        bool on_loop = false; // made by async, only the event loop resumes it
+        bool parked = false; // waiting on an fd, a timer or another coroutine, the loop wakes it
+        anything transfer; // what resume hands to yield and yield hands back
+        anything result;
+        std::vector<std::shared_ptr<coro_state>> waiters; // loop coroutines that await this one
+        // what the state holds while this runs, and this holds while it does not
+        std::vector<anything> vm_stack;
+        std::vector<frame> ret_stack;
+        std::vector<std::vector<anything>> arg_pool;
+        uint64_t arg_depth = 0;
+        std::vector<profile_call> prof_calls;
+        coro_state *prev = nullptr; // what was running before this was resumed
+        char *stack = nullptr;
+#ifdef LANG_CORO_SWITCH
+        void *sp = nullptr; // the top of its stack while it is stopped
+        void *caller_sp = nullptr; // where yield goes back to
+#else
+        ucontext_t context;
+        ucontext_t *caller = nullptr; // where yield goes back to
+#endif
+        ~coro_state();
+    };
+
+    // one a state, made by the first async
+    struct coro_loop
+    {
+        int epoll = epoll_create1(EPOLL_CLOEXEC);
+        std::deque<std::shared_ptr<coro_state>> ready;
+        std::unordered_map<int, std::shared_ptr<coro_state>> fds; // parked until the fd can be read
+        std::multimap<uint64_t, std::shared_ptr<coro_state>> timers; // parked until profile_now passes the key
+        ~coro_loop();
+    };
+
+    char *coro_stack_pool::take()
+    {
+        if (free.size() != 0)
+        {
+            char *ret = free.back();
+            free.pop_back();
+            return ret;
+        }
+        void *got = mmap(nullptr, coro_stack_size + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (got == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        mprotect(got, page, PROT_NONE);
+        return static_cast<char *>(got) + page;
+    }
+
+    void coro_stack_pool::give(char *stack)
+    {
+        if (free.size() < 64)
+        {
+            free.push_back(stack);
+            return;
+        }
+        munmap(stack - page, coro_stack_size + page);
+    }
+
+    coro_stack_pool::~coro_stack_pool()
+    {
+        for (char *stack: free)
+        {
+            munmap(stack - page, coro_stack_size + page);
+        }
+    }
+
+    coro_state::~coro_state()
+    {
+        if (stack != nullptr)
+        {
+            coro_stacks.give(stack);
+        }
+    }
+
+    coro_loop::~coro_loop()
+    {
+        if (epoll >= 0)
+        {
+            close(epoll);
+        }
+    }
+
+    void coro_swap(state &s, coro_state &co)
+    {
+        std::swap(s.vm_stack, co.vm_stack);
+        std::swap(s.ret_stack, co.ret_stack);
+        std::swap(s.arg_pool, co.arg_pool);
+        std::swap(s.arg_depth, co.arg_depth);
+        if (s.profile)
+        {
+            std::swap(s.profile->calls, co.prof_calls);
+        }
+    }
+
+    // makecontext only passes ints, so the coroutine being started is handed over here
+    thread_local coro_state *coro_starting = nullptr;
+
+    void coro_entry()
+    {
+        coro_state &co = *coro_starting;
+        bool failed = false;
+        co.result = co.owner->call_value(co.fn, co.args, failed);
+        co.status = failed ? CORO_FAILED : CORO_DONE;
+        co.fn = make_any<ANY_TYPE_NONE, none>(none());
+        co.args.clear();
+        // never comes back, the stack is given up by whoever resumed this last
+#ifdef LANG_CORO_SWITCH
+        lang_coro_jump(&co.sp, co.caller_sp);
+#else
+        setcontext(co.caller);
+#endif
+    }
+
+    // runs co until it yields, parks or ends, false when there was no stack for it
+    bool coro_resume(state &s, coro_state &co)
+    {
+        if (co.status == CORO_NEW)
+        {
+            co.stack = coro_stacks.take();
+            if (co.stack == nullptr)
+            {
+                return false;
+            }
+#ifdef LANG_CORO_SWITCH
+            // what lang_coro_jump takes off a stack, with coro_entry as the return address
+            // coro_entry then starts with the stack 8 off a 16 byte boundary, as if it had been called
+            uint64_t top = (uint64_t(co.stack) + coro_stack_size) / 16 * 16 - 8;
+            uint64_t *frame = reinterpret_cast<uint64_t *>(top - 64);
+            std::fill(frame, frame+8, 0);
+            uint32_t mxcsr = 0x1f80;
+            uint16_t fpcw = 0x37f;
+            memcpy(frame, &mxcsr, sizeof(mxcsr));
+            memcpy(reinterpret_cast<char *>(frame)+4, &fpcw, sizeof(fpcw));
+            frame[7] = uint64_t(&coro_entry);
+            co.sp = frame;
+#else
+            getcontext(&co.context);
+            co.context.uc_stack.ss_sp = co.stack;
+            co.context.uc_stack.ss_size = coro_stack_size;
+            co.context.uc_link = nullptr;
+            makecontext(&co.context, coro_entry, 0);
+#endif
+            coro_starting = &co;
+        }
+        co.prev = s.coro_now;
+        co.status = CORO_RUNNING;
+        s.coro_now = &co;
+        coro_swap(s, co);
+#ifdef LANG_CORO_SWITCH
+        lang_coro_jump(&co.caller_sp, co.sp);
+#else
+        ucontext_t here;
+        co.caller = &here;
+        swapcontext(&here, &co.context);
+#endif
+        coro_swap(s, co);
+        s.coro_now = co.prev;
+        if (co.status == CORO_RUNNING)
+        {
+            co.status = CORO_SUSPENDED;
+            return true;
+        }
+        coro_stacks.give(co.stack);
+        co.stack = nullptr;
+        for (std::shared_ptr<coro_state> &w: co.waiters)
+        {
+            w->parked = false;
+            s.loop->ready.push_back(std::move(w));
+        }
+        co.waiters.clear();
+        return true;
+    }
+
+    // back to whoever resumed co, returns once it is resumed again
+    void coro_suspend(coro_state &co)
+    {
+#ifdef LANG_CORO_SWITCH
+        lang_coro_jump(&co.sp, co.caller_sp);
+#else
+        swapcontext(&co.context, co.caller);
+#endif
+    }
+
+    // runs the loop coroutines until until has ended, false if nothing is left that could end it
+    bool state::loop_run(coro_state *until)
+    {
+        coro_loop &l = *loop;
+        while (until->status != CORO_DONE && until->status != CORO_FAILED)
+        {
+            if (l.ready.size() != 0)
+            {
+                std::shared_ptr<coro_state> co = std::move(l.ready.front());
+                l.ready.pop_front();
+                co->transfer = make_any<ANY_TYPE_NONE, none>(none());
+                if (!coro_resume(*this, *co))
+                {
+                    return false;
+                }
+                // a yield in a loop coroutine only lets the others have a turn
+                if (co->status == CORO_SUSPENDED && !co->parked)
+                {
+                    l.ready.push_back(std::move(co));
+                }
+                continue;
+            }
+            if (l.fds.size() == 0 && l.timers.size() == 0)
+            {
+                return false;
+            }
+            int timeout = -1;
+            if (l.timers.size() != 0)
+            {
+                uint64_t now = profile_now();
+                uint64_t first = l.timers.begin()->first;
+                timeout = first <= now ? 0 : (first - now + 999999) / 1000000;
+            }
+            epoll_event events[64];
+            int count = epoll_wait(l.epoll, events, 64, timeout);
+            for (int i = 0; i < count; i++)
+            {
+                std::unordered_map<int, std::shared_ptr<coro_state>>::iterator found = l.fds.find(events[i].data.fd);
+                if (found == l.fds.end())
+                {
+                    continue;
+                }
+                epoll_ctl(l.epoll, EPOLL_CTL_DEL, found->first, nullptr);
+                found->second->parked = false;
+                l.ready.push_back(std::move(found->second));
+                l.fds.erase(found);
+            }
+            uint64_t now = profile_now();
+            while (l.timers.size() != 0 && l.timers.begin()->first <= now)
+            {
+                l.timers.begin()->second->parked = false;
+                l.ready.push_back(std::move(l.timers.begin()->second));
+                l.timers.erase(l.timers.begin());
+            }
+        }
+        return true;
+    }
+
+    // the loop coroutine running on s, or null when it is the main program or a resumed coroutine
+    coro_state *coro_on_loop(state &s)
+    {
+        if (s.coro_now != nullptr && s.coro_now->on_loop)
+        {
+            return s.coro_now;
+        }
+        return nullptr;
+    }
+
+    // waits until fd has something to read, or has been closed at the other end
+    // a loop coroutine is parked so the others run meanwhile, anything else just blocks
+    void coro_wait_read(state &s, int fd)
+    {
+        coro_state *me = coro_on_loop(s);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        // a regular file cannot be waited on, it is always ready
+        if (me == nullptr || epoll_ctl(s.loop->epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            pollfd p = {fd, POLLIN, 0};
+            poll(&p, 1, -1);
+            return;
+        }
+        s.loop->fds[fd] = me->shared_from_this();
+        me->parked = true;
+        coro_suspend(*me);
+    }
+
+    // reads fd until its end, 0 or the errno it failed with
+    int coro_read_all(state &s, int fd, std::string &out)
+    {
+        while (true)
+        {
+            uint64_t have = out.size();
+            out.resize(have + 65536);
+            ssize_t got = read(fd, &out[have], 65536);
+            out.resize(have + (got > 0 ? got : 0));
+            if (got > 0)
+            {
+                continue;
+            }
+            if (got == 0)
+            {
+                return 0;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                coro_wait_read(s, fd);
+            }
+            else if (errno != EINTR)
+            {
+                return errno;
+            }
+        }
+    }
+
+    std::shared_ptr<coro_state> coro_make(state *s, args_view args)
+    {
+        std::shared_ptr<coro_state> co = std::make_shared<coro_state>();
+        co->owner = s;
+        co->fn = args[0];
+        co->args.assign(args.begin()+1, args.end());
+        return co;
+    }
+
+    // (coro f args ...) is a coroutine that calls f on args once it is first resumed
+    fn_ret builtin_coro(state *s, args_view args)
+    {
+        return make_any<ANY_TYPE_CORO, std::shared_ptr<coro_state>>(coro_make(s, args));
+    }
+
+    // (resume c v) runs c until it yields and gives back what it yielded, or until it ends and gives back what f did
+    // the yield c stopped at gives back v, or none when v is left out
+    fn_ret builtin_resume(state *s, args_view args)
+    {
+        std::shared_ptr<coro_state> co = any_ref<std::shared_ptr<coro_state>>(args[0]);
+        if (co->owner != s)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the coroutine belongs to another task"s));
+        }
+        if (co->on_loop)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("a coroutine made by async is run by the event loop, await it instead"s));
+        }
+        if (co->status == CORO_RUNNING)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the coroutine is already running"s));
+        }
+        if (co->status == CORO_DONE || co->status == CORO_FAILED)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the coroutine has ended"s));
+        }
+        co->transfer = args.size() > 1 ? args[1] : make_any<ANY_TYPE_NONE, none>(none());
+        if (!coro_resume(*s, *co))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("out of memory for a coroutine stack"s));
+        }
+        if (co->status == CORO_FAILED)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("coroutine failed"s));
+        }
+        if (co->status == CORO_DONE)
+        {
+            return co->result;
+        }
+        anything got = std::move(co->transfer);
+        co->transfer = make_any<ANY_TYPE_NONE, none>(none());
+        return got;
+    }
+
+    // (yield v) stops the coroutine it is in and the resume that ran it gives back v
+    // it gives back what the next resume passes in, in an async coroutine it lets the others run and gives back none
+    fn_ret builtin_yield(state *s, args_view args)
+    {
+        coro_state *co = s->coro_now;
+        if (co == nullptr)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("yield outside a coroutine"s));
+        }
+        co->transfer = args.size() != 0 ? args[0] : make_any<ANY_TYPE_NONE, none>(none());
+        coro_suspend(*co);
+        anything got = std::move(co->transfer);
+        co->transfer = make_any<ANY_TYPE_NONE, none>(none());
+        return got;
+    }
+
+    // (done c) is true once c has ended, failed or not
+    fn_ret builtin_done(state *s, args_view args)
+    {
+        coro_status status = any_ref<std::shared_ptr<coro_state>>(args[0])->status;
+        return make_any<ANY_TYPE_BOOL, bool>(status == CORO_DONE || status == CORO_FAILED);
+    }
+
+    // (collect c) resumes c until it ends and gives back the list of what it yielded, c used as a generator
+    fn_ret builtin_collect(state *s, args_view args)
+    {
+        anything handle = args[0];
+        std::shared_ptr<coro_state> co = any_ref<std::shared_ptr<coro_state>>(handle);
+        std::vector<anything> out;
+        while (co->status != CORO_DONE)
+        {
+            anything got = builtin_resume(s, {&handle, 1});
+            if (is_a_any<ANY_TYPE_ERROR>(got))
+            {
+                return got;
+            }
+            if (co->status != CORO_DONE)
+            {
+                out.push_back(std::move(got));
+            }
+        }
+        return make_any<ANY_TYPE_LIST, std::vector<anything>>(std::move(out));
+    }
+
+    // (async f args ...) is a coroutine the event loop runs, it starts once something awaits
+    fn_ret builtin_async(state *s, args_view args)
+    {
+        if (!s->loop)
+        {
+            s->loop = std::make_unique<coro_loop>();
+            if (s->loop->epoll < 0)
+            {
+                s->loop.reset();
+                return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot make an epoll: "s + strerror(errno)));
+            }
+        }
+        std::shared_ptr<coro_state> co = coro_make(s, args);
+        co->on_loop = true;
+        s->loop->ready.push_back(co);
+        return make_any<ANY_TYPE_CORO, std::shared_ptr<coro_state>>(co);
+    }
+
+    // (await c) waits for an async coroutine to end and gives back what its call did
+    // in an async coroutine it parks until then, anywhere else it runs the event loop until then
+    fn_ret builtin_await(state *s, args_view args)
+    {
+        std::shared_ptr<coro_state> co = any_ref<std::shared_ptr<coro_state>>(args[0]);
+        if (!co->on_loop)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("await takes a coroutine made by async"s));
+        }
+        if (co->owner != s)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the coroutine belongs to another task"s));
+        }
+        coro_state *me = coro_on_loop(*s);
+        if (co.get() == s->coro_now)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("a coroutine cannot await itself"s));
+        }
+        if (co->status != CORO_DONE && co->status != CORO_FAILED)
+        {
+            if (me != nullptr)
+            {
+                co->waiters.push_back(me->shared_from_this());
+                me->parked = true;
+                coro_suspend(*me);
+            }
+            else if (!s->loop_run(co.get()))
+            {
+                return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("await on a coroutine that can never end"s));
+            }
+        }
+        if (co->status == CORO_FAILED)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("coroutine failed"s));
+        }
+        return co->result;
+    }
+
+    // (sleep ms) parks an async coroutine for ms milliseconds, anywhere else it just waits that long
+    fn_ret builtin_sleep(state *s, args_view args)
+    {
+        if (!is_small_int(args[0]) || args[0].num < 0)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("sleep takes a number of milliseconds"s));
+        }
+        coro_state *me = coro_on_loop(*s);
+        if (me == nullptr)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(args[0].num));
+            return make_any<ANY_TYPE_NONE, none>(none());
+        }
+        s->loop->timers.emplace(profile_now() + uint64_t(args[0].num) * 1000000, me->shared_from_this());
+        me->parked = true;
+        coro_suspend(*me);
+        return make_any<ANY_TYPE_NONE, none>(none());
+    }
+
+    // (read-file path) is all of the file at path as a str
+    // an async coroutine reading a pipe or socket is parked while it is empty, regular files are read straight
+    fn_ret builtin_read_file(state *s, args_view args)
+    {
+        const std::string &path = any_ref<std::string>(args[0]);
+        int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot open "s + path + ": " + strerror(errno)));
+        }
+        std::string out;
+        int err = coro_read_all(*s, fd, out);
+        close(fd);
+        if (err != 0)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot read "s + path + ": " + strerror(err)));
+        }
+        return make_any<ANY_TYPE_STR, std::string>(std::move(out));
+    }
+
+    // (read-cmd cmd) runs cmd with sh and gives back what it wrote to stdout
+    // an async coroutine is parked while the command has written nothing new
+    fn_ret builtin_read_cmd(state *s, args_view args)
+    {
+        const std::string &cmd = any_ref<std::string>(args[0]);
+        FILE *pipe = popen(cmd.c_str(), "r");
+        if (pipe == nullptr)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot run "s + cmd + ": " + strerror(errno)));
+        }
+        int fd = fileno(pipe);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        std::string out;
+        int err = coro_read_all(*s, fd, out);
+        pclose(pipe);
+        if (err != 0)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot read from "s + cmd + ": " + strerror(err)));
+        }
+        return make_any<ANY_TYPE_STR, std::string>(std::move(out));
+    }
+
+    native_fn native_coro = {"coro", builtin_coro, 1, native_variadic, {}};
+    native_fn native_resume = {"resume", builtin_resume, 1, 2, {1 << ANY_TYPE_CORO}};
+    native_fn native_yield = {"yield", builtin_yield, 0, 1, {}};
+    native_fn native_done = {"done", builtin_done, 1, 1, {1 << ANY_TYPE_CORO}};
+    native_fn native_collect = {"collect", builtin_collect, 1, 1, {1 << ANY_TYPE_CORO}};
+    native_fn native_async = {"async", builtin_async, 1, native_variadic, {}};
+    native_fn native_await = {"await", builtin_await, 1, 1, {1 << ANY_TYPE_CORO}};
+    native_fn native_sleep = {"sleep", builtin_sleep, 1, 1, {1 << ANY_TYPE_INT}};
+    native_fn native_read_file = {"read-file", builtin_read_file, 1, 1, {1 << ANY_TYPE_STR}};
+    native_fn native_read_cmd = {"read-cmd", builtin_read_cmd, 1, 1, {1 << ANY_TYPE_STR}};
+}
@@ -6,11 +6,21 @@
 #include <fstream>
 #include <sstream>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <ext/atomicity.h>
+#include <deque>
 #include <chrono>
 #include <memory>
 #include <vector>
 #include <stack>
+#include <unordered_map>
 #include <set>
+#include <array>
+#include <string_view>
+#include <map>
+#include <type_traits>
 // #include <boost/any.hpp>
 #include <boost/optional.hpp>
 #include <boost/multiprecision/gmp.hpp>
@@ -27,8 +37,14 @@ namespace lang
     struct node;
     struct anything;
     struct user_fn;
+    struct native_fn;
+    struct profile_data;
+    struct jit_data;
+    struct spawn_image;
+    struct coro_state;
+    struct coro_loop;
 
-    using table_type = std::vector<std::pair<anything, anything>>;
+    struct table_type;
 
     enum any_type
     {
@@ -43,12 +59,28 @@ namespace lang
         ANY_TYPE_ERROR = 8,
         ANY_TYPE_NONE = 9,
         ANY_TYPE_DATA = 10,
+        ANY_TYPE_UNBOUND = 11, // never seen by user code, marks an empty global slot
+        ANY_TYPE_NATIVE = 12, // a builtin using the native_fn calling convention
+        ANY_TYPE_DOUBLE = 13, // an ieee double, written 1.5d, decimal literals without the d stay rationals
+        ANY_TYPE_TASK = 14, // a spawned call, see lang-task.hpp
+        ANY_TYPE_CHAN = 15, // a bounded channel between tasks
+        ANY_TYPE_CORO = 16, // a coroutine, see lang-coro.hpp
+        ANY_TYPE_INTS = 17, // a packed array of machine ints, see lang-array.hpp
+        ANY_TYPE_DOUBLES = 18, // a packed array of doubles
+        ANY_TYPE_BYTES = 19, // a packed array of bytes
+        ANY_TYPE_COUNT, // not a type, new types go above
     };
 
     template<typename T>
-    T any_fast(anything);
+    T any_fast(const anything &);
     template<typename T>
-    T any_fast_ptr(anything &);
+    T *any_fast_ptr(anything &);
+    template<typename T>
+    const T &any_ref(const anything &);
+    template<typename T>
+    struct box_edit;
+    template<typename T>
+    box_edit<T> any_mut(anything &);
     template<any_type Tc, typename T>
     anything make_any(T);
     using opcode_vec = std::vector<opcode>;
@@ -58,7 +90,23 @@ namespace lang
     using tokens = std::vector<token>; // vector of token often often used
     mpq_rational strtorat(std::string);
     table_type generate();
-    std::string walknode(node);
+    std::vector<void *> quick_builtins(table_type &);
+
+    // what the arithmetic builtins do to packed arrays, see lang-array.hpp
+    enum array_op
+    {
+        ARRAY_NONE,
+        ARRAY_ADD,
+        ARRAY_SUB,
+        ARRAY_MUL,
+        ARRAY_DIV,
+    };
+    bool is_array(const anything &);
+    fn_ret array_arith(const char *, array_op, aty2);
+    fn_ret array_index(const anything &, int64_t);
+    std::string array_str(const anything &);
+    std::string any_type_name(uint64_t);
+    std::string walknode(const state &, const node &);
     anything get_table(table_type &, anything &);
     template<any_type Tc, typename T>
     anything get_table_type(table_type &, anything &);
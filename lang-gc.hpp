@@ -0,0 +1,220 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <chrono>
+
+namespace lang
+{
+    // reference counts free everything except cycles through tables and lists, those are found by trial deletion
+    // this only adds cycle collection, every copy of a value still pays for the atomic reference count
+    // a container whose use_count is not all explained by references from the other containers being
+    // collected is held from outside them (vm_stack, globals, helpers, a native's locals, a closure ...)
+    // so it and everything it reaches is live, the rest only holds itself up and is cleared
+    // this needs no list of roots, so a value no one knows how to trace is never freed from under its holder
+    // each one holds a weak count on its box, so the memory stays until the collector has looked at it
+    struct gc_box
+    {
+        box_head *box;
+        uint64_t type;
+    };
+
+    // containers are young until they live through a collection, young collections leave old ones alone
+    // references from old containers count as outside ones, so a young collection never frees too much
+    struct gc_heap
+    {
+        std::vector<gc_box> young;
+        std::vector<gc_box> old;
+        uint64_t young_limit = 4096; // young containers that start a collection
+        uint64_t old_limit = 4096; // old containers that make the next collection a full one
+        bool due = false; // set by gc_track, run collects at its next safepoint
+
+        ~gc_heap()
+        {
+            for (gc_box &b: young)
+            {
+                box_unweak(b.box);
+            }
+            for (gc_box &b: old)
+            {
+                box_unweak(b.box);
+            }
+        }
+    };
+
+    // every thread has its own, frozen boxes are the only ones that go between threads and they are never tracked
+    thread_local gc_heap gc;
+
+    // calls f on every anything a table or list holds
+    template<typename F>
+    void gc_children(void *box, uint64_t type, F f)
+    {
+        if (type == ANY_TYPE_TABLE)
+        {
+            table_type *t = static_cast<table_type *>(box);
+            for (anything &a: t->array)
+            {
+                f(a);
+            }
+            for (std::pair<anything, anything> &kvp: t->entries)
+            {
+                f(kvp.first);
+                f(kvp.second);
+            }
+        }
+        else
+        {
+            for (anything &a: *static_cast<std::vector<anything> *>(box))
+            {
+                f(a);
+            }
+        }
+    }
+
+    bool gc_tracked(const anything &a)
+    {
+        return a.boxed && (a.type == ANY_TYPE_TABLE || a.type == ANY_TYPE_LIST);
+    }
+
+    // returns the number of containers freed
+    uint64_t gc_collect(bool full)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<gc_box> boxes;
+        boxes.swap(gc.young);
+        if (full)
+        {
+            boxes.insert(boxes.end(), gc.old.begin(), gc.old.end());
+            gc.old.clear();
+        }
+        // held so nothing is freed while the counts are taken, dead ones are dropped here
+        // a tracked box is never frozen, so no other thread can take a strong reference while this runs
+        std::vector<anything> held;
+        std::vector<uint64_t> types;
+        std::unordered_map<void *, uint64_t> index;
+        for (gc_box &b: boxes)
+        {
+            if (b.box->strong != 0)
+            {
+                box_retain(b.box);
+                anything p;
+                p.ptr = reinterpret_cast<char *>(b.box) + sizeof(box_head);
+                p.type = b.type;
+                p.boxed = 1;
+                index[p.ptr] = held.size();
+                held.push_back(std::move(p));
+                types.push_back(b.type);
+            }
+            box_unweak(b.box);
+        }
+        boxes.clear();
+        uint64_t count = held.size();
+        std::vector<int64_t> refs(count);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            refs[i] = held[i].use_count() - 1;
+        }
+        for (uint64_t i = 0; i < count; i++)
+        {
+            gc_children(held[i].ptr, types[i], [&](anything &a) {
+                if (gc_tracked(a))
+                {
+                    std::unordered_map<void *, uint64_t>::iterator found = index.find(a.val());
+                    if (found != index.end())
+                    {
+                        refs[found->second] --;
+                    }
+                }
+            });
+        }
+        std::vector<bool> live(count, false);
+        std::vector<uint64_t> todo;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (refs[i] > 0)
+            {
+                live[i] = true;
+                todo.push_back(i);
+            }
+        }
+        while (todo.size() != 0)
+        {
+            uint64_t i = todo.back();
+            todo.pop_back();
+            gc_children(held[i].ptr, types[i], [&](anything &a) {
+                if (gc_tracked(a))
+                {
+                    std::unordered_map<void *, uint64_t>::iterator found = index.find(a.val());
+                    if (found != index.end() && !live[found->second])
+                    {
+                        live[found->second] = true;
+                        todo.push_back(found->second);
+                    }
+                }
+            });
+        }
+        // the garbage is only freed once held goes, after every cycle has been cut
+        uint64_t freed = 0;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (live[i])
+            {
+                gc_box b{held[i].head(), types[i]};
+                __gnu_cxx::__atomic_add_dispatch(&b.box->weak, 1);
+                gc.old.push_back(b);
+            }
+            else if (types[i] == ANY_TYPE_TABLE)
+            {
+                *static_cast<table_type *>(held[i].ptr) = table_type();
+                freed ++;
+            }
+            else
+            {
+                std::vector<anything>().swap(*static_cast<std::vector<anything> *>(held[i].ptr));
+                freed ++;
+            }
+        }
+        held.clear();
+        if (full)
+        {
+            gc.old_limit = std::max<uint64_t>(4096, gc.old.size() * 2);
+        }
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        (full ? gc_totals.full : gc_totals.young) ++;
+        gc_totals.freed += freed;
+        gc_totals.pause_ns += ns;
+        gc_totals.max_pause_ns = std::max(gc_totals.max_pause_ns, ns);
+        return freed;
+    }
+
+    // called by make_any for every new table and list
+    // it never collects, the builtin making the container may still hold others only through raw references
+    void gc_track(const anything &a)
+    {
+        gc_heap &heap = gc; // one lookup of the thread local
+        __gnu_cxx::__atomic_add_dispatch(&a.head()->weak, 1);
+        heap.young.push_back(gc_box{a.head(), a.type});
+        if (heap.young.size() >= heap.young_limit)
+        {
+            heap.due = true;
+        }
+    }
+
+    // called by run, reg_run and the jit once a builtin has returned and its result is on the stack
+    // containers are only made inside builtins, so this sees every one that is due
+    void gc_safepoint()
+    {
+        gc_heap &heap = gc;
+        if (heap.due)
+        {
+            heap.due = false;
+            gc_collect(heap.old.size() >= heap.old_limit);
+        }
+    }
+
+    // (gc) runs a full collection now and returns how many containers it freed
+    fn_ret builtin_gc(state *s, args_view args)
+    {
+        return make_any<ANY_TYPE_INT, mpz_int>(mpz_int(gc_collect(true)));
+    }
+
+    native_fn native_gc = {"gc", builtin_gc, 0, 0, {}};
+}
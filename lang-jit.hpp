@@ -0,0 +1,949 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+
+// the baseline jit only knows x86-64 and needs mmap, define LANG_NO_JIT to leave it out
+#if defined(__x86_64__) && defined(__unix__) && !defined(LANG_NO_JIT)
+#define LANG_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#include <exception>
+
+// from libgcc, tells the unwinder about .eh_frame data that no loaded object has
+extern "C" void __register_frame(void *);
+extern "C" void __deregister_frame(void *);
+#endif
+
+namespace lang
+{
+    // a range of opcodes that has been compiled, the body of a user function or of a while loop
+    // the compiled code keeps nothing in registers between ops, vm_stack and ret_stack are the same
+    // as if run had done the ops, so it can go back to run before any op and come in again at any op
+    struct jit_unit
+    {
+        uint64_t first;
+        uint64_t last; // the op at last is compiled too
+        bool loop;
+        void *code = nullptr;
+        uint64_t bytes = 0;
+        uint64_t mapped = 0; // bytes rounded up to whole pages
+        uint64_t entries = 0; // calls, returns and loop starts that went into it through jit_entry
+        uint64_t exits = 0; // times it went back to run
+        std::vector<uint8_t> frame; // the .eh_frame registered for code, so exceptions from helpers unwind through it
+    };
+
+    struct jit_data
+    {
+        std::vector<void *> code; // per place, where to come into compiled code, nullptr where it cannot
+        std::vector<jit_unit *> owner; // per place, the unit code is in
+        std::vector<uint64_t> counts; // per place, calls and loop trips seen before compiling there
+        std::vector<std::unique_ptr<jit_unit>> units; // the compiled code points at the exit counts
+        void *enter = nullptr; // uint64_t enter(state *, void *code), returns the place run goes on at
+        uint64_t exit_place = 0; // set by a helper that returns jit_leave
+        uint64_t compile_ns = 0;
+        uint64_t failed = 0; // ranges that could not be compiled, run keeps them
+
+        ~jit_data();
+    };
+
+    // returned by the helpers that change where the code goes on, to go back to run at exit_place
+    void *const jit_leave = reinterpret_cast<void *>(1);
+
+    // how many calls of a function or trips around a loop run makes before compiling it
+    const uint64_t jit_threshold = 100;
+
+    const uint64_t no_place = -1;
+
+    // the RET that ends the body of the user function at fn, or no_place
+    uint64_t jit_fn_last(const opcode_vec &ops, uint64_t fn)
+    {
+        if (fn < ops.size() && ops[fn].type == OPCODE_TYPE_JMP && ops[fn].helper < ops.size()
+            && ops[ops[fn].helper].type == OPCODE_TYPE_RET)
+        {
+            return ops[fn].helper;
+        }
+        return no_place;
+    }
+
+#ifdef LANG_JIT
+    jit_data::~jit_data()
+    {
+        for (std::unique_ptr<jit_unit> &unit: units)
+        {
+            __deregister_frame(unit->frame.data());
+            munmap(unit->code, unit->mapped);
+        }
+        if (enter != nullptr)
+        {
+            munmap(enter, sysconf(_SC_PAGESIZE));
+        }
+    }
+
+    // copies code into pages of its own that are made executable once they are no longer writable
+    void *jit_map(const std::vector<uint8_t> &code, uint64_t &bytes)
+    {
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        bytes = (code.size() + page - 1) / page * page;
+        void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, bytes, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(mem, bytes);
+            return nullptr;
+        }
+        return mem;
+    }
+
+    // just enough of an x86-64 assembler for jit_compile
+    struct jit_asm
+    {
+        std::vector<uint8_t> code;
+
+        uint64_t size() const
+        {
+            return code.size();
+        }
+
+        void bytes(std::initializer_list<uint8_t> b)
+        {
+            code.insert(code.end(), b);
+        }
+
+        void imm32(uint32_t v)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                code.push_back(v >> (i * 8));
+            }
+        }
+
+        void imm64(uint64_t v)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                code.push_back(v >> (i * 8));
+            }
+        }
+
+        // mov reg, v for rax (0) or rsi (6)
+        void mov(uint8_t reg, uint64_t v)
+        {
+            if (v <= 0xffffffff)
+            {
+                bytes({uint8_t(0xb8 + reg)});
+                imm32(v);
+            }
+            else
+            {
+                bytes({0x48, uint8_t(0xb8 + reg)});
+                imm64(v);
+            }
+        }
+
+        // fn(state, a)
+        template<typename F>
+        void call(F *fn, uint64_t a = 0)
+        {
+            bytes({0x48, 0x89, 0xdf}); // mov rdi, rbx
+            mov(6, a);
+            bytes({0x48, 0xb8}); // mov rax, fn
+            imm64(reinterpret_cast<uint64_t>(fn));
+            bytes({0xff, 0xd0}); // call rax
+        }
+
+        // jcc rel32 with cc 0x84 for jz and 0x85 for jnz, or jmp rel32 with cc 0
+        // returns where the rel32 is, for patch
+        uint64_t jump(uint8_t cc)
+        {
+            if (cc == 0)
+            {
+                bytes({0xe9});
+            }
+            else
+            {
+                bytes({0x0f, cc});
+            }
+            imm32(0);
+            return size()-4;
+        }
+
+        void patch(uint64_t at, uint64_t to)
+        {
+            uint32_t rel = uint32_t(int32_t(int64_t(to) - int64_t(at + 4)));
+            memcpy(&code[at], &rel, 4);
+        }
+    };
+
+    // a cie and one fde covering code, for __register_frame
+    // all compiled code runs with rbx pushed under the return address into jit_run and calls nothing
+    // that needs more, so one rule holds everywhere in it: the cfa is rsp+16 and rbx is saved below
+    // the return address
+    std::vector<uint8_t> jit_eh_frame(const void *code, uint64_t bytes)
+    {
+        jit_asm f;
+        f.imm32(20); // cie length
+        f.imm32(0); // cie id
+        f.bytes({1, 'z', 'R', 0}); // version and augmentation
+        f.bytes({1, 0x78, 16}); // code alignment 1, data alignment -8, return address in r16
+        f.bytes({1, 0x00}); // augmentation data, pointers are absolute
+        f.bytes({0x0c, 7, 16}); // def_cfa rsp+16
+        f.bytes({0x90, 1}); // the return address at cfa-8
+        f.bytes({0x83, 2}); // rbx at cfa-16
+        f.imm32(24); // fde length
+        f.imm32(f.size()); // back to the cie
+        f.imm64(reinterpret_cast<uint64_t>(code));
+        f.imm64(bytes);
+        f.bytes({0, 0, 0, 0}); // no augmentation data, the cie rules hold, padding
+        f.imm32(0); // the terminator
+        return f.code;
+    }
+
+    // the helpers returning bool give false to go back to run at the op before it has done anything
+    // the ones returning void * give nullptr to go on with the next op, jit_leave to go back to run
+    // at exit_place, or the compiled code to go on at
+    bool jit_argc(state *s, uint64_t argc)
+    {
+        return s->ret_stack[s->ret_stack.size()-1].argc == argc;
+    }
+
+    void jit_begin_space(state *s, uint64_t count)
+    {
+        frame &f = s->ret_stack[s->ret_stack.size()-1];
+        anything empty = make_any<ANY_TYPE_NONE, none>(none());
+        s->vm_stack.resize(s->vm_stack.size() + count, empty);
+        f.top = s->vm_stack.size();
+    }
+
+    void *jit_ret(state *s, uint64_t)
+    {
+        frame f = s->ret_stack[s->ret_stack.size()-1];
+        s->ret_stack.pop_back();
+        anything got;
+        if (s->vm_stack.size() > f.top)
+        {
+            got = s->vm_stack[s->vm_stack.size()-1];
+        }
+        else
+        {
+            got = make_any<ANY_TYPE_NONE, none>(none());
+        }
+        s->vm_stack.erase(s->vm_stack.begin() + (f.base-1), s->vm_stack.end());
+        s->vm_stack.push_back(got);
+        return s->jit_target(f.ret+1, no_place);
+    }
+
+    void jit_push_val(state *s, uint64_t helper)
+    {
+        s->vm_stack.push_back(s->helpers[helper]);
+    }
+
+    bool jit_push_name(state *s, uint64_t helper)
+    {
+        anything value = s->load_global(s->helpers[helper]);
+        if (is_a_any<ANY_TYPE_ERROR>(value))
+        {
+            return false;
+        }
+        s->vm_stack.push_back(value);
+        return true;
+    }
+
+    bool jit_load_global(state *s, uint64_t slot)
+    {
+        anything &value = s->global_vals[slot];
+        if (is_a_any<ANY_TYPE_UNBOUND>(value))
+        {
+            return false;
+        }
+        s->vm_stack.push_back(value);
+        return true;
+    }
+
+    void jit_store_global(state *s, uint64_t slot)
+    {
+        s->global_vals[slot] = s->vm_stack[s->vm_stack.size()-1];
+    }
+
+    void jit_store_global_pop(state *s, uint64_t slot)
+    {
+        s->global_vals[slot] = std::move(s->vm_stack[s->vm_stack.size()-1]);
+        s->vm_stack.pop_back();
+    }
+
+    void jit_load_local(state *s, uint64_t slot)
+    {
+        s->vm_stack.push_back(s->vm_stack[s->ret_stack[s->ret_stack.size()-1].base + slot]);
+    }
+
+    void jit_store_local(state *s, uint64_t slot)
+    {
+        s->vm_stack[s->ret_stack[s->ret_stack.size()-1].base + slot] = s->vm_stack[s->vm_stack.size()-1];
+    }
+
+    void jit_store_local_pop(state *s, uint64_t slot)
+    {
+        s->vm_stack[s->ret_stack[s->ret_stack.size()-1].base + slot] = std::move(s->vm_stack[s->vm_stack.size()-1]);
+        s->vm_stack.pop_back();
+    }
+
+    void jit_pop(state *s, uint64_t)
+    {
+        s->vm_stack.pop_back();
+    }
+
+    void jit_defun(state *s, uint64_t fn)
+    {
+        user_fn f;
+        f.op_place = fn;
+        s->vm_stack.push_back(make_any<ANY_TYPE_USER_FN, user_fn>(f));
+    }
+
+    // true when the jump is taken
+    bool jit_jmp_if(state *s, uint64_t)
+    {
+        anything &val = s->vm_stack[s->vm_stack.size()-1];
+        bool jump = !is_a_any<ANY_TYPE_BOOL>(val) || val.flag;
+        s->vm_stack.pop_back();
+        return jump;
+    }
+
+    bool jit_jmp_if_not(state *s, uint64_t)
+    {
+        anything &val = s->vm_stack[s->vm_stack.size()-1];
+        bool jump = !is_a_any<ANY_TYPE_BOOL>(val) || !val.flag;
+        s->vm_stack.pop_back();
+        return jump;
+    }
+
+    // goes back to run at place without having done anything, run does the op again and reports
+    // the error or deopts the site
+    void *jit_redo(state *s, uint64_t place)
+    {
+        s->jit->exit_place = place;
+        return jit_leave;
+    }
+
+    // an error from a builtin, run fails as soon as it sees it
+    void *jit_fail(state *s, const anything &got, uint64_t place)
+    {
+        if (is_a_any<ANY_TYPE_ERROR>(got))
+        {
+            s->errors.push(any_ref<errors::str_error>(got));
+        }
+        return jit_redo(s, place);
+    }
+
+    // calls the builtin under the top argc values, which are popped, and leaves the result in its place
+    void *jit_builtin(state *s, anything &fncall, uint64_t argc, uint64_t place)
+    {
+        if (is_a_any<ANY_TYPE_FUNC>(fncall))
+        {
+            fn_ret got = s->call_func(fncall, argc);
+            if (is_a_any<ANY_TYPE_ERROR>(got) || s->errors.size() > 0)
+            {
+                return jit_fail(s, got, place);
+            }
+            s->vm_stack[s->vm_stack.size()-1] = std::move(got);
+            gc_safepoint();
+            return nullptr;
+        }
+        fn_ret got = s->call_native(fncall.native, argc);
+        if (is_a_any<ANY_TYPE_ERROR>(got) || s->errors.size() > 0)
+        {
+            return jit_fail(s, got, place);
+        }
+        s->vm_stack.resize(s->vm_stack.size()-argc);
+        s->vm_stack[s->vm_stack.size()-1] = std::move(got);
+        gc_safepoint();
+        return nullptr;
+    }
+
+    void *jit_call(state *s, uint64_t place);
+
+    // the quickened ops, they are read at run time since run can still quicken or deopt the site
+    void *jit_quick(state *s, uint64_t place)
+    {
+        opcode *op = &s->opcodes[place];
+        anything *args = &s->vm_stack[s->vm_stack.size()-3];
+        switch (op->type)
+        {
+            case OPCODE_TYPE_INT_ADD:
+            case OPCODE_TYPE_INT_SUB:
+            case OPCODE_TYPE_INT_MUL:
+            case OPCODE_TYPE_INT_LT:
+            case OPCODE_TYPE_INT_GT:
+            case OPCODE_TYPE_INT_LTE:
+            case OPCODE_TYPE_INT_GTE:
+            case OPCODE_TYPE_INT_EQ:
+            {
+                if (args[0].val() != s->quick_fns[quick_kind_of(op->type)]
+                    || !is_a_any<ANY_TYPE_INT>(args[1]) || !is_a_any<ANY_TYPE_INT>(args[2]))
+                {
+                    return jit_redo(s, place);
+                }
+                if (!quick_int(op->type, args[1], args[2], args[0]))
+                {
+                    return jit_builtin(s, args[0], 2, place);
+                }
+                break;
+            }
+            case OPCODE_TYPE_RAT_ADD:
+            case OPCODE_TYPE_RAT_MUL:
+            {
+                if (args[0].val() != s->quick_fns[quick_kind_of(op->type)]
+                    || !is_a_any<ANY_TYPE_RAT>(args[1]) || !is_a_any<ANY_TYPE_RAT>(args[2]))
+                {
+                    return jit_redo(s, place);
+                }
+                const mpq_rational &lhs = any_ref<mpq_rational>(args[1]);
+                const mpq_rational &rhs = any_ref<mpq_rational>(args[2]);
+                if (op->type == OPCODE_TYPE_RAT_ADD)
+                {
+                    args[0] = make_any<ANY_TYPE_RAT, mpq_rational>(lhs + rhs);
+                }
+                else
+                {
+                    args[0] = make_any<ANY_TYPE_RAT, mpq_rational>(lhs * rhs);
+                }
+                break;
+            }
+            case OPCODE_TYPE_STR_CONCAT:
+            {
+                if (args[0].val() != s->quick_fns[QUICK_ADD]
+                    || !is_a_any<ANY_TYPE_STR>(args[1]) || !is_a_any<ANY_TYPE_STR>(args[2]))
+                {
+                    return jit_redo(s, place);
+                }
+                args[0] = str_concat(args[1], args[2]);
+                break;
+            }
+            case OPCODE_TYPE_DBL_ADD:
+            case OPCODE_TYPE_DBL_SUB:
+            case OPCODE_TYPE_DBL_MUL:
+            case OPCODE_TYPE_DBL_LT:
+            case OPCODE_TYPE_DBL_GT:
+            case OPCODE_TYPE_DBL_LTE:
+            case OPCODE_TYPE_DBL_GTE:
+            case OPCODE_TYPE_DBL_EQ:
+            {
+                quick_kind kind = quick_kind_of(op->type);
+                if (args[0].val() != s->quick_fns[kind]
+                    || !is_a_any<ANY_TYPE_DOUBLE>(args[1]) || !is_a_any<ANY_TYPE_DOUBLE>(args[2]))
+                {
+                    return jit_redo(s, place);
+                }
+                args[0] = double_op(kind, args[1].dbl, args[2].dbl);
+                break;
+            }
+            default:
+            {
+                // deopted since it was compiled
+                return jit_call(s, place);
+            }
+        }
+        s->vm_stack.pop_back();
+        s->vm_stack.pop_back();
+        return nullptr;
+    }
+
+    // FUNC_CALL and TAIL_CALL, the callee is under its arguments
+    void *jit_call(state *s, uint64_t place)
+    {
+        opcode *op = &s->opcodes[place];
+        if (op->type != OPCODE_TYPE_FUNC_CALL && op->type != OPCODE_TYPE_TAIL_CALL)
+        {
+            return jit_quick(s, place);
+        }
+        uint64_t argc = op->helper;
+        if (s->vm_stack.size() < argc+1)
+        {
+            return jit_redo(s, place);
+        }
+        uint64_t from = s->vm_stack.size()-1-argc;
+        anything &fncall = s->vm_stack[from];
+        if (is_a_any<ANY_TYPE_USER_FN>(fncall))
+        {
+            uint64_t target = fncall.place;
+            if (op->type == OPCODE_TYPE_TAIL_CALL)
+            {
+                frame &f = s->ret_stack[s->ret_stack.size()-1];
+                std::move(s->vm_stack.begin()+from, s->vm_stack.end(), s->vm_stack.begin()+(f.base-1));
+                s->vm_stack.resize(f.base+argc);
+                f.argc = argc;
+                f.top = s->vm_stack.size();
+            }
+            else
+            {
+                if (s->ret_stack.size() >= s->max_depth)
+                {
+                    return jit_redo(s, place);
+                }
+                frame f;
+                f.ret = place;
+                f.base = s->vm_stack.size()-argc;
+                f.argc = argc;
+                f.top = s->vm_stack.size();
+                s->ret_stack.push_back(f);
+            }
+            return s->jit_target(target+1, jit_fn_last(s->opcodes, target));
+        }
+        if (is_a_any<ANY_TYPE_FUNC>(fncall))
+        {
+            if (argc == 2 && (op->extra & ~quick_from_tail) < 4 && s->opts.quicken)
+            {
+                opcode_type quick = s->quicken(fncall, s->vm_stack[from+1], s->vm_stack[from+2]);
+                if (quick != OPCODE_TYPE_FUNC_CALL)
+                {
+                    if (op->type == OPCODE_TYPE_TAIL_CALL)
+                    {
+                        op->extra |= quick_from_tail;
+                    }
+                    op->type = quick;
+                    return jit_quick(s, place);
+                }
+            }
+            return jit_builtin(s, fncall, argc, place);
+        }
+        if (is_a_any<ANY_TYPE_NATIVE>(fncall))
+        {
+            return jit_builtin(s, fncall, argc, place);
+        }
+        return jit_redo(s, place);
+    }
+
+    // CALL_GLOBAL_TOP and FUNC_CALL_TOP, the callee is not under the arguments
+    void *jit_call_top(state *s, uint64_t place)
+    {
+        opcode *op = &s->opcodes[place];
+        bool global = op->type == OPCODE_TYPE_CALL_GLOBAL_TOP;
+        uint64_t argc = global ? op->extra : op->helper;
+        if (s->vm_stack.size() < (global ? argc : argc+1))
+        {
+            return jit_redo(s, place);
+        }
+        anything fncall = global ? s->global_vals[op->helper] : s->vm_stack[s->vm_stack.size()-1];
+        if (global && is_a_any<ANY_TYPE_USER_FN>(fncall))
+        {
+            if (s->ret_stack.size() >= s->max_depth)
+            {
+                return jit_redo(s, place);
+            }
+            s->vm_stack.insert(s->vm_stack.end()-argc, fncall);
+            frame f;
+            f.ret = place;
+            f.base = s->vm_stack.size()-argc;
+            f.argc = argc;
+            f.top = s->vm_stack.size();
+            s->ret_stack.push_back(f);
+            return s->jit_target(fncall.place+1, jit_fn_last(s->opcodes, fncall.place));
+        }
+        if (!is_a_any<ANY_TYPE_FUNC>(fncall) && !is_a_any<ANY_TYPE_NATIVE>(fncall))
+        {
+            return jit_redo(s, place);
+        }
+        if (global)
+        {
+            // the builtin goes where run would have left it, under the arguments, and is replaced by the result
+            s->vm_stack.insert(s->vm_stack.end()-argc, fncall);
+        }
+        else if (argc != 0)
+        {
+            std::rotate(s->vm_stack.end()-argc-1, s->vm_stack.end()-1, s->vm_stack.end());
+        }
+        return jit_builtin(s, s->vm_stack[s->vm_stack.size()-1-argc], argc, place);
+    }
+
+    // a rel32 in compiled code that is filled in once every op has been compiled
+    struct jit_jump
+    {
+        uint64_t at;
+        uint64_t to; // the place it goes to
+        bool redo; // back to run at to even when to is compiled, for ops the code could not do
+    };
+
+    // an operand that a quickened op can read where it is instead of from vm_stack
+    bool jit_plain(const opcode &op)
+    {
+        return op.type == OPCODE_TYPE_PUSH_VAL || op.type == OPCODE_TYPE_LOAD_LOCAL || op.type == OPCODE_TYPE_LOAD_GLOBAL;
+    }
+
+    const anything &jit_operand(state *s, const opcode &op)
+    {
+        switch (op.type)
+        {
+            case OPCODE_TYPE_PUSH_VAL: return s->helpers[op.helper];
+            case OPCODE_TYPE_LOAD_LOCAL: return s->vm_stack[s->ret_stack[s->ret_stack.size()-1].base + op.helper];
+            default: return s->global_vals[op.helper];
+        }
+    }
+
+    // LOAD_GLOBAL, two plain operands and the INT_ or DBL_ op at place done in one go, without pushing
+    // the builtin and the operands, false to do the four ops one at a time instead
+    bool jit_fused(state *s, uint64_t place)
+    {
+        const opcode *ops = &s->opcodes[place-3];
+        opcode_type type = ops[3].type;
+        bool dbl = type >= OPCODE_TYPE_DBL_ADD && type <= OPCODE_TYPE_DBL_EQ;
+        if (!dbl && (type < OPCODE_TYPE_INT_ADD || type > OPCODE_TYPE_INT_EQ))
+        {
+            // deopted since it was compiled
+            return false;
+        }
+        quick_kind kind = quick_kind_of(type);
+        if (s->global_vals[ops[0].helper].val() != s->quick_fns[kind])
+        {
+            return false;
+        }
+        const anything &a = jit_operand(s, ops[1]);
+        const anything &b = jit_operand(s, ops[2]);
+        if (dbl)
+        {
+            if (!is_a_any<ANY_TYPE_DOUBLE>(a) || !is_a_any<ANY_TYPE_DOUBLE>(b))
+            {
+                return false;
+            }
+            s->vm_stack.push_back(double_op(kind, a.dbl, b.dbl));
+            return true;
+        }
+        anything got;
+        if (!quick_int(type, a, b, got))
+        {
+            return false;
+        }
+        s->vm_stack.push_back(std::move(got));
+        return true;
+    }
+
+    // compiles first..last, false when there was no memory for it
+    bool state::jit_compile(uint64_t first, uint64_t last, bool loop)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::unique_ptr<jit_unit> unit = std::make_unique<jit_unit>();
+        unit->first = first;
+        unit->last = last;
+        unit->loop = loop;
+        jit_asm a;
+        std::vector<uint64_t> at(last-first+1);
+        std::vector<jit_jump> jumps;
+        std::vector<uint64_t> leaves; // rel32 of each jump to the code that goes back to run at exit_place
+        for (uint64_t p = first; p <= last; p++)
+        {
+            at[p-first] = a.size();
+            opcode &op = opcodes[p];
+            if (p+3 <= last && op.type == OPCODE_TYPE_LOAD_GLOBAL && jit_plain(opcodes[p+1]) && jit_plain(opcodes[p+2])
+                && opcodes[p+3].type >= OPCODE_TYPE_INT_ADD
+                && (opcodes[p+3].type <= OPCODE_TYPE_INT_EQ
+                    || (opcodes[p+3].type >= OPCODE_TYPE_DBL_ADD && opcodes[p+3].type <= OPCODE_TYPE_DBL_EQ)))
+            {
+                // the ops are still compiled one at a time after this, for when it cannot be used
+                a.call(jit_fused, p+3);
+                a.bytes({0x84, 0xc0}); // test al, al
+                jumps.push_back({a.jump(0x85), p+4, false});
+            }
+            switch (op.type)
+            {
+                case OPCODE_TYPE_NOP:
+                case OPCODE_TYPE_END_SPACE:
+                {
+                    break;
+                }
+                case OPCODE_TYPE_ARGC:
+                {
+                    a.call(jit_argc, op.helper);
+                    a.bytes({0x84, 0xc0}); // test al, al
+                    jumps.push_back({a.jump(0x84), p, true});
+                    break;
+                }
+                case OPCODE_TYPE_BEGIN_SPACE:
+                {
+                    a.call(jit_begin_space, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_PUSH_VAL:
+                {
+                    a.call(jit_push_val, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_PUSH_NAME:
+                case OPCODE_TYPE_LOAD_GLOBAL:
+                {
+                    a.call(op.type == OPCODE_TYPE_PUSH_NAME ? jit_push_name : jit_load_global, op.helper);
+                    a.bytes({0x84, 0xc0}); // test al, al
+                    jumps.push_back({a.jump(0x84), p, true});
+                    break;
+                }
+                case OPCODE_TYPE_STORE_GLOBAL:
+                {
+                    a.call(jit_store_global, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_STORE_GLOBAL_POP:
+                {
+                    a.call(jit_store_global_pop, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_LOAD_LOCAL:
+                {
+                    a.call(jit_load_local, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_STORE_LOCAL:
+                {
+                    a.call(jit_store_local, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_STORE_LOCAL_POP:
+                {
+                    a.call(jit_store_local_pop, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_POP:
+                {
+                    a.call(jit_pop);
+                    break;
+                }
+                case OPCODE_TYPE_DEFUN:
+                {
+                    a.call(jit_defun, op.helper);
+                    break;
+                }
+                case OPCODE_TYPE_JMP:
+                {
+                    jumps.push_back({a.jump(0), op.helper+1, false});
+                    break;
+                }
+                case OPCODE_TYPE_JMP_IF:
+                case OPCODE_TYPE_JMP_IF_NOT:
+                {
+                    a.call(op.type == OPCODE_TYPE_JMP_IF ? jit_jmp_if : jit_jmp_if_not);
+                    a.bytes({0x84, 0xc0}); // test al, al
+                    jumps.push_back({a.jump(0x85), op.helper+1, false});
+                    break;
+                }
+                case OPCODE_TYPE_RET:
+                case OPCODE_TYPE_FUNC_CALL:
+                case OPCODE_TYPE_TAIL_CALL:
+                case OPCODE_TYPE_CALL_GLOBAL_TOP:
+                case OPCODE_TYPE_FUNC_CALL_TOP:
+                default:
+                {
+                    if (op.type == OPCODE_TYPE_RET)
+                    {
+                        a.call(jit_ret);
+                    }
+                    else if (op.type == OPCODE_TYPE_FUNC_CALL || op.type == OPCODE_TYPE_TAIL_CALL)
+                    {
+                        a.call(jit_call, p);
+                    }
+                    else if (op.type == OPCODE_TYPE_CALL_GLOBAL_TOP || op.type == OPCODE_TYPE_FUNC_CALL_TOP)
+                    {
+                        a.call(jit_call_top, p);
+                    }
+                    else
+                    {
+                        // the quickened ops
+                        a.call(jit_quick, p);
+                    }
+                    if (op.type != OPCODE_TYPE_RET)
+                    {
+                        a.bytes({0x48, 0x85, 0xc0, 0x74, 0x0c}); // test rax, rax; jz over the rest
+                    }
+                    a.bytes({0x48, 0x83, 0xf8, 0x01}); // cmp rax, 1
+                    leaves.push_back(a.jump(0x84));
+                    a.bytes({0xff, 0xe0}); // jmp rax
+                    break;
+                }
+            }
+        }
+        jumps.push_back({a.jump(0), last+1, false});
+
+        // one exit per place that the unit can go back to run at
+        std::map<uint64_t, uint64_t> exits;
+        uint64_t *counter = &unit->exits;
+        for (jit_jump &j: jumps)
+        {
+            if (!j.redo && j.to >= first && j.to <= last)
+            {
+                a.patch(j.at, at[j.to-first]);
+                continue;
+            }
+            std::map<uint64_t, uint64_t>::iterator found = exits.find(j.to);
+            if (found == exits.end())
+            {
+                found = exits.insert({j.to, a.size()}).first;
+                a.mov(0, reinterpret_cast<uint64_t>(counter));
+                a.bytes({0x48, 0xff, 0x00}); // inc qword [rax]
+                a.mov(0, j.to);
+                a.bytes({0x5b, 0xc3}); // pop rbx; ret
+            }
+            a.patch(j.at, found->second);
+        }
+        // jit_leave, the place is in exit_place
+        uint64_t leave = a.size();
+        a.mov(0, reinterpret_cast<uint64_t>(counter));
+        a.bytes({0x48, 0xff, 0x00}); // inc qword [rax]
+        a.mov(0, reinterpret_cast<uint64_t>(&jit->exit_place));
+        a.bytes({0x48, 0x8b, 0x00}); // mov rax, [rax]
+        a.bytes({0x5b, 0xc3}); // pop rbx; ret
+        for (uint64_t l: leaves)
+        {
+            a.patch(l, leave);
+        }
+
+        unit->code = jit_map(a.code, unit->mapped);
+        if (unit->code == nullptr)
+        {
+            return false;
+        }
+        unit->bytes = a.size();
+        unit->frame = jit_eh_frame(unit->code, unit->bytes);
+        __register_frame(unit->frame.data());
+        for (uint64_t p = first; p <= last; p++)
+        {
+            jit->code[p] = static_cast<uint8_t *>(unit->code) + at[p-first];
+            jit->owner[p] = unit.get();
+        }
+        jit->units.push_back(std::move(unit));
+        jit->compile_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    // the compiled code to go on at for place to, nullptr if there is none
+    // last is the end of the function or loop that starts at to, it is counted and compiled once it
+    // is hot, no_place only looks
+    void *state::jit_entry(uint64_t to, uint64_t last)
+    {
+        if (!jit)
+        {
+            jit = std::make_unique<jit_data>();
+            std::vector<uint8_t> enter = {
+                0x53, // push rbx, which also lines the stack up for calls
+                0x48, 0x89, 0xfb, // mov rbx, rdi
+                0xff, 0xe6, // jmp rsi
+            };
+            uint64_t bytes;
+            jit->enter = jit_map(enter, bytes);
+        }
+        if (jit->enter == nullptr)
+        {
+            return nullptr;
+        }
+        if (jit->code.size() < opcodes.size())
+        {
+            jit->code.resize(opcodes.size(), nullptr);
+            jit->owner.resize(opcodes.size(), nullptr);
+            jit->counts.resize(opcodes.size(), 0);
+        }
+        if (to >= jit->code.size())
+        {
+            return nullptr;
+        }
+        if (jit->code[to] == nullptr && last != no_place && last < opcodes.size())
+        {
+            uint64_t &count = jit->counts[to];
+            count ++;
+            if (count == jit_threshold && !jit_compile(to, last, opcodes[last].type != OPCODE_TYPE_RET))
+            {
+                jit->failed ++;
+            }
+        }
+        void *code = jit->code[to];
+        if (code != nullptr)
+        {
+            jit->owner[to]->entries ++;
+        }
+        return code;
+    }
+
+    // jit_entry or jit_leave, for the helpers
+    void *state::jit_target(uint64_t to, uint64_t last)
+    {
+        void *code = jit_entry(to, last);
+        if (code == nullptr)
+        {
+            jit->exit_place = to;
+            return jit_leave;
+        }
+        return code;
+    }
+
+    // runs compiled code until it goes back to run, returns the place run goes on at
+    uint64_t state::jit_run(void *code)
+    {
+        using enter_fn = uint64_t (*)(state *, void *);
+        // an exception from a helper, out of memory or thrown by a builtin, fails the form as run would
+        try
+        {
+            return reinterpret_cast<enter_fn>(jit->enter)(this, code);
+        }
+        catch (const std::exception &e)
+        {
+            errors.push(errors::str_error(e.what()));
+        }
+        catch (...)
+        {
+            errors.push(errors::str_error("an unknown exception in compiled code"s));
+        }
+        return 0;
+    }
+#else
+    jit_data::~jit_data()
+    {
+    }
+
+    bool state::jit_compile(uint64_t, uint64_t, bool)
+    {
+        return false;
+    }
+
+    void *state::jit_entry(uint64_t, uint64_t)
+    {
+        return nullptr;
+    }
+
+    void *state::jit_target(uint64_t, uint64_t)
+    {
+        return nullptr;
+    }
+
+    uint64_t state::jit_run(void *)
+    {
+        return 0;
+    }
+#endif
+
+    void state::jit_report(std::ostream &out)
+    {
+#ifndef LANG_JIT
+        out << "the jit is not built in" << std::endl;
+#else
+        if (!jit)
+        {
+            out << "nothing was compiled" << std::endl;
+            return;
+        }
+        char line[256];
+        uint64_t bytes = 0;
+        out << "unit               first   last    ops   bytes     entries       exits" << std::endl;
+        for (std::unique_ptr<jit_unit> &unit: jit->units)
+        {
+            std::string name = unit->loop ? "loop@" + std::to_string(unit->first) : profile_name(unit->first-1, false);
+            snprintf(line, sizeof(line), "%-16s %7lu %6lu %6lu %7lu %11lu %11lu", name.c_str(), (unsigned long) unit->first,
+                (unsigned long) unit->last, (unsigned long) (unit->last - unit->first + 1), (unsigned long) unit->bytes,
+                (unsigned long) unit->entries, (unsigned long) unit->exits);
+            out << line << std::endl;
+            bytes += unit->bytes;
+        }
+        snprintf(line, sizeof(line), "%lu units, %lu bytes of code, %lu not compiled, %.3f ms compiling",
+            (unsigned long) jit->units.size(), (unsigned long) bytes, (unsigned long) jit->failed, jit->compile_ns / 1e6);
+        out << line << std::endl;
+#endif
+    }
+}
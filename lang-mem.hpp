@@ -0,0 +1,352 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <cstdio>
+
+namespace lang
+{
+    // live and high water counts of the boxes behind anything::val, one per any_type
+    // bytes is the box itself (box_head and payload object) plus what a string or gmp number owns
+    // count drops when the payload is destroyed, the memory of a table or list box is only freed once
+    // the collector has dropped its weak reference to it
+    struct mem_type_stats
+    {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        uint64_t peak_count = 0;
+        uint64_t peak_bytes = 0;
+    };
+
+    // the boxes each thread makes and frees itself, the states on one thread can pass boxes between them
+    thread_local std::array<mem_type_stats, ANY_TYPE_COUNT> mem_stats;
+
+    // frozen boxes and task handles can go away on any thread, so they are counted here under a lock
+    std::array<mem_type_stats, ANY_TYPE_COUNT> mem_shared;
+    std::mutex mem_shared_lock;
+
+    // what the cycle collector in lang-gc.hpp has done so far
+    struct gc_stats
+    {
+        uint64_t young = 0; // collections of the containers made since the last one
+        uint64_t full = 0; // collections of every container
+        uint64_t freed = 0; // containers found in garbage cycles and cleared
+        uint64_t pause_ns = 0;
+        uint64_t max_pause_ns = 0;
+    };
+
+    thread_local gc_stats gc_totals;
+
+    void mem_add_to(mem_type_stats &s, uint64_t count, uint64_t bytes)
+    {
+        s.count += count;
+        s.bytes += bytes;
+        if (s.count > s.peak_count)
+        {
+            s.peak_count = s.count;
+        }
+        if (s.bytes > s.peak_bytes)
+        {
+            s.peak_bytes = s.bytes;
+        }
+    }
+
+    void mem_add(uint64_t type, uint64_t count, uint64_t bytes, bool shared = false)
+    {
+        if (shared)
+        {
+            std::lock_guard<std::mutex> hold(mem_shared_lock);
+            mem_add_to(mem_shared[type], count, bytes);
+            return;
+        }
+        mem_add_to(mem_stats[type], count, bytes);
+    }
+
+    void mem_sub(uint64_t type, uint64_t count, uint64_t bytes, bool shared = false)
+    {
+        if (shared)
+        {
+            std::lock_guard<std::mutex> hold(mem_shared_lock);
+            mem_shared[type].count -= count;
+            mem_shared[type].bytes -= bytes;
+            return;
+        }
+        mem_type_stats &s = mem_stats[type];
+        s.count -= count;
+        s.bytes -= bytes;
+    }
+
+    // what this thread sees, its own boxes and the shared ones, the peaks are the sum of the two peaks
+    std::array<mem_type_stats, ANY_TYPE_COUNT> mem_now()
+    {
+        std::array<mem_type_stats, ANY_TYPE_COUNT> ret = mem_stats;
+        std::lock_guard<std::mutex> hold(mem_shared_lock);
+        for (uint64_t t = 0; t < ANY_TYPE_COUNT; t++)
+        {
+            ret[t].count += mem_shared[t].count;
+            ret[t].bytes += mem_shared[t].bytes;
+            ret[t].peak_count += mem_shared[t].peak_count;
+            ret[t].peak_bytes += mem_shared[t].peak_bytes;
+        }
+        return ret;
+    }
+
+    // heap memory a payload owns outside its box
+    template<typename T>
+    uint64_t mem_owned(const T &)
+    {
+        return 0;
+    }
+
+    uint64_t mem_owned(const std::string &s)
+    {
+        const char *inside = reinterpret_cast<const char *>(&s);
+        if (s.data() >= inside && s.data() < inside + sizeof(s))
+        {
+            return 0;
+        }
+        return s.capacity() + 1;
+    }
+
+    // the buffer of a packed array
+    template<typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, uint64_t>::type mem_owned(const std::vector<T> &v)
+    {
+        return v.capacity() * sizeof(T);
+    }
+
+    uint64_t mem_owned(mpz_srcptr z)
+    {
+        return z->_mp_alloc * sizeof(mp_limb_t);
+    }
+
+    uint64_t mem_owned(const mpz_int &z)
+    {
+        return mem_owned(z.backend().data());
+    }
+
+    uint64_t mem_owned(const mpq_rational &q)
+    {
+        return mem_owned(mpq_numref(q.backend().data())) + mem_owned(mpq_denref(q.backend().data()));
+    }
+
+    // what make_box allocates, the payload right after the box_head so an anything can point at the payload
+    // the payload is destroyed with the last strong reference, the rest stays until the memory goes with the last weak one
+    // owned is what mem_stats was told the payload owns, so the same is taken back when it goes
+    // a frozen box is never changed in place and is counted in mem_shared
+    template<typename T>
+    struct mem_box
+    {
+        box_head head;
+        union
+        {
+            T value;
+        };
+        uint64_t type;
+        uint64_t owned;
+        bool frozen;
+
+        mem_box(uint64_t t, T v, bool f)
+            : head(&drop), value(std::move(v)), type(t), owned(mem_owned(value)), frozen(f)
+        {
+            mem_add(type, 1, owned, frozen);
+        }
+
+        ~mem_box()
+        {
+        }
+
+        static void drop(box_head *h, bool free);
+
+        // catches up with a change made through any_mut, called once the change is done
+        void remeasure()
+        {
+            uint64_t now = mem_owned(value);
+            mem_sub(type, 0, owned);
+            mem_add(type, 0, now);
+            owned = now;
+        }
+    };
+
+    // what any_mut gives back, it points at a box nothing else holds and measures it again when it goes
+    // keep it no longer than the change, the box is only measured after it
+    template<typename T>
+    struct box_edit
+    {
+        mem_box<T> *box;
+
+        box_edit(mem_box<T> *b)
+            : box(b)
+        {
+        }
+
+        box_edit(const box_edit &) = delete;
+
+        ~box_edit()
+        {
+            box->remeasure();
+        }
+
+        T &operator*() const
+        {
+            return box->value;
+        }
+
+        T *operator->() const
+        {
+            return &box->value;
+        }
+    };
+
+    // what make_box allocates a box with, so the box memory is counted under the type it was made as
+    template<typename T>
+    struct mem_alloc
+    {
+        using value_type = T;
+        uint64_t type;
+        bool shared;
+
+        mem_alloc(uint64_t t, bool s)
+            : type(t), shared(s)
+        {
+        }
+
+        template<typename U>
+        mem_alloc(const mem_alloc<U> &other)
+            : type(other.type), shared(other.shared)
+        {
+        }
+
+        T *allocate(std::size_t n)
+        {
+            mem_add(type, 0, n * sizeof(T), shared);
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T *p, std::size_t n)
+        {
+            mem_sub(type, 0, n * sizeof(T), shared);
+            std::allocator<T>().deallocate(p, n);
+        }
+
+        template<typename U>
+        bool operator==(const mem_alloc<U> &other) const
+        {
+            return type == other.type && shared == other.shared;
+        }
+
+        template<typename U>
+        bool operator!=(const mem_alloc<U> &other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    template<typename T>
+    void mem_box<T>::drop(box_head *h, bool free)
+    {
+        mem_box *box = reinterpret_cast<mem_box *>(h);
+        if (!free)
+        {
+            mem_sub(box->type, 1, box->owned, box->frozen);
+            box->value.~T();
+            return;
+        }
+        mem_alloc<mem_box> alloc(box->type, box->frozen);
+        box->~mem_box();
+        alloc.deallocate(box, 1);
+    }
+
+    // entries and bytes of the containers a state keeps, by name
+    std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> state_mem(const state &s)
+    {
+        uint64_t global_bytes = s.global_vals.capacity() * sizeof(anything);
+        return {
+            {"opcodes", {s.opcodes.size(), s.opcodes.capacity() * sizeof(opcode)}},
+            {"reg_code", {s.reg_code.size(), s.reg_code.capacity() * sizeof(reg_op)}},
+            {"helpers", {s.helpers.size(), s.helpers.capacity() * sizeof(anything)}},
+            {"vm_stack", {s.vm_stack.size(), s.vm_stack.capacity() * sizeof(anything)}},
+            {"ret_stack", {s.ret_stack.size(), s.ret_stack.capacity() * sizeof(frame)}},
+            {"globals", {s.global_vals.size(), global_bytes}},
+        };
+    }
+
+    void mem_report(const state &s, std::ostream &out)
+    {
+        char line[256];
+        std::array<mem_type_stats, ANY_TYPE_COUNT> now = mem_now();
+        out << "type            live        bytes         peak   peak bytes" << std::endl;
+        for (uint64_t t = 0; t < ANY_TYPE_COUNT; t++)
+        {
+            mem_type_stats &m = now[t];
+            if (m.peak_count == 0)
+            {
+                continue;
+            }
+            snprintf(line, sizeof(line), "%-10s %9lu %12lu %12lu %12lu", any_type_name(t).c_str(), (unsigned long) m.count,
+                (unsigned long) m.bytes, (unsigned long) m.peak_count, (unsigned long) m.peak_bytes);
+            out << line << std::endl;
+        }
+        out << std::endl << "state          count        bytes" << std::endl;
+        for (std::pair<std::string, std::pair<uint64_t, uint64_t>> &it: state_mem(s))
+        {
+            snprintf(line, sizeof(line), "%-10s %9lu %12lu", it.first.c_str(), (unsigned long) it.second.first,
+                (unsigned long) it.second.second);
+            out << line << std::endl;
+        }
+        out << std::endl;
+        snprintf(line, sizeof(line), "gc         %lu young, %lu full, %lu freed, %.3f ms paused, %.3f ms longest",
+            (unsigned long) gc_totals.young, (unsigned long) gc_totals.full, (unsigned long) gc_totals.freed,
+            gc_totals.pause_ns / 1e6, gc_totals.max_pause_ns / 1e6);
+        out << line << std::endl;
+    }
+
+    anything mem_entry(const std::vector<std::pair<std::string, uint64_t>> &fields)
+    {
+        table_type ret;
+        for (const std::pair<std::string, uint64_t> &field: fields)
+        {
+            ret.set(make_any<ANY_TYPE_STR, std::string>(field.first), make_any<ANY_TYPE_INT, mpz_int>(mpz_int(field.second)));
+        }
+        return make_any<ANY_TYPE_TABLE, table_type>(ret);
+    }
+
+    // (mem-stats) is a table from type name to {live bytes peak peak-bytes}, from container name to
+    // {count bytes} and from "gc" to {young full freed pause-ns max-pause-ns}
+    // types that were never boxed are left out
+    fn_ret builtin_mem_stats(state *s, args_view args)
+    {
+        // taken before the result is built, so it does not count itself
+        std::array<mem_type_stats, ANY_TYPE_COUNT> now = mem_now();
+        table_type ret;
+        for (uint64_t t = 0; t < ANY_TYPE_COUNT; t++)
+        {
+            mem_type_stats &m = now[t];
+            if (m.peak_count == 0)
+            {
+                continue;
+            }
+            ret.set(make_any<ANY_TYPE_STR, std::string>(any_type_name(t)), mem_entry({
+                {"live", m.count},
+                {"bytes", m.bytes},
+                {"peak", m.peak_count},
+                {"peak-bytes", m.peak_bytes},
+            }));
+        }
+        for (std::pair<std::string, std::pair<uint64_t, uint64_t>> &it: state_mem(*s))
+        {
+            ret.set(make_any<ANY_TYPE_STR, std::string>(it.first), mem_entry({
+                {"count", it.second.first},
+                {"bytes", it.second.second},
+            }));
+        }
+        ret.set(make_any<ANY_TYPE_STR, std::string>("gc"), mem_entry({
+            {"young", gc_totals.young},
+            {"full", gc_totals.full},
+            {"freed", gc_totals.freed},
+            {"pause-ns", gc_totals.pause_ns},
+            {"max-pause-ns", gc_totals.max_pause_ns},
+        }));
+        return make_any<ANY_TYPE_TABLE, table_type>(ret);
+    }
+
+    native_fn native_mem_stats = {"mem-stats", builtin_mem_stats, 0, 0, {}};
+}
@@ -0,0 +1,334 @@
+#pragma once
+#include "lang-defs.hpp"
+
+namespace lang
+{
+    uint64_t args_view::size() const
+    {
+        return count;
+    }
+
+    anything &args_view::operator[](uint64_t i) const
+    {
+        return first[i];
+    }
+
+    anything *args_view::begin() const
+    {
+        return first;
+    }
+
+    anything *args_view::end() const
+    {
+        return first + count;
+    }
+
+    std::string any_type_name(uint64_t type)
+    {
+        switch (type)
+        {
+            case ANY_TYPE_INT: return "int";
+            case ANY_TYPE_RAT: return "rat";
+            case ANY_TYPE_STR: return "str";
+            case ANY_TYPE_LIST: return "list";
+            case ANY_TYPE_TABLE: return "table";
+            case ANY_TYPE_BOOL: return "bool";
+            case ANY_TYPE_FUNC: return "func";
+            case ANY_TYPE_USER_FN: return "fn";
+            case ANY_TYPE_ERROR: return "error";
+            case ANY_TYPE_NONE: return "none";
+            case ANY_TYPE_DATA: return "data";
+            case ANY_TYPE_NATIVE: return "func";
+            case ANY_TYPE_DOUBLE: return "double";
+            case ANY_TYPE_TASK: return "task";
+            case ANY_TYPE_CHAN: return "chan";
+            case ANY_TYPE_CORO: return "coro";
+            case ANY_TYPE_INTS: return "ints";
+            case ANY_TYPE_DOUBLES: return "doubles";
+            case ANY_TYPE_BYTES: return "bytes";
+            default: return "unknown";
+        }
+    }
+
+    // how a parameter of a native function is read out of an anything
+    // mask is the any_type bits the VM lets through, 0 for every type
+    // boxed payloads are borrowed const, a native that changes one takes anything and uses any_mut
+    template<typename T>
+    struct native_arg;
+
+    template<>
+    struct native_arg<anything>
+    {
+        static const uint64_t mask = 0;
+        static anything &get(anything &a)
+        {
+            return a;
+        }
+    };
+
+    template<>
+    struct native_arg<mpz_int>
+    {
+        static const uint64_t mask = 1 << ANY_TYPE_INT;
+        static mpz_int get(anything &a)
+        {
+            return any_fast<mpz_int>(a);
+        }
+    };
+
+    template<>
+    struct native_arg<mpq_rational>
+    {
+        static const uint64_t mask = 1 << ANY_TYPE_RAT;
+        static const mpq_rational &get(anything &a)
+        {
+            return any_ref<mpq_rational>(a);
+        }
+    };
+
+    template<>
+    struct native_arg<std::string>
+    {
+        static const uint64_t mask = 1 << ANY_TYPE_STR;
+        static const std::string &get(anything &a)
+        {
+            return any_ref<std::string>(a);
+        }
+    };
+
+    template<>
+    struct native_arg<bool>
+    {
+        static const uint64_t mask = 1 << ANY_TYPE_BOOL;
+        static bool get(anything &a)
+        {
+            return a.flag;
+        }
+    };
+
+    fn_ret native_ret(anything got)
+    {
+        return got;
+    }
+
+    fn_ret native_ret(mpz_int got)
+    {
+        return make_any<ANY_TYPE_INT, mpz_int>(std::move(got));
+    }
+
+    fn_ret native_ret(mpq_rational got)
+    {
+        return make_any<ANY_TYPE_RAT, mpq_rational>(std::move(got));
+    }
+
+    fn_ret native_ret(std::string got)
+    {
+        return make_any<ANY_TYPE_STR, std::string>(std::move(got));
+    }
+
+    fn_ret native_ret(bool got)
+    {
+        return make_any<ANY_TYPE_BOOL, bool>(got);
+    }
+
+    // turns a plain typed function into a native_fn
+    //     mpz_int twice(state *, mpz_int n) { return n * 2; }
+    //     native_fn native_twice = native_thunk<twice>::describe("twice");
+    template<auto F>
+    struct native_thunk;
+
+    template<typename R, typename... A, R (*F)(state *, A...)>
+    struct native_thunk<F>
+    {
+        static_assert(sizeof...(A) <= native_typed_args, "too many parameters for a native thunk");
+
+        template<std::size_t... I>
+        static fn_ret call_with(state *s, args_view args, std::index_sequence<I...>)
+        {
+            return native_ret(F(s, native_arg<std::decay_t<A>>::get(args[I])...));
+        }
+
+        static fn_ret call(state *s, args_view args)
+        {
+            return call_with(s, args, std::index_sequence_for<A...>());
+        }
+
+        static native_fn describe(const char *name)
+        {
+            native_fn ret = {name, call, sizeof...(A), sizeof...(A), {native_arg<std::decay_t<A>>::mask...}};
+            return ret;
+        }
+    };
+
+    // moves argc values starting at first into a vector that is reused by later calls at the same depth
+    std::vector<anything> &state::take_args(anything *first, uint64_t argc)
+    {
+        if (arg_depth == arg_pool.size())
+        {
+            arg_pool.emplace_back();
+        }
+        std::vector<anything> &args = arg_pool[arg_depth];
+        args.assign(std::make_move_iterator(first), std::make_move_iterator(first+argc));
+        return args;
+    }
+
+    // pops argc arguments into a reused vector
+    std::vector<anything> &state::take_args(uint64_t argc)
+    {
+        std::vector<anything> &args = take_args(vm_stack.data() + vm_stack.size()-argc, argc);
+        vm_stack.resize(vm_stack.size()-argc);
+        return args;
+    }
+
+    // auxlib may have changed the boxes it was handed through any_fast_ptr, they are measured again
+    // before the arguments are dropped
+    void aux_settle(std::vector<anything> &args, const anything &got)
+    {
+        for (const anything &a: args)
+        {
+            box_remeasure(a);
+        }
+        box_remeasure(got);
+        args.clear();
+    }
+
+    // calls a std::function builtin with the top argc values, which are popped
+    fn_ret state::call_func(anything &fncall, uint64_t argc)
+    {
+        // the function lives in its own box, so moving vm_stack around does not move it
+        const fn_type &fn = any_ref<fn_type>(fncall);
+        std::vector<anything> &args = take_args(argc);
+        arg_depth ++;
+        fn_ret got = fn(this, args);
+        arg_depth --;
+        aux_settle(arg_pool[arg_depth], got);
+        return got;
+    }
+
+    // calls a std::function builtin with the argc values starting at first, which are moved out
+    fn_ret state::call_func(anything &fncall, anything *first, uint64_t argc)
+    {
+        const fn_type &fn = any_ref<fn_type>(fncall);
+        std::vector<anything> &args = take_args(first, argc);
+        arg_depth ++;
+        fn_ret got = fn(this, args);
+        arg_depth --;
+        aux_settle(arg_pool[arg_depth], got);
+        return got;
+    }
+
+    // calls a native builtin on the top argc values, the caller pops them
+    fn_ret state::call_native(const native_fn *fn, uint64_t argc)
+    {
+        args_view args = {vm_stack.data() + vm_stack.size()-argc, argc};
+        return call_native(fn, args);
+    }
+
+    // calls a native builtin on args wherever they are, the arity and types are checked first
+    fn_ret state::call_native(const native_fn *fn, args_view args)
+    {
+        uint64_t argc = args.count;
+        if (argc < fn->min_args)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::need_more_args(fn->name, fn->min_args));
+        }
+        if (fn->max_args != native_variadic && argc > fn->max_args)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("function \""s + fn->name
+                + "\" takes at most " + std::to_string(fn->max_args) + " arguments"));
+        }
+        for (uint64_t i = 0; i < argc && i < native_typed_args; i++)
+        {
+            uint64_t mask = fn->types[i];
+            if (mask != 0 && (args[i].type >= 64 || (mask & (uint64_t(1) << args[i].type)) == 0))
+            {
+                std::vector<std::string> okay;
+                for (uint64_t t = 0; t < 64; t++)
+                {
+                    if (mask & (uint64_t(1) << t))
+                    {
+                        okay.push_back(any_type_name(t));
+                    }
+                }
+                return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::type_error(fn->name, okay));
+            }
+        }
+        return fn->call(this, args);
+    }
+
+    // fn must outlive the state, natives are normally static
+    // a name that has no slot yet gets one seeded from globals the first time it is compiled
+    void state::def_native(const native_fn &fn)
+    {
+        anything value = make_any<ANY_TYPE_NATIVE, const native_fn *>(&fn);
+        globals[globals.size()-1].set(make_any<ANY_TYPE_STR, std::string>(fn.name), value);
+        std::unordered_map<std::string, uint64_t>::iterator found = global_slots.find(fn.name);
+        if (found != global_slots.end())
+        {
+            global_vals[found->second] = value;
+        }
+    }
+
+    // (index t key), (index l n) and (index a n) of an array without copying them, every other kind of value
+    // still goes to the index auxlib defines
+    fn_ret builtin_index(state *s, args_view args)
+    {
+        anything &from = args[0];
+        if (is_a_any<ANY_TYPE_TABLE>(from))
+        {
+            return get_table(any_ref<table_type>(from), args[1]);
+        }
+        if (is_a_any<ANY_TYPE_LIST>(from) && is_small_int(args[1]))
+        {
+            const std::vector<anything> &l = any_ref<std::vector<anything>>(from);
+            if (args[1].num < 0 || uint64_t(args[1].num) >= l.size())
+            {
+                return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("index "s
+                    + std::to_string(args[1].num) + " is out of range"));
+            }
+            return l[args[1].num];
+        }
+        if (is_array(from) && is_small_int(args[1]))
+        {
+            return array_index(from, args[1].num);
+        }
+        if (is_a_any<ANY_TYPE_FUNC>(s->aux_index))
+        {
+            std::vector<anything> copy(args.begin(), args.end());
+            anything got = any_ref<fn_type>(s->aux_index)(s, copy);
+            aux_settle(copy, got);
+            return got;
+        }
+        return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot index"s));
+    }
+
+    native_fn native_index = {"index", builtin_index, 2, 2, {}};
+
+    // (list-set l n v) is l with item n replaced by v, l itself is only changed if nothing else holds it
+    fn_ret builtin_list_set(state *s, args_view args)
+    {
+        anything &l = args[0];
+        if (!is_small_int(args[1]) || args[1].num < 0 || uint64_t(args[1].num) >= any_ref<std::vector<anything>>(l).size())
+        {
+            std::string at = is_small_int(args[1]) ? std::to_string(args[1].num) + " " : "";
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("index "s + at + "is out of range"));
+        }
+        (*any_mut<std::vector<anything>>(l))[args[1].num] = args[2];
+        return l;
+    }
+
+    // (table-set t k v) is t with k set to v, t itself is only changed if nothing else holds it
+    fn_ret builtin_table_set(state *s, args_view args)
+    {
+        anything &t = args[0];
+        if (!any_mut<table_type>(t)->set(args[1], args[2]))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("a "s + any_type_name(args[1].type)
+                + " cannot be a table key"));
+        }
+        return t;
+    }
+
+    native_fn native_list_set = {"list-set", builtin_list_set, 3, 3, {1 << ANY_TYPE_LIST, 1 << ANY_TYPE_INT}};
+    native_fn native_table_set = {"table-set", builtin_table_set, 3, 3, {1 << ANY_TYPE_TABLE}};
+}
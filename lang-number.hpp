@@ -0,0 +1,234 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <cmath>
+
+namespace lang
+{
+    // false for values that are not numbers
+    bool to_double(const anything &a, double &out)
+    {
+        switch (a.type)
+        {
+            case ANY_TYPE_DOUBLE:
+            {
+                out = a.dbl;
+                return true;
+            }
+            case ANY_TYPE_INT:
+            {
+                out = a.boxed ? mpz_get_d(any_ref<mpz_int>(a).backend().data()) : double(a.num);
+                return true;
+            }
+            case ANY_TYPE_RAT:
+            {
+                out = mpq_get_d(any_ref<mpq_rational>(a).backend().data());
+                return true;
+            }
+            default:
+            {
+                return false;
+            }
+        }
+    }
+
+    // the shortest text that reads back as the same double, with a .0 when it would look like an int
+    std::string double_str(double d)
+    {
+        char buf[32];
+        for (int digits = 1; digits <= 17; digits++)
+        {
+            snprintf(buf, sizeof(buf), "%.*g", digits, d);
+            if (strtod(buf, nullptr) == d)
+            {
+                break;
+            }
+        }
+        std::string ret = buf;
+        if (std::isfinite(d) && ret.find_first_of(".e") == std::string::npos)
+        {
+            ret += ".0";
+        }
+        return ret;
+    }
+
+    // the builtins auxlib does arithmetic with, what each does to two doubles
+    // and the INT_ op that does it to two machine ints, NOP when there is none
+    // chain is for the ones that fold left over more than two arguments
+    // array is the kernel it runs on packed arrays, ARRAY_NONE for the ones that do not take them
+    // equality is for eq and neq, which compare a double with anything, a side that is not a number
+    // is unequal to it, which is what op gives for 0 and 1
+    struct number_builtin
+    {
+        const char *name;
+        anything (*op)(double, double);
+        opcode_type small;
+        bool chain;
+        array_op array;
+        bool equality;
+    };
+
+    std::vector<number_builtin> number_builtins = {
+        {"add", [](double a, double b) { return double_op(QUICK_ADD, a, b); }, OPCODE_TYPE_INT_ADD, true, ARRAY_ADD, false},
+        {"sub", [](double a, double b) { return double_op(QUICK_SUB, a, b); }, OPCODE_TYPE_INT_SUB, true, ARRAY_SUB, false},
+        {"mul", [](double a, double b) { return double_op(QUICK_MUL, a, b); }, OPCODE_TYPE_INT_MUL, true, ARRAY_MUL, false},
+        {"div", [](double a, double b) { return make_any<ANY_TYPE_DOUBLE, double>(a / b); }, OPCODE_TYPE_NOP, true, ARRAY_DIV, false},
+        {"lt", [](double a, double b) { return double_op(QUICK_LT, a, b); }, OPCODE_TYPE_INT_LT, false, ARRAY_NONE, false},
+        {"gt", [](double a, double b) { return double_op(QUICK_GT, a, b); }, OPCODE_TYPE_INT_GT, false, ARRAY_NONE, false},
+        {"lte", [](double a, double b) { return double_op(QUICK_LTE, a, b); }, OPCODE_TYPE_INT_LTE, false, ARRAY_NONE, false},
+        {"gte", [](double a, double b) { return double_op(QUICK_GTE, a, b); }, OPCODE_TYPE_INT_GTE, false, ARRAY_NONE, false},
+        {"eq", [](double a, double b) { return double_op(QUICK_EQ, a, b); }, OPCODE_TYPE_INT_EQ, false, ARRAY_NONE, true},
+        {"neq", [](double a, double b) { return make_any<ANY_TYPE_BOOL, bool>(a != b); }, OPCODE_TYPE_NOP, false, ARRAY_NONE, true},
+    };
+
+    // two machine ints are done here with checked arithmetic, an overflow goes to auxlib
+    // and gets an mpz_int back, which make_any turns into a machine int again if it fits
+    // a call with a double in it is done here too, ints and rationals next to a double become doubles
+    // so is a call on packed arrays, which array_arith runs over whole arrays
+    // every other call goes to the auxlib builtin untouched, so exact math stays exact
+    fn_type number_wrap(const number_builtin &b, fn_type aux)
+    {
+        return [b, aux](state *s, aty2 args) -> fn_ret {
+            anything got;
+            if (b.small != OPCODE_TYPE_NOP && args.size() == 2 && quick_int(b.small, args[0], args[1], got))
+            {
+                return got;
+            }
+            if (b.array != ARRAY_NONE && args.size() >= 2 && (is_array(args[0]) || (args.size() == 2 && is_array(args[1]))))
+            {
+                return array_arith(b.name, b.array, args);
+            }
+            bool any_double = false;
+            for (anything &a: args)
+            {
+                any_double = any_double || is_a_any<ANY_TYPE_DOUBLE>(a);
+            }
+            if (!any_double || args.size() < 2 || (args.size() > 2 && !b.chain))
+            {
+                if (!aux)
+                {
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("function \""s + b.name
+                        + "\" only takes doubles"));
+                }
+                return aux(s, args);
+            }
+            got = args[0];
+            for (uint64_t i = 1; i < args.size(); i++)
+            {
+                double lhs;
+                double rhs;
+                if (!to_double(got, lhs) || !to_double(args[i], rhs))
+                {
+                    if (b.equality)
+                    {
+                        return b.op(0, 1);
+                    }
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::type_error(b.name, {"int", "rat", "double"}));
+                }
+                got = b.op(lhs, rhs);
+            }
+            return got;
+        };
+    }
+
+    // auxlib prints what it knows, doubles and packed arrays are handed to it as their text
+    fn_type double_print(fn_type aux)
+    {
+        return [aux](state *s, aty2 args) -> fn_ret {
+            for (anything &a: args)
+            {
+                if (is_a_any<ANY_TYPE_DOUBLE>(a))
+                {
+                    a = make_any<ANY_TYPE_STR, std::string>(double_str(a.dbl));
+                }
+                else if (is_array(a))
+                {
+                    a = make_any<ANY_TYPE_STR, std::string>(array_str(a));
+                }
+            }
+            return aux(s, args);
+        };
+    }
+
+    fn_ret builtin_to_double(state *s, args_view args)
+    {
+        double d = 0;
+        to_double(args[0], d);
+        return make_any<ANY_TYPE_DOUBLE, double>(d);
+    }
+
+    // exact, every finite double is a rational
+    fn_ret builtin_to_rat(state *s, args_view args)
+    {
+        anything &a = args[0];
+        if (is_a_any<ANY_TYPE_RAT>(a))
+        {
+            return a;
+        }
+        if (is_a_any<ANY_TYPE_INT>(a))
+        {
+            return make_any<ANY_TYPE_RAT, mpq_rational>(mpq_rational(any_fast<mpz_int>(a)));
+        }
+        if (!std::isfinite(a.dbl))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot make a rational of "s + double_str(a.dbl)));
+        }
+        mpq_rational q;
+        mpq_set_d(q.backend().data(), a.dbl);
+        return make_any<ANY_TYPE_RAT, mpq_rational>(q);
+    }
+
+    // rounds toward zero
+    fn_ret builtin_to_int(state *s, args_view args)
+    {
+        anything &a = args[0];
+        if (is_a_any<ANY_TYPE_INT>(a))
+        {
+            return a;
+        }
+        mpz_int z;
+        if (is_a_any<ANY_TYPE_RAT>(a))
+        {
+            mpq_srcptr q = any_ref<mpq_rational>(a).backend().data();
+            mpz_tdiv_q(z.backend().data(), mpq_numref(q), mpq_denref(q));
+            return make_any<ANY_TYPE_INT, mpz_int>(z);
+        }
+        if (!std::isfinite(a.dbl))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot make an int of "s + double_str(a.dbl)));
+        }
+        mpz_set_d(z.backend().data(), a.dbl);
+        return make_any<ANY_TYPE_INT, mpz_int>(z);
+    }
+
+    const uint64_t number_types = (1 << ANY_TYPE_INT) | (1 << ANY_TYPE_RAT) | (1 << ANY_TYPE_DOUBLE);
+
+    native_fn native_to_double = {"to-double", builtin_to_double, 1, 1, {number_types}};
+    native_fn native_to_rat = {"to-rat", builtin_to_rat, 1, 1, {number_types}};
+    native_fn native_to_int = {"to-int", builtin_to_int, 1, 1, {number_types}};
+
+    // wraps the auxlib builtins in place, called before anything is compiled
+    void number_builtins_wrap(table_type &builtins)
+    {
+        for (const number_builtin &b: number_builtins)
+        {
+            anything name = make_any<ANY_TYPE_STR, std::string>(b.name);
+            anything *got = builtins.find(name);
+            fn_type aux;
+            if (got != nullptr && is_a_any<ANY_TYPE_FUNC>(*got))
+            {
+                aux = any_ref<fn_type>(*got);
+            }
+            else if (got != nullptr)
+            {
+                continue;
+            }
+            builtins.set(name, make_any<ANY_TYPE_FUNC, fn_type>(number_wrap(b, aux)));
+        }
+        anything name = make_any<ANY_TYPE_STR, std::string>("print");
+        anything *got = builtins.find(name);
+        if (got != nullptr && is_a_any<ANY_TYPE_FUNC>(*got))
+        {
+            builtins.set(name, make_any<ANY_TYPE_FUNC, fn_type>(double_print(any_ref<fn_type>(*got))));
+        }
+    }
+}
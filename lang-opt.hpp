@@ -0,0 +1,269 @@
+#pragma once
+#include "lang-defs.hpp"
+
+namespace lang
+{
+    // builtins that can be run at compile time when every argument is a constant
+    std::set<std::string> pure_funcs = {
+        "add",
+        "sub",
+        "mul",
+        "div",
+        "mod",
+        "pow",
+        "lt",
+        "gt",
+        "lte",
+        "gte",
+        "eq",
+        "neq",
+        "not",
+        "concat",
+    };
+
+    // ops whose helper is a place, the next op run after them is helper+1
+    bool opt_is_jump(opcode_type type)
+    {
+        return type == OPCODE_TYPE_JMP
+            || type == OPCODE_TYPE_JMP_IF
+            || type == OPCODE_TYPE_JMP_IF_NOT
+            || type == OPCODE_TYPE_DEFUN;
+    }
+
+    // a jump that lands on an unconditional jump goes straight to where that one goes
+    void opt_thread_jumps(opcode_vec &ops, uint64_t start, uint64_t end)
+    {
+        for (uint64_t i = start; i < end; i++)
+        {
+            opcode &op = ops[i];
+            if (op.type != OPCODE_TYPE_JMP && op.type != OPCODE_TYPE_JMP_IF && op.type != OPCODE_TYPE_JMP_IF_NOT)
+            {
+                continue;
+            }
+            uint64_t hops = 0;
+            while (hops < end-start)
+            {
+                uint64_t next = op.helper+1;
+                if (next < start || next >= end || ops[next].type != OPCODE_TYPE_JMP || ops[next].helper == op.helper)
+                {
+                    break;
+                }
+                op.helper = ops[next].helper;
+                hops ++;
+            }
+        }
+    }
+
+    // true for every place in [start, end] that something can jump or call into
+    std::vector<bool> opt_targets(opcode_vec &ops, uint64_t start, uint64_t end)
+    {
+        std::vector<bool> ret(end-start+1);
+        for (uint64_t i = start; i < end; i++)
+        {
+            if (opt_is_jump(ops[i].type))
+            {
+                uint64_t next = ops[i].helper+1;
+                if (next >= start && next <= end)
+                {
+                    ret[next-start] = true;
+                }
+            }
+        }
+        return ret;
+    }
+
+    // folds (name const ...) when name is still the original pure builtin and is never redefined
+    // only used outside of fn bodies, a later form could redefine name before the body runs
+    // out holds the rewritten ops from start on
+    bool state::opt_fold_call(opcode_vec &out, std::vector<bool> &out_targets, std::set<uint64_t> &stored, uint64_t argc)
+    {
+        if (out.size() < argc+1)
+        {
+            return false;
+        }
+        opcode &callee = out[out.size()-1-argc];
+        if (callee.type != OPCODE_TYPE_LOAD_GLOBAL || stored.count(callee.helper) != 0)
+        {
+            return false;
+        }
+        std::string &name = global_names[callee.helper];
+        anything key = make_any<ANY_TYPE_STR, std::string>(name);
+        anything *orig = globals[globals.size()-1].find(key);
+        anything &fnval = global_vals[callee.helper];
+        if (pure_funcs.count(name) == 0 || orig == nullptr || !is_a_any<ANY_TYPE_FUNC>(fnval) || orig->val() != fnval.val())
+        {
+            return false;
+        }
+        std::vector<anything> args(argc);
+        for (uint64_t i = 0; i < argc; i++)
+        {
+            uint64_t at = out.size()-argc+i;
+            if (out[at].type != OPCODE_TYPE_PUSH_VAL || out_targets[at])
+            {
+                return false;
+            }
+            args[i] = helpers[out[at].helper];
+        }
+        uint64_t errcount = errors.size();
+        const fn_type &fn = any_ref<fn_type>(fnval);
+        fn_ret got = fn(this, args);
+        if (is_a_any<ANY_TYPE_ERROR>(got) || errors.size() != errcount)
+        {
+            while (errors.size() > errcount)
+            {
+                errors.pop();
+            }
+            return false;
+        }
+        out.resize(out.size()-argc);
+        out_targets.resize(out_targets.size()-argc);
+        opcode &folded = out[out.size()-1];
+        folded.type = OPCODE_TYPE_PUSH_VAL;
+        folded.helper = helpers.size();
+        folded.extra = 0;
+        helpers.push_back(got);
+        return true;
+    }
+
+    // rewrites opcodes from start to the end, which must not have run yet
+    void state::optimize(uint64_t start)
+    {
+        uint64_t end = opcodes.size();
+        if (opts.jump_threading)
+        {
+            opt_thread_jumps(opcodes, start, end);
+        }
+        if (!opts.peephole && !opts.superinstructions && !opts.fold)
+        {
+            return;
+        }
+        std::vector<bool> targets = opt_targets(opcodes, start, end);
+        std::set<uint64_t> stored;
+        // earlier code has already run, so its stores are seen through global_vals
+        for (uint64_t i = start; i < end; i++)
+        {
+            if (opcodes[i].type == OPCODE_TYPE_STORE_GLOBAL || opcodes[i].type == OPCODE_TYPE_STORE_GLOBAL_POP)
+            {
+                stored.insert(opcodes[i].helper);
+            }
+        }
+        std::vector<bool> in_fn(end-start);
+        for (uint64_t i = start; i < end; i++)
+        {
+            if (opcodes[i].type == OPCODE_TYPE_DEFUN && opcodes[i].helper >= start)
+            {
+                for (uint64_t j = opcodes[i].helper; j < i; j++)
+                {
+                    in_fn[j-start] = true;
+                }
+            }
+        }
+        opcode_vec out;
+        out.reserve(end-start);
+        std::vector<bool> out_targets; // whether each op in out past start can be jumped to
+        std::vector<uint64_t> newpos(end-start+1); // old place to the first kept op at or after it
+        bool dead = false;
+        bool carried = false; // a dropped op was a target, so the next kept one is
+        for (uint64_t i = start; i < end; i++)
+        {
+            newpos[i-start] = start+out.size();
+            opcode op = opcodes[i];
+            bool target = targets[i-start] || carried;
+            bool has_last = out.size() != 0;
+            if (targets[i-start])
+            {
+                dead = false;
+            }
+            if (opts.peephole)
+            {
+                // nothing can reach code between a jump or return and the next target
+                if (dead || op.type == OPCODE_TYPE_NOP || op.type == OPCODE_TYPE_END_SPACE
+                    || (op.type == OPCODE_TYPE_BEGIN_SPACE && op.helper == 0)
+                    || (op.type == OPCODE_TYPE_JMP && op.helper == i))
+                {
+                    carried = target;
+                    continue;
+                }
+            }
+            carried = false;
+            if (has_last && !target)
+            {
+                opcode &last = out[out.size()-1];
+                if (op.type == OPCODE_TYPE_POP)
+                {
+                    if (opts.peephole && (last.type == OPCODE_TYPE_PUSH_VAL
+                        || last.type == OPCODE_TYPE_LOAD_LOCAL || last.type == OPCODE_TYPE_DEFUN))
+                    {
+                        carried = out_targets[out_targets.size()-1];
+                        out.pop_back();
+                        out_targets.pop_back();
+                        continue;
+                    }
+                    if (opts.superinstructions && last.type == OPCODE_TYPE_STORE_GLOBAL)
+                    {
+                        last.type = OPCODE_TYPE_STORE_GLOBAL_POP;
+                        continue;
+                    }
+                    if (opts.superinstructions && last.type == OPCODE_TYPE_STORE_LOCAL)
+                    {
+                        last.type = OPCODE_TYPE_STORE_LOCAL_POP;
+                        continue;
+                    }
+                }
+                if (opts.fold && last.type == OPCODE_TYPE_PUSH_VAL
+                    && (op.type == OPCODE_TYPE_JMP_IF_NOT || op.type == OPCODE_TYPE_JMP_IF))
+                {
+                    anything &cond = helpers[last.helper];
+                    bool truthy = is_a_any<ANY_TYPE_BOOL>(cond) && cond.flag;
+                    bool jump = op.type == OPCODE_TYPE_JMP_IF_NOT ? !truthy : (truthy || !is_a_any<ANY_TYPE_BOOL>(cond));
+                    if (jump)
+                    {
+                        last.type = OPCODE_TYPE_JMP;
+                        last.helper = op.helper;
+                        dead = opts.peephole;
+                    }
+                    else
+                    {
+                        carried = out_targets[out_targets.size()-1];
+                        out.pop_back();
+                        out_targets.pop_back();
+                    }
+                    continue;
+                }
+                if (opts.fold && op.type == OPCODE_TYPE_FUNC_CALL && !in_fn[i-start]
+                    && opt_fold_call(out, out_targets, stored, op.helper))
+                {
+                    continue;
+                }
+                if (opts.superinstructions && last.type == OPCODE_TYPE_LOAD_GLOBAL
+                    && (op.type == OPCODE_TYPE_FUNC_CALL_TOP || (op.type == OPCODE_TYPE_FUNC_CALL && op.helper == 0)))
+                {
+                    last.type = OPCODE_TYPE_CALL_GLOBAL_TOP;
+                    last.extra = op.helper;
+                    continue;
+                }
+            }
+            out.push_back(op);
+            out_targets.push_back(target);
+            if (op.type == OPCODE_TYPE_JMP || op.type == OPCODE_TYPE_RET)
+            {
+                dead = opts.peephole;
+            }
+        }
+        newpos[end-start] = start+out.size();
+        uint64_t size = out.size();
+        for (uint64_t i = 0; i < size; i++)
+        {
+            if (opt_is_jump(out[i].type))
+            {
+                uint64_t next = out[i].helper+1;
+                if (next >= start && next <= end)
+                {
+                    out[i].helper = newpos[next-start]-1;
+                }
+            }
+        }
+        opcodes.resize(start);
+        opcodes.insert(opcodes.end(), out.begin(), out.end());
+    }
+}
@@ -0,0 +1,402 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <tuple>
+
+namespace lang
+{
+    const char *opcode_name(uint64_t type)
+    {
+        switch (type)
+        {
+            case OPCODE_TYPE_PUSH_VAL: return "PUSH_VAL";
+            case OPCODE_TYPE_PUSH_NAME: return "PUSH_NAME";
+            case OPCODE_TYPE_POP: return "POP";
+            case OPCODE_TYPE_FUNC_CALL: return "FUNC_CALL";
+            case OPCODE_TYPE_JMP_IF_NOT: return "JMP_IF_NOT";
+            case OPCODE_TYPE_JMP_IF: return "JMP_IF";
+            case OPCODE_TYPE_JMP: return "JMP";
+            case OPCODE_TYPE_DEFUN: return "DEFUN";
+            case OPCODE_TYPE_RET: return "RET";
+            case OPCODE_TYPE_BEGIN_SPACE: return "BEGIN_SPACE";
+            case OPCODE_TYPE_END_SPACE: return "END_SPACE";
+            case OPCODE_TYPE_NOP: return "NOP";
+            case OPCODE_TYPE_FUNC_CALL_TOP: return "FUNC_CALL_TOP";
+            case OPCODE_TYPE_LOAD_GLOBAL: return "LOAD_GLOBAL";
+            case OPCODE_TYPE_STORE_GLOBAL: return "STORE_GLOBAL";
+            case OPCODE_TYPE_LOAD_LOCAL: return "LOAD_LOCAL";
+            case OPCODE_TYPE_STORE_LOCAL: return "STORE_LOCAL";
+            case OPCODE_TYPE_ARGC: return "ARGC";
+            case OPCODE_TYPE_STORE_GLOBAL_POP: return "STORE_GLOBAL_POP";
+            case OPCODE_TYPE_STORE_LOCAL_POP: return "STORE_LOCAL_POP";
+            case OPCODE_TYPE_CALL_GLOBAL_TOP: return "CALL_GLOBAL_TOP";
+            case OPCODE_TYPE_INT_ADD: return "INT_ADD";
+            case OPCODE_TYPE_INT_SUB: return "INT_SUB";
+            case OPCODE_TYPE_INT_MUL: return "INT_MUL";
+            case OPCODE_TYPE_INT_LT: return "INT_LT";
+            case OPCODE_TYPE_INT_GT: return "INT_GT";
+            case OPCODE_TYPE_INT_LTE: return "INT_LTE";
+            case OPCODE_TYPE_INT_GTE: return "INT_GTE";
+            case OPCODE_TYPE_INT_EQ: return "INT_EQ";
+            case OPCODE_TYPE_RAT_ADD: return "RAT_ADD";
+            case OPCODE_TYPE_RAT_MUL: return "RAT_MUL";
+            case OPCODE_TYPE_STR_CONCAT: return "STR_CONCAT";
+            case OPCODE_TYPE_TAIL_CALL: return "TAIL_CALL";
+            case OPCODE_TYPE_DBL_ADD: return "DBL_ADD";
+            case OPCODE_TYPE_DBL_SUB: return "DBL_SUB";
+            case OPCODE_TYPE_DBL_MUL: return "DBL_MUL";
+            case OPCODE_TYPE_DBL_LT: return "DBL_LT";
+            case OPCODE_TYPE_DBL_GT: return "DBL_GT";
+            case OPCODE_TYPE_DBL_LTE: return "DBL_LTE";
+            case OPCODE_TYPE_DBL_GTE: return "DBL_GTE";
+            case OPCODE_TYPE_DBL_EQ: return "DBL_EQ";
+            default: return "?";
+        }
+    }
+
+    uint64_t profile_now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // a node of the call tree, node 0 is the top level code
+    // direct recursion stays in one node so the tree is as deep as the distinct calls
+    struct profile_node
+    {
+        uint64_t parent;
+        uint64_t callee; // op_place of a user function or the key of a builtin
+        bool builtin;
+        uint64_t self_ns;
+    };
+
+    struct profile_fn
+    {
+        uint64_t calls = 0;
+        uint64_t incl_ns = 0; // only the outermost of recursive calls is counted
+        uint64_t excl_ns = 0;
+        uint64_t active = 0;
+    };
+
+    struct profile_builtin
+    {
+        const native_fn *native = nullptr;
+        uint64_t calls = 0;
+        uint64_t ns = 0;
+    };
+
+    struct profile_site
+    {
+        uint64_t callee = 0; // the last thing called from here
+        bool builtin = false;
+        uint64_t calls = 0;
+        uint64_t ns = 0; // like incl_ns of profile_fn for user function calls
+        uint64_t active = 0;
+    };
+
+    // a user function call that has not returned
+    struct profile_call
+    {
+        uint64_t fn;
+        uint64_t site;
+        uint64_t node;
+        uint64_t start;
+        uint64_t child_ns;
+    };
+
+    // filled in by run while profiling, builtins are keyed by the address of their payload
+    // builtins the quickened ops run inline only show up in the opcode counts
+    struct profile_data
+    {
+        std::array<uint64_t, OPCODE_TYPE_COUNT> ops = {};
+        std::unordered_map<uint64_t, profile_fn> fns;
+        std::unordered_map<uint64_t, profile_builtin> builtins;
+        std::unordered_map<uint64_t, profile_site> sites;
+        std::vector<profile_node> nodes = {profile_node{0, 0, false, 0}};
+        std::map<std::tuple<uint64_t, uint64_t, bool>, uint64_t> children;
+        std::vector<profile_call> calls;
+        uint64_t top_child_ns = 0; // time the top level code spent in calls
+
+        uint64_t child(uint64_t parent, uint64_t callee, bool builtin)
+        {
+            if (parent != 0 && !builtin && !nodes[parent].builtin && nodes[parent].callee == callee)
+            {
+                return parent;
+            }
+            std::tuple<uint64_t, uint64_t, bool> key(parent, callee, builtin);
+            std::map<std::tuple<uint64_t, uint64_t, bool>, uint64_t>::iterator found = children.find(key);
+            if (found != children.end())
+            {
+                return found->second;
+            }
+            nodes.push_back(profile_node{parent, callee, builtin, 0});
+            children[key] = nodes.size()-1;
+            return nodes.size()-1;
+        }
+
+        void add_child_time(uint64_t ns)
+        {
+            if (calls.size() != 0)
+            {
+                calls[calls.size()-1].child_ns += ns;
+            }
+            else
+            {
+                top_child_ns += ns;
+            }
+        }
+
+        void enter(uint64_t fn, uint64_t site)
+        {
+            uint64_t parent = calls.size() != 0 ? calls[calls.size()-1].node : 0;
+            profile_fn &f = fns[fn];
+            f.calls ++;
+            f.active ++;
+            profile_site &s = sites[site];
+            s.callee = fn;
+            s.builtin = false;
+            s.calls ++;
+            s.active ++;
+            calls.push_back(profile_call{fn, site, child(parent, fn, false), profile_now(), 0});
+        }
+
+        void leave()
+        {
+            profile_call c = calls[calls.size()-1];
+            calls.pop_back();
+            uint64_t incl = profile_now() - c.start;
+            uint64_t excl = incl > c.child_ns ? incl - c.child_ns : 0;
+            profile_fn &f = fns[c.fn];
+            f.active --;
+            if (f.active == 0)
+            {
+                f.incl_ns += incl;
+            }
+            f.excl_ns += excl;
+            nodes[c.node].self_ns += excl;
+            profile_site &s = sites[c.site];
+            s.active --;
+            if (s.active == 0)
+            {
+                s.ns += incl;
+            }
+            add_child_time(incl);
+        }
+
+        void builtin(uint64_t key, const native_fn *native, uint64_t site, uint64_t ns)
+        {
+            profile_builtin &b = builtins[key];
+            b.native = native;
+            b.calls ++;
+            b.ns += ns;
+            profile_site &s = sites[site];
+            s.callee = key;
+            s.builtin = true;
+            s.calls ++;
+            s.ns += ns;
+            uint64_t parent = calls.size() != 0 ? calls[calls.size()-1].node : 0;
+            nodes[child(parent, key, true)].self_ns += ns;
+            add_child_time(ns);
+        }
+    };
+
+    void state::profile_start()
+    {
+        if (!profile)
+        {
+            profile = std::make_unique<profile_data>();
+        }
+        profiling = true;
+    }
+
+    // closes the calls a run left open and gives the top level code the time that was not spent in calls
+    void state::profile_finish(uint64_t depth, uint64_t start, uint64_t top_child)
+    {
+        while (profile->calls.size() > depth)
+        {
+            profile->leave();
+        }
+        uint64_t total = profile_now() - start;
+        uint64_t in_calls = profile->top_child_ns - top_child;
+        if (depth == 0 && total > in_calls)
+        {
+            profile->nodes[0].self_ns += total - in_calls;
+        }
+    }
+
+    // the global a function or builtin is bound to, looked up only when reporting
+    std::string state::profile_name(uint64_t callee, bool builtin)
+    {
+        if (builtin)
+        {
+            profile_builtin &b = profile->builtins[callee];
+            if (b.native != nullptr)
+            {
+                return b.native->name;
+            }
+        }
+        uint64_t size = global_vals.size();
+        for (uint64_t i = 0; i < size; i++)
+        {
+            anything &value = global_vals[i];
+            if (builtin ? (is_a_any<ANY_TYPE_FUNC>(value) && uint64_t(value.val()) == callee)
+                : (is_a_any<ANY_TYPE_USER_FN>(value) && value.place == callee))
+            {
+                return global_names[i];
+            }
+        }
+        if (builtin)
+        {
+            for (const std::pair<anything, anything> &kvp: globals[globals.size()-1])
+            {
+                if (is_a_any<ANY_TYPE_STR>(kvp.first) && is_a_any<ANY_TYPE_FUNC>(kvp.second)
+                    && uint64_t(kvp.second.val()) == callee)
+                {
+                    return any_ref<std::string>(kvp.first);
+                }
+            }
+            return "builtin";
+        }
+        return "fn@" + std::to_string(callee);
+    }
+
+    void state::profile_report(std::ostream &out)
+    {
+        if (!profile)
+        {
+            out << "the profiler has not been started" << std::endl;
+            return;
+        }
+        char line[256];
+        std::vector<std::pair<uint64_t, uint64_t>> order;
+
+        out << "opcode                     count" << std::endl;
+        for (uint64_t i = 0; i < OPCODE_TYPE_COUNT; i++)
+        {
+            if (profile->ops[i] != 0)
+            {
+                order.push_back(std::pair<uint64_t, uint64_t>(profile->ops[i], i));
+            }
+        }
+        std::sort(order.rbegin(), order.rend());
+        for (std::pair<uint64_t, uint64_t> &it: order)
+        {
+            snprintf(line, sizeof(line), "%-20s %12lu", opcode_name(it.second), (unsigned long) it.first);
+            out << line << std::endl;
+        }
+
+        out << std::endl << "function             calls      incl ms      excl ms" << std::endl;
+        order.clear();
+        for (std::pair<const uint64_t, profile_fn> &it: profile->fns)
+        {
+            order.push_back(std::pair<uint64_t, uint64_t>(it.second.excl_ns, it.first));
+        }
+        std::sort(order.rbegin(), order.rend());
+        for (std::pair<uint64_t, uint64_t> &it: order)
+        {
+            profile_fn &f = profile->fns[it.second];
+            snprintf(line, sizeof(line), "%-16s %9lu %12.3f %12.3f", profile_name(it.second, false).c_str(),
+                (unsigned long) f.calls, f.incl_ns / 1e6, f.excl_ns / 1e6);
+            out << line << std::endl;
+        }
+
+        out << std::endl << "builtin              calls           ms" << std::endl;
+        order.clear();
+        for (std::pair<const uint64_t, profile_builtin> &it: profile->builtins)
+        {
+            order.push_back(std::pair<uint64_t, uint64_t>(it.second.ns, it.first));
+        }
+        std::sort(order.rbegin(), order.rend());
+        for (std::pair<uint64_t, uint64_t> &it: order)
+        {
+            profile_builtin &b = profile->builtins[it.second];
+            snprintf(line, sizeof(line), "%-16s %9lu %12.3f", profile_name(it.second, true).c_str(),
+                (unsigned long) b.calls, b.ns / 1e6);
+            out << line << std::endl;
+        }
+
+        out << std::endl << "hottest call sites" << std::endl << "place  callee               calls           ms" << std::endl;
+        order.clear();
+        for (std::pair<const uint64_t, profile_site> &it: profile->sites)
+        {
+            order.push_back(std::pair<uint64_t, uint64_t>(it.second.ns, it.first));
+        }
+        std::sort(order.rbegin(), order.rend());
+        uint64_t shown = 0;
+        for (std::pair<uint64_t, uint64_t> &it: order)
+        {
+            if (shown ++ == 20)
+            {
+                break;
+            }
+            profile_site &s = profile->sites[it.second];
+            snprintf(line, sizeof(line), "%5lu  %-16s %9lu %12.3f", (unsigned long) it.second,
+                profile_name(s.callee, s.builtin).c_str(), (unsigned long) s.calls, s.ns / 1e6);
+            out << line << std::endl;
+        }
+    }
+
+    // one "top;caller;callee nanoseconds" line per call tree node, the format flamegraph.pl reads
+    bool state::profile_stacks(const std::string &path)
+    {
+        if (!profile)
+        {
+            return false;
+        }
+        std::ofstream out(path);
+        if (!out)
+        {
+            return false;
+        }
+        uint64_t size = profile->nodes.size();
+        std::vector<std::string> paths(size);
+        for (uint64_t i = 0; i < size; i++)
+        {
+            // parents are always made before their children
+            profile_node &n = profile->nodes[i];
+            if (i == 0)
+            {
+                paths[i] = "top";
+            }
+            else
+            {
+                paths[i] = paths[n.parent] + ";" + profile_name(n.callee, n.builtin);
+            }
+            if (n.self_ns != 0)
+            {
+                out << paths[i] << " " << n.self_ns << "\n";
+            }
+        }
+        return bool(out);
+    }
+
+    // (profile) prints the report, (profile true) and (profile false) turn the profiler on and off
+    // from the next top level form, (profile "file") writes the collapsed stacks to file
+    fn_ret builtin_profile(state *s, args_view args)
+    {
+        if (args.size() == 0)
+        {
+            s->profile_report(std::cout);
+        }
+        else if (is_a_any<ANY_TYPE_BOOL>(args[0]))
+        {
+            if (args[0].flag)
+            {
+                s->profile_start();
+            }
+            else
+            {
+                s->profiling = false;
+            }
+        }
+        else if (!s->profile_stacks(any_ref<std::string>(args[0])))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("cannot write the profile to "s
+                + any_ref<std::string>(args[0])));
+        }
+        return make_any<ANY_TYPE_NONE, none>(none());
+    }
+
+    native_fn native_profile = {"profile", builtin_profile, 0, 1, {(1 << ANY_TYPE_BOOL) | (1 << ANY_TYPE_STR)}};
+}
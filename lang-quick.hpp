@@ -0,0 +1,203 @@
+#pragma once
+#include "lang-defs.hpp"
+
+namespace lang
+{
+    // builtins the VM has specialized opcodes for
+    std::map<std::string, quick_kind> quick_names = {
+        {"add", QUICK_ADD},
+        {"sub", QUICK_SUB},
+        {"mul", QUICK_MUL},
+        {"lt", QUICK_LT},
+        {"gt", QUICK_GT},
+        {"lte", QUICK_LTE},
+        {"gte", QUICK_GTE},
+        {"eq", QUICK_EQ},
+    };
+
+    // the payload of each builtin in quick_names, used by the guards of the specialized ops
+    std::vector<void *> quick_builtins(table_type &builtins)
+    {
+        std::vector<void *> ret(QUICK_COUNT, nullptr);
+        for (std::pair<const std::string, quick_kind> &kvp: quick_names)
+        {
+            anything *got = builtins.find(make_any<ANY_TYPE_STR, std::string>(kvp.first));
+            if (got != nullptr && is_a_any<ANY_TYPE_FUNC>(*got))
+            {
+                ret[kvp.second] = got->val();
+            }
+        }
+        return ret;
+    }
+
+    // which builtin a specialized op stands in for
+    quick_kind quick_kind_of(opcode_type type)
+    {
+        switch (type)
+        {
+            case OPCODE_TYPE_INT_ADD:
+            case OPCODE_TYPE_RAT_ADD:
+            case OPCODE_TYPE_STR_CONCAT:
+            case OPCODE_TYPE_DBL_ADD:
+                return QUICK_ADD;
+            case OPCODE_TYPE_INT_SUB:
+            case OPCODE_TYPE_DBL_SUB:
+                return QUICK_SUB;
+            case OPCODE_TYPE_INT_MUL:
+            case OPCODE_TYPE_RAT_MUL:
+            case OPCODE_TYPE_DBL_MUL:
+                return QUICK_MUL;
+            case OPCODE_TYPE_INT_LT:
+            case OPCODE_TYPE_DBL_LT:
+                return QUICK_LT;
+            case OPCODE_TYPE_INT_GT:
+            case OPCODE_TYPE_DBL_GT:
+                return QUICK_GT;
+            case OPCODE_TYPE_INT_LTE:
+            case OPCODE_TYPE_DBL_LTE:
+                return QUICK_LTE;
+            case OPCODE_TYPE_INT_GTE:
+            case OPCODE_TYPE_DBL_GTE:
+                return QUICK_GTE;
+            default:
+                return QUICK_EQ;
+        }
+    }
+
+    // picks the specialized op for a two argument call, or FUNC_CALL if there is none
+    opcode_type state::quicken(const anything &fn, const anything &a, const anything &b)
+    {
+        void *payload = fn.val();
+        uint64_t kind = 0;
+        while (kind < QUICK_COUNT && quick_fns[kind] != payload)
+        {
+            kind ++;
+        }
+        if (kind == QUICK_COUNT || a.type != b.type)
+        {
+            return OPCODE_TYPE_FUNC_CALL;
+        }
+        if (is_a_any<ANY_TYPE_INT>(a))
+        {
+            switch (kind)
+            {
+                case QUICK_ADD: return OPCODE_TYPE_INT_ADD;
+                case QUICK_SUB: return OPCODE_TYPE_INT_SUB;
+                case QUICK_MUL: return OPCODE_TYPE_INT_MUL;
+                case QUICK_LT: return OPCODE_TYPE_INT_LT;
+                case QUICK_GT: return OPCODE_TYPE_INT_GT;
+                case QUICK_LTE: return OPCODE_TYPE_INT_LTE;
+                case QUICK_GTE: return OPCODE_TYPE_INT_GTE;
+                case QUICK_EQ: return OPCODE_TYPE_INT_EQ;
+            }
+        }
+        if (is_a_any<ANY_TYPE_RAT>(a))
+        {
+            switch (kind)
+            {
+                case QUICK_ADD: return OPCODE_TYPE_RAT_ADD;
+                case QUICK_MUL: return OPCODE_TYPE_RAT_MUL;
+            }
+        }
+        if (is_a_any<ANY_TYPE_DOUBLE>(a))
+        {
+            switch (kind)
+            {
+                case QUICK_ADD: return OPCODE_TYPE_DBL_ADD;
+                case QUICK_SUB: return OPCODE_TYPE_DBL_SUB;
+                case QUICK_MUL: return OPCODE_TYPE_DBL_MUL;
+                case QUICK_LT: return OPCODE_TYPE_DBL_LT;
+                case QUICK_GT: return OPCODE_TYPE_DBL_GT;
+                case QUICK_LTE: return OPCODE_TYPE_DBL_LTE;
+                case QUICK_GTE: return OPCODE_TYPE_DBL_GTE;
+                case QUICK_EQ: return OPCODE_TYPE_DBL_EQ;
+            }
+        }
+        if (is_a_any<ANY_TYPE_STR>(a) && kind == QUICK_ADD)
+        {
+            return OPCODE_TYPE_STR_CONCAT;
+        }
+        return OPCODE_TYPE_FUNC_CALL;
+    }
+
+    // what the DBL_ ops and the double side of the arithmetic builtins compute
+    anything double_op(quick_kind kind, double a, double b)
+    {
+        switch (kind)
+        {
+            case QUICK_ADD: return make_any<ANY_TYPE_DOUBLE, double>(a + b);
+            case QUICK_SUB: return make_any<ANY_TYPE_DOUBLE, double>(a - b);
+            case QUICK_MUL: return make_any<ANY_TYPE_DOUBLE, double>(a * b);
+            case QUICK_LT: return make_any<ANY_TYPE_BOOL, bool>(a < b);
+            case QUICK_GT: return make_any<ANY_TYPE_BOOL, bool>(a > b);
+            case QUICK_LTE: return make_any<ANY_TYPE_BOOL, bool>(a <= b);
+            case QUICK_GTE: return make_any<ANY_TYPE_BOOL, bool>(a >= b);
+            default: return make_any<ANY_TYPE_BOOL, bool>(a == b);
+        }
+    }
+
+    // the machine int fast path of the INT_ ops, false when an operand is a bignum or the result overflows
+    bool quick_int(opcode_type type, const anything &a, const anything &b, anything &out)
+    {
+        if (!is_small_int(a) || !is_small_int(b))
+        {
+            return false;
+        }
+        int64_t got;
+        switch (type)
+        {
+            case OPCODE_TYPE_INT_ADD:
+            {
+                if (__builtin_add_overflow(a.num, b.num, &got))
+                {
+                    return false;
+                }
+                out = make_small_int(got);
+                return true;
+            }
+            case OPCODE_TYPE_INT_SUB:
+            {
+                if (__builtin_sub_overflow(a.num, b.num, &got))
+                {
+                    return false;
+                }
+                out = make_small_int(got);
+                return true;
+            }
+            case OPCODE_TYPE_INT_MUL:
+            {
+                if (__builtin_mul_overflow(a.num, b.num, &got))
+                {
+                    return false;
+                }
+                out = make_small_int(got);
+                return true;
+            }
+            case OPCODE_TYPE_INT_LT:
+            {
+                out = make_any<ANY_TYPE_BOOL, bool>(a.num < b.num);
+                return true;
+            }
+            case OPCODE_TYPE_INT_GT:
+            {
+                out = make_any<ANY_TYPE_BOOL, bool>(a.num > b.num);
+                return true;
+            }
+            case OPCODE_TYPE_INT_LTE:
+            {
+                out = make_any<ANY_TYPE_BOOL, bool>(a.num <= b.num);
+                return true;
+            }
+            case OPCODE_TYPE_INT_GTE:
+            {
+                out = make_any<ANY_TYPE_BOOL, bool>(a.num >= b.num);
+                return true;
+            }
+            default:
+            {
+                out = make_any<ANY_TYPE_BOOL, bool>(a.num == b.num);
+                return true;
+            }
+        }
+    }
+}
@@ -0,0 +1,718 @@
+#pragma once
+#include "lang-defs.hpp"
+
+namespace lang
+{
+    // the register VM, picked with opts.registers
+    // comp walks the same tree as state::comp but gives every value a register of the fn it is in
+    // the registers of a call are a window of vm_stack starting at the frame base
+    // the parameters come first, then every local a def in the body can make, then temporaries
+    // a call puts its arguments in consecutive temporaries, which become the first registers of the callee
+
+    uint64_t state::reg_emit(reg_op_type type, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e)
+    {
+        reg_op op;
+        op.type = type;
+        op.a = a;
+        op.b = b;
+        op.c = c;
+        op.d = d;
+        op.e = e;
+        reg_code.push_back(op);
+        return reg_code.size()-1;
+    }
+
+    uint32_t state::reg_alloc()
+    {
+        uint32_t ret = reg_next;
+        reg_next ++;
+        if (reg_next > reg_high)
+        {
+            reg_high = reg_next;
+        }
+        return ret;
+    }
+
+    uint32_t state::reg_constant(const anything &value)
+    {
+        helpers.push_back(value);
+        return uint32_t(helpers.size()-1) | reg_const;
+    }
+
+    bool reg_is_index(const state &s, const node &n)
+    {
+        return n.tok != no_node && s.toks[n.tok].type == TOKEN_TYPE_NAME && s.toks[n.tok].token == "#";
+    }
+
+    bool reg_is_special(const state &s, const node &n, const char *name)
+    {
+        return n.tok != no_node && s.toks[n.tok].type == TOKEN_TYPE_NAME && s.toks[n.tok].token == name;
+    }
+
+    // how many defs n has outside of the fns in it, an upper bound on the locals they make
+    uint64_t reg_defs(const state &s, const node &n)
+    {
+        if (n.tok != no_node || n.first_child == no_node)
+        {
+            return 0;
+        }
+        const node &head = s.tree.nodes[n.first_child];
+        if (reg_is_special(s, head, "fn"))
+        {
+            return 0;
+        }
+        uint64_t ret = reg_is_special(s, head, "def") ? 1 : 0;
+        for (uint64_t c = n.first_child; c != no_node; c = s.tree.nodes[c].next_sibling)
+        {
+            ret += reg_defs(s, s.tree.nodes[c]);
+        }
+        return ret;
+    }
+
+    // compiles n so its value ends up in dst
+    void state::reg_to(const node &n, uint32_t dst)
+    {
+        uint32_t got = reg_expr(n, dst);
+        if (got != dst)
+        {
+            reg_emit(REG_OP_MOVE, dst, got);
+        }
+    }
+
+    // compiles the children of n from the first-th on into consecutive new registers
+    // a # child is an index of the two values before it, so it leaves one in their place
+    // returns how many values there are, they start at the reg_next from before
+    uint32_t state::reg_values(const node &n, uint64_t first)
+    {
+        uint32_t start = reg_next;
+        uint32_t count = 0;
+        uint64_t i = 0;
+        for (uint64_t c = n.first_child; c != no_node; c = tree.nodes[c].next_sibling, i++)
+        {
+            if (i < first)
+            {
+                continue;
+            }
+            const node &ch = tree.nodes[c];
+            if (reg_is_index(*this, ch))
+            {
+                if (count < 2)
+                {
+                    std::cout << "nothing to index" << std::endl;
+                    comp_errors ++;
+                    continue;
+                }
+                count --;
+                reg_emit(REG_OP_CALL_GLOBAL, start+count-1, start+count-1, 2, intern_global("index"));
+                reg_next = start+count;
+                continue;
+            }
+            uint32_t at = reg_alloc();
+            reg_to(ch, at);
+            reg_next = at+1;
+            count ++;
+        }
+        return count;
+    }
+
+    // a call that is not a special form, the result goes to dst
+    uint32_t state::reg_call(const node &n, uint32_t dst, bool tail)
+    {
+        const node &head = tree.nodes[n.first_child];
+        uint64_t slashes = 0;
+        for (uint64_t c = n.first_child; c != no_node; c = tree.nodes[c].next_sibling)
+        {
+            if (reg_is_index(*this, tree.nodes[c]))
+            {
+                slashes ++;
+            }
+        }
+        bool named = head.tok != no_node && toks[head.tok].type == TOKEN_TYPE_NAME && !reg_is_index(*this, head)
+            && (head.next_sibling == no_node || !reg_is_index(*this, tree.nodes[head.next_sibling]));
+        uint32_t start = reg_next;
+        if (named && slashes == 0 && n.child_count == 3 && find_local(toks[head.tok].token) < 0)
+        {
+            // the arguments are used where they are, they are only copied for a call of a fn
+            uint32_t pair = reg_alloc();
+            reg_alloc();
+            const node &lhs = tree.child(n, 1);
+            const node &rhs = tree.child(n, 2);
+            uint32_t x = reg_expr(lhs, pair);
+            reg_next = pair+2;
+            if (x != pair && !(x & reg_const) && reg_defs(*this, rhs) != 0)
+            {
+                // the second argument can change the local the first one reads
+                reg_emit(REG_OP_MOVE, pair, x);
+                x = pair;
+            }
+            uint32_t y = reg_expr(rhs, pair+1);
+            reg_next = start;
+            reg_emit(tail ? REG_OP_TAIL_CALL_GLOBAL2 : REG_OP_CALL_GLOBAL2, dst, x, y,
+                intern_global(std::string(toks[head.tok].token)), pair);
+            return dst;
+        }
+        if (named)
+        {
+            uint32_t argc = reg_values(n, 1);
+            int64_t local = find_local(toks[head.tok].token);
+            if (local >= 0)
+            {
+                reg_emit(tail ? REG_OP_TAIL_CALL : REG_OP_CALL, dst, start, argc, local);
+            }
+            else
+            {
+                reg_emit(tail ? REG_OP_TAIL_CALL_GLOBAL : REG_OP_CALL_GLOBAL, dst, start, argc,
+                    intern_global(std::string(toks[head.tok].token)));
+            }
+            reg_next = start;
+            return dst;
+        }
+        uint32_t count = reg_values(n, 0);
+        reg_next = start;
+        if (count == 0)
+        {
+            std::cout << "nothing to call" << std::endl;
+            comp_errors ++;
+            return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+        }
+        reg_emit(tail ? REG_OP_TAIL_CALL : REG_OP_CALL, dst, start+1, count-1, start);
+        return dst;
+    }
+
+    // compiles n and returns where its value is
+    // that is dst, which n may write to, or a local or constant that is left alone
+    uint32_t state::reg_expr(const node &n, uint32_t dst)
+    {
+        bool tail = comp_tail;
+        comp_tail = false;
+        if (n.tok != no_node)
+        {
+            const token &t = toks[n.tok];
+            switch (t.type)
+            {
+                case TOKEN_TYPE_NAME:
+                {
+                    if (t.token == "#")
+                    {
+                        std::cout << "nothing to index" << std::endl;
+                        comp_errors ++;
+                        return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+                    }
+                    int64_t local = find_local(t.token);
+                    if (local >= 0)
+                    {
+                        return local;
+                    }
+                    reg_emit(REG_OP_LOAD_GLOBAL, dst, intern_global(std::string(t.token)));
+                    return dst;
+                }
+                case TOKEN_TYPE_INT:
+                    return reg_constant(make_any<ANY_TYPE_INT, mpz_int>(mpz_int(std::string(t.token))));
+                case TOKEN_TYPE_STR:
+                    return reg_constant(make_any<ANY_TYPE_STR, std::string>(std::string(t.token)));
+                case TOKEN_TYPE_DOUBLE:
+                    return reg_constant(make_any<ANY_TYPE_DOUBLE, double>(strtod(std::string(t.token).c_str(), nullptr)));
+                case TOKEN_TYPE_FLOAT:
+                    return reg_constant(make_any<ANY_TYPE_RAT, mpq_rational>(strtorat(std::string(t.token))));
+                default:
+                    std::cout << "unknown token past ast" << t.token << std::endl;
+                    comp_errors ++;
+                    return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+            }
+        }
+        if (n.child_count == 0)
+        {
+            std::cout << "cannot have empty call" << std::endl;
+            comp_errors ++;
+            return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+        }
+        const node &head = tree.nodes[n.first_child];
+        if (reg_is_special(*this, head, "def"))
+        {
+            if (n.child_count != 3)
+            {
+                std::cout << "def takes 2 arguments" << std::endl;
+                comp_errors ++;
+                return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+            }
+            const node &ch1 = tree.child(n, 1);
+            if (ch1.tok == no_node || toks[ch1.tok].type != TOKEN_TYPE_NAME)
+            {
+                std::cout << "def takes 2 arguments, the first must be a name" << std::endl;
+                comp_errors ++;
+                return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+            }
+            std::string defname(toks[ch1.tok].token);
+            if (scopes.size() == 0)
+            {
+                uint32_t got = reg_expr(tree.child(n, 2), dst);
+                reg_emit(REG_OP_STORE_GLOBAL, intern_global(defname), got);
+                return got;
+            }
+            // a local that already exists is written in place, a new one is made after its value
+            int64_t local = find_local(defname);
+            if (local >= 0)
+            {
+                reg_to(tree.child(n, 2), local);
+                return local;
+            }
+            uint32_t got = reg_expr(tree.child(n, 2), dst);
+            local = scopes[scopes.size()-1].locals.size();
+            scopes[scopes.size()-1].locals.push_back(defname);
+            reg_emit(REG_OP_MOVE, local, got);
+            return local;
+        }
+        if (reg_is_special(*this, head, "fn"))
+        {
+            uint64_t fnsize = n.child_count;
+            if (fnsize != 2 && fnsize != 3)
+            {
+                std::cout << "fn takes 2 or 3 args" << std::endl;
+                comp_errors ++;
+                return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+            }
+            comp_scope scope;
+            if (fnsize == 3)
+            {
+                const node &params = tree.child(n, 1);
+                for (uint64_t c = params.first_child; c != no_node; c = tree.nodes[c].next_sibling)
+                {
+                    const node &p = tree.nodes[c];
+                    if (p.tok == no_node || toks[p.tok].type != TOKEN_TYPE_NAME)
+                    {
+                        std::cout << "fn parameters must be names" << std::endl;
+                        comp_errors ++;
+                        return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+                    }
+                    scope.locals.push_back(std::string(toks[p.tok].token));
+                }
+            }
+            const node &body = tree.child(n, fnsize-1);
+            uint32_t argc = scope.locals.size();
+            uint32_t outer_next = reg_next;
+            uint32_t outer_high = reg_high;
+            scopes.push_back(scope);
+            uint64_t over = reg_emit(REG_OP_JMP, 0);
+            uint64_t enter = reg_emit(REG_OP_ENTER, argc);
+            reg_next = argc + reg_defs(*this, body);
+            reg_high = reg_next;
+            uint32_t result = reg_alloc();
+            comp_tail = true;
+            uint32_t got = reg_expr(body, result);
+            reg_emit(REG_OP_RET, got);
+            reg_code[enter].b = reg_high;
+            reg_code[over].a = reg_code.size();
+            scopes.pop_back();
+            reg_next = outer_next;
+            reg_high = outer_high;
+            // the fn never changes, so it is a constant rather than an op
+            user_fn f;
+            f.op_place = enter;
+            return reg_constant(make_any<ANY_TYPE_USER_FN, user_fn>(f));
+        }
+        if (reg_is_special(*this, head, "while"))
+        {
+            if (n.child_count != 3)
+            {
+                std::cout << "while takes 2 arguments" << std::endl;
+                comp_errors ++;
+                return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+            }
+            // dst can be a local the loop reads, so it is not used as scratch
+            uint32_t scratch = reg_alloc();
+            uint64_t begin = reg_code.size();
+            uint32_t cond = reg_expr(tree.child(n, 1), scratch);
+            uint64_t test = reg_emit(REG_OP_JMP_IF_NOT, 0, cond);
+            reg_expr(tree.child(n, 2), scratch);
+            reg_emit(REG_OP_JMP, begin);
+            reg_code[test].a = reg_code.size();
+            reg_next = scratch;
+            return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+        }
+        if (reg_is_special(*this, head, "if"))
+        {
+            if (n.child_count != 3 && n.child_count != 4)
+            {
+                std::cout << "if takes 2 or 3 arguments" << std::endl;
+                comp_errors ++;
+                return reg_constant(make_any<ANY_TYPE_NONE, none>(none()));
+            }
+            uint32_t scratch = reg_alloc();
+            uint32_t cond = reg_expr(tree.child(n, 1), scratch);
+            reg_next = scratch;
+            uint64_t test = reg_emit(REG_OP_JMP_IF_NOT, 0, cond);
+            comp_tail = tail;
+            reg_to(tree.child(n, 2), dst);
+            uint64_t over = reg_emit(REG_OP_JMP, 0);
+            reg_code[test].a = reg_code.size();
+            if (n.child_count == 4)
+            {
+                comp_tail = tail;
+                reg_to(tree.child(n, 3), dst);
+            }
+            else
+            {
+                reg_emit(REG_OP_MOVE, dst, reg_constant(make_any<ANY_TYPE_NONE, none>(none())));
+            }
+            reg_code[over].a = reg_code.size();
+            return dst;
+        }
+        return reg_call(n, dst, tail);
+    }
+
+    // compiles the current tree as one top level form, true if it had errors
+    bool state::reg_comp()
+    {
+        uint64_t errs = comp_errors;
+        reg_next = 0;
+        reg_high = 0;
+        uint64_t space = reg_emit(REG_OP_SPACE, 0);
+        reg_values(tree.nodes[root], 0);
+        reg_code[space].a = reg_high;
+        return comp_errors != errs;
+    }
+
+    // true when both operands are what the specialized op was made for
+    bool reg_quick_guard(opcode_type type, const anything &a, const anything &b)
+    {
+        switch (type)
+        {
+            case OPCODE_TYPE_RAT_ADD:
+            case OPCODE_TYPE_RAT_MUL:
+                return is_a_any<ANY_TYPE_RAT>(a) && is_a_any<ANY_TYPE_RAT>(b);
+            case OPCODE_TYPE_STR_CONCAT:
+                return is_a_any<ANY_TYPE_STR>(a) && is_a_any<ANY_TYPE_STR>(b);
+            case OPCODE_TYPE_DBL_ADD:
+            case OPCODE_TYPE_DBL_SUB:
+            case OPCODE_TYPE_DBL_MUL:
+            case OPCODE_TYPE_DBL_LT:
+            case OPCODE_TYPE_DBL_GT:
+            case OPCODE_TYPE_DBL_LTE:
+            case OPCODE_TYPE_DBL_GTE:
+            case OPCODE_TYPE_DBL_EQ:
+                return is_a_any<ANY_TYPE_DOUBLE>(a) && is_a_any<ANY_TYPE_DOUBLE>(b);
+            default:
+                return is_a_any<ANY_TYPE_INT>(a) && is_a_any<ANY_TYPE_INT>(b);
+        }
+    }
+
+    // what the specialized stack ops do, false for bignums and overflow, which go to the builtin
+    // out can be a or b
+    bool reg_quick(opcode_type type, const anything &a, const anything &b, anything &out)
+    {
+        switch (type)
+        {
+            case OPCODE_TYPE_RAT_ADD:
+                out = make_any<ANY_TYPE_RAT, mpq_rational>(any_ref<mpq_rational>(a) + any_ref<mpq_rational>(b));
+                return true;
+            case OPCODE_TYPE_RAT_MUL:
+                out = make_any<ANY_TYPE_RAT, mpq_rational>(any_ref<mpq_rational>(a) * any_ref<mpq_rational>(b));
+                return true;
+            case OPCODE_TYPE_STR_CONCAT:
+                out = make_any<ANY_TYPE_STR, std::string>(any_ref<std::string>(a) + any_ref<std::string>(b));
+                return true;
+            case OPCODE_TYPE_DBL_ADD:
+            case OPCODE_TYPE_DBL_SUB:
+            case OPCODE_TYPE_DBL_MUL:
+            case OPCODE_TYPE_DBL_LT:
+            case OPCODE_TYPE_DBL_GT:
+            case OPCODE_TYPE_DBL_LTE:
+            case OPCODE_TYPE_DBL_GTE:
+            case OPCODE_TYPE_DBL_EQ:
+                out = double_op(quick_kind_of(type), a.dbl, b.dbl);
+                return true;
+            default:
+                return quick_int(type, a, b, out);
+        }
+    }
+
+#ifdef LANG_THREADED
+#define REG_CASE(type) label_##type:
+#define REG_JUMP() \
+    if (place == brk) goto reg_done; \
+    op = &reg_code[place]; \
+    goto *dispatch[op->type]
+#else
+#define REG_CASE(type) case type:
+#define REG_JUMP() \
+    if (place == brk) goto reg_done; \
+    continue
+#endif
+#define REG_NEXT() \
+    place ++; \
+    REG_JUMP()
+#define REG_FAIL(err) \
+    errors.push(err); \
+    goto reg_fail
+// an operand that can be a constant
+#define REG_RK(o) ((o) & reg_const ? helpers[(o) & ~reg_const] : regs[o])
+
+    // runs reg_code from place up to brk, true if it failed
+    // there is no profiling or jit here, both only know the stack VM
+    bool state::reg_run(uint64_t place, uint64_t brk)
+    {
+        if (place == brk)
+        {
+            return false;
+        }
+        reg_op *op = &reg_code[place];
+        // the form starts at the bottom of vm_stack, what is already there are its first registers
+        uint64_t base = 0; // of the frame running, the top level form until a call
+        uint64_t form_base = base;
+        uint64_t form_top = base;
+        anything *regs = vm_stack.data() + base;
+        // what a call is calling, set before going to reg_call
+        anything *callee = nullptr;
+        uint32_t argbase = 0;
+        uint32_t argc = 0;
+        bool tail = false;
+#ifdef LANG_THREADED
+        // in reg_op_type order
+        static void *dispatch[] = {
+            &&label_REG_OP_SPACE,
+            &&label_REG_OP_ENTER,
+            &&label_REG_OP_RET,
+            &&label_REG_OP_MOVE,
+            &&label_REG_OP_LOAD_GLOBAL,
+            &&label_REG_OP_STORE_GLOBAL,
+            &&label_REG_OP_JMP,
+            &&label_REG_OP_JMP_IF_NOT,
+            &&label_REG_OP_CALL,
+            &&label_REG_OP_CALL_GLOBAL,
+            &&label_REG_OP_TAIL_CALL,
+            &&label_REG_OP_TAIL_CALL_GLOBAL,
+            &&label_REG_OP_CALL_GLOBAL2,
+            &&label_REG_OP_TAIL_CALL_GLOBAL2,
+        };
+        goto *dispatch[op->type];
+#else
+        while (true)
+        {
+            op = &reg_code[place];
+            switch (op->type)
+            {
+#endif
+                REG_CASE(REG_OP_SPACE)
+                {
+                    vm_stack.resize(base + op->a, make_any<ANY_TYPE_NONE, none>(none()));
+                    form_top = vm_stack.size();
+                    regs = vm_stack.data() + base;
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_ENTER)
+                {
+                    frame &f = ret_stack[ret_stack.size()-1];
+                    if (f.argc != op->a)
+                    {
+                        REG_FAIL(errors::str_error("function takes "s + std::to_string(op->a)
+                            + " arguments, got " + std::to_string(f.argc)));
+                    }
+                    // what the caller left above the arguments goes, the locals start out as none
+                    vm_stack.resize(base + f.argc);
+                    vm_stack.resize(base + op->b, make_any<ANY_TYPE_NONE, none>(none()));
+                    f.top = vm_stack.size();
+                    regs = vm_stack.data() + base;
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_RET)
+                {
+                    anything got = REG_RK(op->a);
+                    frame f = ret_stack[ret_stack.size()-1];
+                    ret_stack.pop_back();
+                    uint64_t top = form_top;
+                    base = form_base;
+                    if (ret_stack.size() != 0)
+                    {
+                        base = ret_stack[ret_stack.size()-1].base;
+                        top = ret_stack[ret_stack.size()-1].top;
+                    }
+                    vm_stack.resize(top);
+                    regs = vm_stack.data() + base;
+                    place = f.ret;
+                    op = &reg_code[place];
+                    regs[op->a] = std::move(got);
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_MOVE)
+                {
+                    regs[op->a] = REG_RK(op->b);
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_LOAD_GLOBAL)
+                {
+                    anything &value = global_vals[op->b];
+                    if (is_a_any<ANY_TYPE_UNBOUND>(value))
+                    {
+                        REG_FAIL(errors::str_error("cannot load global "s + global_names[op->b]));
+                    }
+                    regs[op->a] = value;
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_STORE_GLOBAL)
+                {
+                    global_vals[op->a] = REG_RK(op->b);
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_JMP)
+                {
+                    place = op->a;
+                    REG_JUMP();
+                }
+                REG_CASE(REG_OP_JMP_IF_NOT)
+                {
+                    anything &val = REG_RK(op->b);
+                    if (!is_a_any<ANY_TYPE_BOOL>(val) || !val.flag)
+                    {
+                        place = op->a;
+                        REG_JUMP();
+                    }
+                    REG_NEXT();
+                }
+                REG_CASE(REG_OP_CALL)
+                REG_CASE(REG_OP_TAIL_CALL)
+                {
+                    callee = &REG_RK(op->d);
+                    argbase = op->b;
+                    argc = op->c;
+                    tail = op->type == REG_OP_TAIL_CALL;
+                    goto reg_call;
+                }
+                REG_CASE(REG_OP_CALL_GLOBAL)
+                REG_CASE(REG_OP_TAIL_CALL_GLOBAL)
+                {
+                    callee = &global_vals[op->d];
+                    if (is_a_any<ANY_TYPE_UNBOUND>(*callee))
+                    {
+                        REG_FAIL(errors::str_error("cannot load global "s + global_names[op->d]));
+                    }
+                    argbase = op->b;
+                    argc = op->c;
+                    tail = op->type == REG_OP_TAIL_CALL_GLOBAL;
+                    goto reg_call;
+                }
+                REG_CASE(REG_OP_CALL_GLOBAL2)
+                REG_CASE(REG_OP_TAIL_CALL_GLOBAL2)
+                {
+                    callee = &global_vals[op->d];
+                    anything &x = REG_RK(op->b);
+                    anything &y = REG_RK(op->c);
+                    if (op->quick != OPCODE_TYPE_FUNC_CALL)
+                    {
+                        if (callee->val() == quick_fns[quick_kind_of(op->quick)] && reg_quick_guard(op->quick, x, y))
+                        {
+                            if (reg_quick(op->quick, x, y, regs[op->a]))
+                            {
+                                REG_NEXT();
+                            }
+                            // bignums and overflow keep the site but take the builtin
+                        }
+                        else
+                        {
+                            op->quick = OPCODE_TYPE_FUNC_CALL;
+                            op->misses ++;
+                        }
+                    }
+                    else if (opts.quicken && op->misses < 4 && is_a_any<ANY_TYPE_FUNC>(*callee))
+                    {
+                        op->quick = quicken(*callee, x, y);
+                        if (op->quick != OPCODE_TYPE_FUNC_CALL)
+                        {
+                            REG_JUMP();
+                        }
+                        op->misses ++;
+                    }
+                    if (is_a_any<ANY_TYPE_UNBOUND>(*callee))
+                    {
+                        REG_FAIL(errors::str_error("cannot load global "s + global_names[op->d]));
+                    }
+                    // x is a local, a constant or already in e, y the same with e+1
+                    if (&x != &regs[op->e])
+                    {
+                        regs[op->e] = x;
+                    }
+                    if (&y != &regs[op->e+1])
+                    {
+                        regs[op->e+1] = y;
+                    }
+                    argbase = op->e;
+                    argc = 2;
+                    tail = op->type == REG_OP_TAIL_CALL_GLOBAL2;
+                    goto reg_call;
+                }
+            reg_call:
+                {
+                    if (is_a_any<ANY_TYPE_USER_FN>(*callee))
+                    {
+                        uint64_t target = callee->place;
+                        if (tail && ret_stack.size() != 0)
+                        {
+                            // the arguments become the first registers of this frame
+                            std::move(regs+argbase, regs+argbase+argc, regs);
+                            ret_stack[ret_stack.size()-1].argc = argc;
+                            place = target;
+                            REG_JUMP();
+                        }
+                        if (ret_stack.size() >= max_depth)
+                        {
+                            REG_FAIL(errors::str_error("more than "s + std::to_string(max_depth) + " nested function calls"));
+                        }
+                        frame f;
+                        f.ret = place;
+                        f.base = base + argbase;
+                        f.argc = argc;
+                        f.top = f.base + argc;
+                        ret_stack.push_back(f);
+                        base = f.base;
+                        regs = vm_stack.data() + base;
+                        place = target;
+                        REG_JUMP();
+                    }
+                    fn_ret got;
+                    if (is_a_any<ANY_TYPE_FUNC>(*callee))
+                    {
+                        got = call_func(*callee, regs+argbase, argc);
+                    }
+                    else if (is_a_any<ANY_TYPE_NATIVE>(*callee))
+                    {
+                        args_view args = {regs+argbase, argc};
+                        got = call_native(callee->native, args);
+                    }
+                    else
+                    {
+                        REG_FAIL(errors::str_error("cannot call a "s + aux::get_type(*callee)));
+                    }
+                    if (is_a_any<ANY_TYPE_ERROR>(got))
+                    {
+                        REG_FAIL(any_ref<errors::str_error>(got));
+                    }
+                    if (errors.size() > 0)
+                    {
+                        goto reg_fail;
+                    }
+                    regs = vm_stack.data() + base;
+                    regs[op->a] = std::move(got);
+                    gc_safepoint();
+                    REG_NEXT();
+                }
+#ifndef LANG_THREADED
+                default:
+                {
+                    REG_FAIL(errors::str_error("unknown opcode "s + std::to_string(op->type)));
+                }
+            }
+        }
+#endif
+    reg_done:
+        return false;
+    reg_fail:
+        errors.top().show_error();
+        errors.pop();
+        return true;
+    }
+
+#undef REG_CASE
+#undef REG_JUMP
+#undef REG_NEXT
+#undef REG_FAIL
+#undef REG_RK
+}
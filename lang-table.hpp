@@ -0,0 +1,337 @@
+#pragma once
+#include "lang-defs.hpp"
+#include <cmath>
+#include <cstring>
+
+namespace lang
+{
+    uint64_t hash_mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    uint64_t hash_mpz(mpz_srcptr z)
+    {
+        uint64_t h = mpz_sgn(z) + 7;
+        uint64_t size = mpz_size(z);
+        for (uint64_t i = 0; i < size; i++)
+        {
+            h = hash_mix(h ^ mpz_getlimbn(z, i));
+        }
+        return h;
+    }
+
+    // returns false for values that cannot be table keys
+    bool hash_key(const anything &key, uint64_t &out)
+    {
+        uint64_t h;
+        switch (key.type)
+        {
+            case ANY_TYPE_STR:
+            {
+                h = std::hash<std::string>()(*static_cast<std::string *>(key.ptr));
+                break;
+            }
+            case ANY_TYPE_INT:
+            {
+                if (key.boxed)
+                {
+                    h = hash_mpz(static_cast<mpz_int *>(key.ptr)->backend().data());
+                }
+                else
+                {
+                    h = hash_mix(key.num);
+                }
+                break;
+            }
+            case ANY_TYPE_RAT:
+            {
+                mpq_srcptr q = static_cast<mpq_rational *>(key.ptr)->backend().data();
+                h = hash_mpz(mpq_numref(q)) * 31 + hash_mpz(mpq_denref(q));
+                break;
+            }
+            case ANY_TYPE_BOOL:
+            {
+                h = key.flag ? 1 : 2;
+                break;
+            }
+            case ANY_TYPE_DOUBLE:
+            {
+                // -0.0 is the same key as 0.0 and every nan is one key, see same_key
+                double d = key.dbl == 0 ? 0.0 : std::isnan(key.dbl) ? NAN : key.dbl;
+                memcpy(&h, &d, sizeof(h));
+                break;
+            }
+            case ANY_TYPE_NONE:
+            {
+                h = 3;
+                break;
+            }
+            default:
+            {
+                return false;
+            }
+        }
+        out = hash_mix(h + key.type);
+        return true;
+    }
+
+    // only called on keys that already passed hash_key
+    bool same_key(const anything &a, const anything &b)
+    {
+        if (a.type != b.type)
+        {
+            return false;
+        }
+        switch (a.type)
+        {
+            case ANY_TYPE_STR:
+            {
+                return *static_cast<std::string *>(a.ptr) == *static_cast<std::string *>(b.ptr);
+            }
+            case ANY_TYPE_INT:
+            {
+                // ints are normalized by make_any so a boxed int never equals an inline one
+                if (!a.boxed || !b.boxed)
+                {
+                    return !a.boxed && !b.boxed && a.num == b.num;
+                }
+                return *static_cast<mpz_int *>(a.ptr) == *static_cast<mpz_int *>(b.ptr);
+            }
+            case ANY_TYPE_RAT:
+            {
+                return *static_cast<mpq_rational *>(a.ptr) == *static_cast<mpq_rational *>(b.ptr);
+            }
+            case ANY_TYPE_BOOL:
+            {
+                return a.flag == b.flag;
+            }
+            case ANY_TYPE_DOUBLE:
+            {
+                return a.dbl == b.dbl || (std::isnan(a.dbl) && std::isnan(b.dbl));
+            }
+            default:
+            {
+                return true;
+            }
+        }
+    }
+
+    // a table is an array part holding the values of the keys 0, 1, 2 ...
+    // followed by an insertion ordered hash part for every other key
+    // the array part only grows while the hash part is empty, so the two in turn are in insertion order
+    // the hash part is open addressed with linear probing
+    struct table_type
+    {
+        struct slot
+        {
+            uint64_t hash;
+            uint64_t pos; // index into entries plus one, zero means empty
+        };
+
+        struct iterator
+        {
+            const table_type *table;
+            uint64_t i;
+            std::pair<anything, anything> operator*() const;
+            iterator &operator++();
+            bool operator!=(const iterator &) const;
+        };
+
+        std::vector<anything> array;
+        std::vector<std::pair<anything, anything>> entries;
+        std::vector<slot> index;
+
+        table_type() = default;
+        table_type(std::initializer_list<std::pair<anything, anything>>);
+        anything *find(const anything &);
+        const anything *find(const anything &) const;
+        bool set(const anything &, const anything &);
+        void push_back(const std::pair<anything, anything> &);
+        uint64_t size() const;
+        bool empty() const;
+        iterator begin() const;
+        iterator end() const;
+    private:
+        uint64_t find_slot(const anything &, uint64_t) const;
+        void rehash(uint64_t);
+        static bool array_key(const anything &, uint64_t &);
+    };
+
+    table_type::table_type(std::initializer_list<std::pair<anything, anything>> kvps)
+    {
+        for (const std::pair<anything, anything> &kvp: kvps)
+        {
+            push_back(kvp);
+        }
+    }
+
+    bool table_type::array_key(const anything &key, uint64_t &out)
+    {
+        if (key.type == ANY_TYPE_INT && !key.boxed && key.num >= 0)
+        {
+            out = key.num;
+            return true;
+        }
+        return false;
+    }
+
+    // returns the index slot holding key or the empty slot it would go in
+    uint64_t table_type::find_slot(const anything &key, uint64_t hash) const
+    {
+        uint64_t mask = index.size()-1;
+        uint64_t i = hash & mask;
+        while (index[i].pos != 0)
+        {
+            if (index[i].hash == hash && same_key(entries[index[i].pos-1].first, key))
+            {
+                return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void table_type::rehash(uint64_t size)
+    {
+        index = std::vector<slot>(size, slot{0, 0});
+        uint64_t mask = size-1;
+        uint64_t count = entries.size();
+        for (uint64_t e = 0; e < count; e++)
+        {
+            uint64_t hash;
+            if (!hash_key(entries[e].first, hash))
+            {
+                continue;
+            }
+            uint64_t i = hash & mask;
+            while (index[i].pos != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            index[i] = slot{hash, e+1};
+        }
+    }
+
+    anything *table_type::find(const anything &key)
+    {
+        return const_cast<anything *>(static_cast<const table_type *>(this)->find(key));
+    }
+
+    const anything *table_type::find(const anything &key) const
+    {
+        uint64_t at;
+        if (array_key(key, at) && at < array.size())
+        {
+            return &array[at];
+        }
+        uint64_t hash;
+        if (index.size() == 0 || !hash_key(key, hash))
+        {
+            return nullptr;
+        }
+        const slot &s = index[find_slot(key, hash)];
+        if (s.pos == 0)
+        {
+            return nullptr;
+        }
+        return &entries[s.pos-1].second;
+    }
+
+    bool table_type::set(const anything &key, const anything &value)
+    {
+        uint64_t at;
+        bool is_array_key = array_key(key, at);
+        if (is_array_key && at < array.size())
+        {
+            array[at] = value;
+            return true;
+        }
+        uint64_t hash;
+        if (!hash_key(key, hash))
+        {
+            return false;
+        }
+        if (index.size() != 0)
+        {
+            slot &s = index[find_slot(key, hash)];
+            if (s.pos != 0)
+            {
+                entries[s.pos-1].second = value;
+                return true;
+            }
+        }
+        // keys already in the hash part are never moved, and an array key added after one of them
+        // goes in the hash part as well so iteration still sees it after them
+        if (is_array_key && at == array.size() && entries.empty())
+        {
+            array.push_back(value);
+            return true;
+        }
+        if ((entries.size()+1)*2 > index.size())
+        {
+            rehash(index.size() == 0 ? 8 : index.size()*2);
+        }
+        entries.push_back(std::pair<anything, anything>(key, value));
+        index[find_slot(key, hash)] = slot{hash, entries.size()};
+        return true;
+    }
+
+    void table_type::push_back(const std::pair<anything, anything> &kvp)
+    {
+        if (!set(kvp.first, kvp.second))
+        {
+            // unhashable keys are kept so iteration still sees them, but they can never be found
+            entries.push_back(kvp);
+        }
+    }
+
+    uint64_t table_type::size() const
+    {
+        return array.size() + entries.size();
+    }
+
+    bool table_type::empty() const
+    {
+        return size() == 0;
+    }
+
+    table_type::iterator table_type::begin() const
+    {
+        return iterator{this, 0};
+    }
+
+    table_type::iterator table_type::end() const
+    {
+        return iterator{this, size()};
+    }
+
+    std::pair<anything, anything> table_type::iterator::operator*() const
+    {
+        uint64_t asize = table->array.size();
+        if (i < asize)
+        {
+            anything key;
+            key.type = ANY_TYPE_INT;
+            key.num = i;
+            return std::pair<anything, anything>(key, table->array[i]);
+        }
+        return table->entries[i-asize];
+    }
+
+    table_type::iterator &table_type::iterator::operator++()
+    {
+        i ++;
+        return *this;
+    }
+
+    bool table_type::iterator::operator!=(const iterator &other) const
+    {
+        return i != other.i;
+    }
+}
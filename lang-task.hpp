@@ -0,0 +1,882 @@
+#pragma once
+#include "lang-defs.hpp"
+
+namespace lang
+{
+    // tasks run a call on a state of their own, on a pool of worker threads
+    // nothing a task can change is seen by another thread: values go between them frozen,
+    // as a copy that no collector tracks and that any_mut copies again before changing it
+    // a value that is already frozen goes as it is
+
+    // what a task needs of the state that spawned it, every value in it is frozen
+    struct spawn_image
+    {
+        opt_flags opts;
+        uint64_t max_depth;
+        opcode_vec opcodes;
+        std::vector<reg_op> reg_code;
+        std::vector<anything> helpers;
+        std::vector<std::string> global_names;
+        std::vector<anything> global_vals;
+        std::vector<void *> quick_fns; // of the builtins in global_vals, which belong to the spawning state
+    };
+
+    // one spawned call, shared by the worker running it and every handle to it
+    struct task_state
+    {
+        std::shared_ptr<const spawn_image> image;
+        std::function<anything(state &, bool &)> body; // run on a new state loaded from image
+        std::mutex lock;
+        std::condition_variable finished;
+        bool done = false;
+        bool failed = false;
+        anything result; // frozen
+    };
+
+    struct chan_state
+    {
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<anything> items; // frozen
+        uint64_t limit;
+        bool closed = false;
+    };
+
+    // a thread waiting on the condition variable of a task or channel, owner keeps the two alive
+    struct task_waiter
+    {
+        std::shared_ptr<void> owner;
+        std::mutex *lock;
+        std::condition_variable *cv;
+    };
+
+    struct task_queue
+    {
+        std::mutex lock;
+        std::deque<std::shared_ptr<task_state>> tasks;
+    };
+
+    // every worker has a queue, it takes the newest task of its own and steals the oldest of the others
+    // a worker waiting on a task or channel does not count as running, when no worker is running
+    // and tasks are queued a spare one is started, it steals until nothing is queued and then ends
+    struct task_pool
+    {
+        uint64_t threads = 0; // workers, 0 for one per core, only read by the first spawn
+        std::once_flag started;
+        std::vector<std::unique_ptr<task_queue>> queues;
+        std::mutex spare_lock;
+        std::vector<std::thread> workers; // spares are added under spare_lock
+        std::atomic<uint64_t> running{0};
+        std::atomic<uint64_t> queued{0};
+        std::atomic<uint64_t> next{0}; // where tasks from outside the pool go, round robin
+        std::atomic<bool> stopping{false};
+        std::mutex idle_lock;
+        std::condition_variable idle;
+        std::mutex wait_lock;
+        std::vector<task_waiter> waiters; // woken when the pool stops
+        uint64_t size();
+        void push(std::shared_ptr<task_state>);
+        std::shared_ptr<task_state> take();
+        bool run_one();
+        void work(uint64_t);
+        void spare();
+        void grow();
+        void block();
+        void unblock();
+        template<typename F>
+        void wait(std::shared_ptr<void>, std::unique_lock<std::mutex> &, std::condition_variable &, F);
+        ~task_pool();
+    };
+
+    thread_local int64_t task_worker = -1; // the queue of the worker on this thread, -1 outside the pool and for spares
+    thread_local bool task_in_pool = false;
+
+    task_pool tasks;
+
+    // false when v holds a box a thread could change or collect
+    bool any_frozen(const anything &v)
+    {
+        if (!v.boxed)
+        {
+            return true;
+        }
+        switch (v.type)
+        {
+            case ANY_TYPE_INT: return box_frozen<mpz_int>(v);
+            case ANY_TYPE_RAT: return box_frozen<mpq_rational>(v);
+            case ANY_TYPE_STR: return box_frozen<std::string>(v);
+            case ANY_TYPE_LIST: return box_frozen<std::vector<anything>>(v);
+            case ANY_TYPE_TABLE: return box_frozen<table_type>(v);
+            case ANY_TYPE_INTS: return box_frozen<std::vector<int64_t>>(v);
+            case ANY_TYPE_DOUBLES: return box_frozen<std::vector<double>>(v);
+            case ANY_TYPE_BYTES: return box_frozen<std::vector<uint8_t>>(v);
+            case ANY_TYPE_CORO: return false; // its stacks belong to the state it was made on
+            default: return true; // builtins, errors and handles are never changed
+        }
+    }
+
+    // memo is every container seen so far, one still being copied is ANY_TYPE_UNBOUND there
+    // why is set to what makes v impossible to freeze, if something does
+    anything freeze(const anything &v, std::unordered_map<void *, anything> &memo, const char *&why)
+    {
+        if (any_frozen(v))
+        {
+            return v;
+        }
+        if (v.type == ANY_TYPE_CORO)
+        {
+            why = "cannot freeze a coroutine";
+            return v;
+        }
+        std::unordered_map<void *, anything>::iterator found = memo.find(v.val());
+        if (found != memo.end())
+        {
+            if (is_a_any<ANY_TYPE_UNBOUND>(found->second))
+            {
+                why = "cannot freeze a value that holds itself";
+                return v;
+            }
+            return found->second;
+        }
+        anything ret = v;
+        switch (v.type)
+        {
+            case ANY_TYPE_INT:
+                ret = make_box<mpz_int>(v.type, any_ref<mpz_int>(v), true);
+                return ret;
+            case ANY_TYPE_RAT:
+                ret = make_box<mpq_rational>(v.type, any_ref<mpq_rational>(v), true);
+                return ret;
+            case ANY_TYPE_STR:
+                ret = make_box<std::string>(v.type, any_ref<std::string>(v), true);
+                return ret;
+            case ANY_TYPE_INTS:
+                ret = make_box<std::vector<int64_t>>(v.type, any_ref<std::vector<int64_t>>(v), true);
+                return ret;
+            case ANY_TYPE_DOUBLES:
+                ret = make_box<std::vector<double>>(v.type, any_ref<std::vector<double>>(v), true);
+                return ret;
+            case ANY_TYPE_BYTES:
+                ret = make_box<std::vector<uint8_t>>(v.type, any_ref<std::vector<uint8_t>>(v), true);
+                return ret;
+            default:
+                break;
+        }
+        anything open;
+        open.type = ANY_TYPE_UNBOUND;
+        memo[v.val()] = open;
+        if (v.type == ANY_TYPE_LIST)
+        {
+            const std::vector<anything> &from = any_ref<std::vector<anything>>(v);
+            std::vector<anything> to;
+            to.reserve(from.size());
+            for (const anything &a: from)
+            {
+                to.push_back(freeze(a, memo, why));
+            }
+            ret = make_box<std::vector<anything>>(v.type, std::move(to), true);
+        }
+        else
+        {
+            table_type to;
+            for (std::pair<anything, anything> kvp: any_ref<table_type>(v))
+            {
+                to.set(freeze(kvp.first, memo, why), freeze(kvp.second, memo, why));
+            }
+            ret = make_box<table_type>(v.type, std::move(to), true);
+        }
+        memo[v.val()] = ret;
+        return ret;
+    }
+
+    // a frozen copy of v, or an error when v holds a container that holds itself or a coroutine
+    anything freeze(const anything &v)
+    {
+        if (any_frozen(v))
+        {
+            return v;
+        }
+        std::unordered_map<void *, anything> memo;
+        const char *why = nullptr;
+        anything ret = freeze(v, memo, why);
+        if (why != nullptr)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error(why));
+        }
+        return ret;
+    }
+
+    // runs fn on args as if it was called from a form of its own, failed is set if it fails
+    // the error has been shown by then, the way run shows it
+    // vm_stack and ret_stack are left empty, so they have to hold nothing of a run that is going on
+    anything state::call_value(const anything &fn, const std::vector<anything> &args, bool &failed)
+    {
+        failed = false;
+        std::vector<anything> taken = args;
+        if (is_a_any<ANY_TYPE_NATIVE>(fn) || is_a_any<ANY_TYPE_FUNC>(fn))
+        {
+            anything callee = fn;
+            args_view view = {taken.data(), taken.size()};
+            anything got = is_a_any<ANY_TYPE_NATIVE>(fn) ? call_native(fn.native, view) : call_func(callee, taken.data(), taken.size());
+            if (is_a_any<ANY_TYPE_ERROR>(got))
+            {
+                errors::str_error shown = any_ref<errors::str_error>(got);
+                shown.show_error();
+                failed = true;
+                return make_any<ANY_TYPE_NONE, none>(none());
+            }
+            return got;
+        }
+        vm_stack.clear();
+        ret_stack.clear();
+        vm_stack.push_back(fn);
+        vm_stack.insert(vm_stack.end(), taken.begin(), taken.end());
+        uint64_t argc = args.size();
+        if (opts.registers)
+        {
+            // base 0 is the fn, its arguments follow
+            reg_code[call_place].a = argc+1;
+            reg_op &call = reg_code[call_place+1];
+            call.type = REG_OP_CALL;
+            call.a = 0;
+            call.b = 1;
+            call.c = argc;
+            call.d = 0;
+            failed = reg_run(call_place, call_place+2);
+        }
+        else
+        {
+            // quickening may have changed it last time
+            opcodes[call_place].type = OPCODE_TYPE_FUNC_CALL;
+            opcodes[call_place].helper = argc;
+            opcodes[call_place].extra = 0;
+            failed = run(call_place, call_place+1);
+        }
+        anything ret = make_any<ANY_TYPE_NONE, none>(none());
+        if (!failed && vm_stack.size() != 0)
+        {
+            ret = opts.registers ? vm_stack[0] : vm_stack[vm_stack.size()-1];
+        }
+        vm_stack.clear();
+        ret_stack.clear();
+        return ret;
+    }
+
+    // true when a and b are the same value, not just equal ones, a box is the same box
+    // a global that any_mut changed in place cannot look the same, spawn_from holds its box so it was copied
+    bool spawn_same(const anything &a, const anything &b)
+    {
+        return a.type == b.type && a.val() == b.val() && a.num == b.num;
+    }
+
+    // the code and globals of this state as they are now, for tasks to start from
+    // the last one is given again while nothing it was made from has changed, a new one reuses
+    // the frozen copies of the helpers and globals that are still the same
+    // the state itself is not changed, a global that cannot be frozen is left unbound in the snapshot
+    std::shared_ptr<const spawn_image> state::spawn_snapshot()
+    {
+        const spawn_image *last = spawn_last.get();
+        bool same = last != nullptr && last->opcodes.size() == opcodes.size() && last->reg_code.size() == reg_code.size()
+            && last->helpers.size() == helpers.size() && spawn_from.size() == global_vals.size()
+            && last->max_depth == max_depth;
+        for (uint64_t i = 0; same && i < global_vals.size(); i++)
+        {
+            same = spawn_same(spawn_from[i], global_vals[i]);
+        }
+        if (same)
+        {
+            return spawn_last;
+        }
+        std::shared_ptr<spawn_image> image = std::make_shared<spawn_image>();
+        image->opts = opts;
+        image->max_depth = max_depth;
+        image->opcodes = opcodes;
+        image->reg_code = reg_code;
+        // helpers are only ever added to
+        uint64_t kept = 0;
+        image->helpers.reserve(helpers.size());
+        if (last != nullptr)
+        {
+            kept = std::min(last->helpers.size(), helpers.size());
+            image->helpers.assign(last->helpers.begin(), last->helpers.begin()+kept);
+        }
+        for (uint64_t i = kept; i < helpers.size(); i++)
+        {
+            image->helpers.push_back(freeze(helpers[i]));
+        }
+        image->global_names = global_names;
+        image->global_vals.reserve(global_vals.size());
+        for (uint64_t i = 0; i < global_vals.size(); i++)
+        {
+            const anything &g = global_vals[i];
+            if (last != nullptr && i < spawn_from.size() && spawn_same(spawn_from[i], g))
+            {
+                image->global_vals.push_back(last->global_vals[i]);
+                continue;
+            }
+            anything frozen = freeze(g);
+            if (is_a_any<ANY_TYPE_ERROR>(frozen) && !is_a_any<ANY_TYPE_ERROR>(g))
+            {
+                frozen = anything();
+                frozen.type = ANY_TYPE_UNBOUND;
+            }
+            image->global_vals.push_back(frozen);
+        }
+        image->quick_fns = quick_fns;
+        spawn_from = global_vals;
+        spawn_last = image;
+        return image;
+    }
+
+    void state::spawn_load(const spawn_image &image)
+    {
+        opts = image.opts;
+        max_depth = image.max_depth;
+        opcodes = image.opcodes;
+        reg_code = image.reg_code;
+        helpers = image.helpers;
+        global_names = image.global_names;
+        global_vals = image.global_vals;
+        global_slots.clear();
+        for (uint64_t i = 0; i < global_names.size(); i++)
+        {
+            global_slots[global_names[i]] = i;
+        }
+        quick_fns = image.quick_fns;
+    }
+
+    void task_run(task_state &t)
+    {
+        bool failed = false;
+        anything got;
+        {
+            state child;
+            child.spawn_load(*t.image);
+            got = t.body(child, failed);
+            if (!failed)
+            {
+                got = freeze(got);
+                failed = is_a_any<ANY_TYPE_ERROR>(got);
+                if (failed)
+                {
+                    errors::str_error shown = any_ref<errors::str_error>(got);
+                    shown.show_error();
+                }
+            }
+        }
+        std::lock_guard<std::mutex> hold(t.lock);
+        t.result = failed ? make_any<ANY_TYPE_NONE, none>(none()) : got;
+        t.failed = failed;
+        t.done = true;
+        t.finished.notify_all();
+    }
+
+    uint64_t task_pool::size()
+    {
+        std::call_once(started, [this]() {
+            uint64_t count = threads;
+            if (count == 0)
+            {
+                count = std::max<uint64_t>(1, std::thread::hardware_concurrency());
+            }
+            for (uint64_t i = 0; i < count; i++)
+            {
+                queues.push_back(std::make_unique<task_queue>());
+            }
+            running = count;
+            std::lock_guard<std::mutex> hold(spare_lock);
+            for (uint64_t i = 0; i < count; i++)
+            {
+                workers.emplace_back(&task_pool::work, this, i);
+            }
+        });
+        return queues.size();
+    }
+
+    void task_pool::push(std::shared_ptr<task_state> t)
+    {
+        uint64_t count = size();
+        uint64_t at = task_worker >= 0 ? task_worker : next++ % count;
+        {
+            std::lock_guard<std::mutex> hold(queues[at]->lock);
+            queues[at]->tasks.push_back(std::move(t));
+        }
+        queued ++;
+        {
+            std::lock_guard<std::mutex> hold(idle_lock);
+            idle.notify_one();
+        }
+        grow();
+    }
+
+    std::shared_ptr<task_state> task_pool::take()
+    {
+        if (queued == 0)
+        {
+            return nullptr;
+        }
+        uint64_t count = queues.size();
+        uint64_t first = 0;
+        if (task_worker >= 0)
+        {
+            task_queue &own = *queues[task_worker];
+            std::lock_guard<std::mutex> hold(own.lock);
+            if (own.tasks.size() != 0)
+            {
+                std::shared_ptr<task_state> t = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued --;
+                return t;
+            }
+            first = task_worker+1;
+        }
+        for (uint64_t i = 0; i < count; i++)
+        {
+            task_queue &other = *queues[(first+i) % count];
+            std::lock_guard<std::mutex> hold(other.lock);
+            if (other.tasks.size() != 0)
+            {
+                std::shared_ptr<task_state> t = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                queued --;
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    // runs one queued task on this thread, false if there was none
+    bool task_pool::run_one()
+    {
+        std::shared_ptr<task_state> t = take();
+        if (!t)
+        {
+            return false;
+        }
+        task_run(*t);
+        return true;
+    }
+
+    void task_pool::work(uint64_t index)
+    {
+        task_worker = index;
+        task_in_pool = true;
+        while (!stopping)
+        {
+            if (run_one())
+            {
+                continue;
+            }
+            std::unique_lock<std::mutex> hold(idle_lock);
+            idle.wait(hold, [this]() {
+                return queued != 0 || stopping;
+            });
+        }
+    }
+
+    void task_pool::spare()
+    {
+        task_in_pool = true;
+        while (!stopping && run_one())
+        {
+        }
+        running --;
+        // a task may have been queued after the last take
+        grow();
+    }
+
+    // starts a spare worker if tasks are queued and no worker is left to take them
+    void task_pool::grow()
+    {
+        if (queued == 0 || running != 0 || stopping)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> hold(spare_lock);
+        if (queued == 0 || running != 0 || stopping)
+        {
+            return;
+        }
+        running ++;
+        workers.emplace_back(&task_pool::spare, this);
+    }
+
+    // called around a wait that other tasks may have to end
+    void task_pool::block()
+    {
+        if (task_in_pool)
+        {
+            running --;
+            grow();
+        }
+    }
+
+    void task_pool::unblock()
+    {
+        if (task_in_pool)
+        {
+            running ++;
+        }
+    }
+
+    // waits on cv, whose lock hold has, until done gives true or the pool stops
+    // the waiter is known to the pool meanwhile, so stopping can wake it
+    template<typename F>
+    void task_pool::wait(std::shared_ptr<void> owner, std::unique_lock<std::mutex> &hold, std::condition_variable &cv, F done)
+    {
+        {
+            std::lock_guard<std::mutex> held(wait_lock);
+            waiters.push_back(task_waiter{std::move(owner), hold.mutex(), &cv});
+        }
+        cv.wait(hold, [&]() {
+            return done() || stopping;
+        });
+        std::lock_guard<std::mutex> held(wait_lock);
+        for (uint64_t i = 0; i < waiters.size(); i++)
+        {
+            if (waiters[i].cv == &cv)
+            {
+                waiters.erase(waiters.begin()+i);
+                break;
+            }
+        }
+    }
+
+    // tasks still queued are dropped, running ones are waited for
+    task_pool::~task_pool()
+    {
+        stopping = true;
+        {
+            std::lock_guard<std::mutex> hold(idle_lock);
+            idle.notify_all();
+        }
+        // a waiter takes wait_lock with its own lock held, so the two are never held here together
+        // one that comes after the copy already sees stopping
+        std::vector<task_waiter> woken;
+        {
+            std::lock_guard<std::mutex> hold(wait_lock);
+            woken = waiters;
+        }
+        for (task_waiter &w: woken)
+        {
+            std::lock_guard<std::mutex> hold(*w.lock);
+            w.cv->notify_all();
+        }
+        std::vector<std::thread> all;
+        {
+            std::lock_guard<std::mutex> hold(spare_lock);
+            all.swap(workers);
+        }
+        for (std::thread &w: all)
+        {
+            w.join();
+        }
+    }
+
+    // false if the pool stopped first
+    bool task_wait(const std::shared_ptr<task_state> &t)
+    {
+        std::unique_lock<std::mutex> hold(t->lock);
+        if (t->done)
+        {
+            return true;
+        }
+        tasks.block();
+        tasks.wait(t, hold, t->finished, [&t]() {
+            return t->done;
+        });
+        tasks.unblock();
+        return t->done;
+    }
+
+    std::shared_ptr<task_state> task_start(std::shared_ptr<const spawn_image> image,
+        std::function<anything(state &, bool &)> body)
+    {
+        std::shared_ptr<task_state> t = std::make_shared<task_state>();
+        t->image = std::move(image);
+        t->body = std::move(body);
+        tasks.push(t);
+        return t;
+    }
+
+    // the result of a task, an error if it failed
+    anything task_result(const std::shared_ptr<task_state> &t)
+    {
+        if (!task_wait(t))
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the task pool stopped"s));
+        }
+        if (t->failed)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("task failed"s));
+        }
+        return t->result;
+    }
+
+    // (freeze v) is v as a value that can go to another task without being copied
+    fn_ret builtin_freeze(state *s, args_view args)
+    {
+        return freeze(args[0]);
+    }
+
+    // (spawn f args ...) calls f on args in a task of its own and gives back the task
+    // f sees the globals as they were when it was spawned
+    fn_ret builtin_spawn(state *s, args_view args)
+    {
+        anything fn = freeze(args[0]);
+        if (is_a_any<ANY_TYPE_ERROR>(fn))
+        {
+            return fn;
+        }
+        std::vector<anything> rest;
+        for (uint64_t i = 1; i < args.size(); i++)
+        {
+            rest.push_back(freeze(args[i]));
+            if (is_a_any<ANY_TYPE_ERROR>(rest[i-1]))
+            {
+                return rest[i-1];
+            }
+        }
+        std::shared_ptr<task_state> t = task_start(s->spawn_snapshot(), [fn, rest](state &child, bool &failed) {
+            return child.call_value(fn, rest, failed);
+        });
+        return make_any<ANY_TYPE_TASK, std::shared_ptr<task_state>>(t);
+    }
+
+    // (join t) waits for t and gives back what its call did
+    fn_ret builtin_join(state *s, args_view args)
+    {
+        return task_result(any_ref<std::shared_ptr<task_state>>(args[0]));
+    }
+
+    // (chan n) is a channel that holds up to n values
+    fn_ret builtin_chan(state *s, args_view args)
+    {
+        if (!is_small_int(args[0]) || args[0].num < 1)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("a channel holds at least 1 value"s));
+        }
+        std::shared_ptr<chan_state> c = std::make_shared<chan_state>();
+        c->limit = args[0].num;
+        return make_any<ANY_TYPE_CHAN, std::shared_ptr<chan_state>>(c);
+    }
+
+    // (send c v) waits for room in c and puts v in it
+    fn_ret builtin_send(state *s, args_view args)
+    {
+        const std::shared_ptr<chan_state> &owner = any_ref<std::shared_ptr<chan_state>>(args[0]);
+        chan_state &c = *owner;
+        anything value = freeze(args[1]);
+        if (is_a_any<ANY_TYPE_ERROR>(value))
+        {
+            return value;
+        }
+        std::unique_lock<std::mutex> hold(c.lock);
+        if (!c.closed && c.items.size() >= c.limit)
+        {
+            tasks.block();
+            tasks.wait(owner, hold, c.changed, [&c]() {
+                return c.closed || c.items.size() < c.limit;
+            });
+            tasks.unblock();
+        }
+        if (c.closed)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("send on a closed channel"s));
+        }
+        if (c.items.size() >= c.limit)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the task pool stopped"s));
+        }
+        c.items.push_back(std::move(value));
+        c.changed.notify_all();
+        return make_any<ANY_TYPE_NONE, none>(none());
+    }
+
+    // (recv c) waits for a value in c and takes it, none once c is closed and empty
+    fn_ret builtin_recv(state *s, args_view args)
+    {
+        const std::shared_ptr<chan_state> &owner = any_ref<std::shared_ptr<chan_state>>(args[0]);
+        chan_state &c = *owner;
+        std::unique_lock<std::mutex> hold(c.lock);
+        if (!c.closed && c.items.size() == 0)
+        {
+            tasks.block();
+            tasks.wait(owner, hold, c.changed, [&c]() {
+                return c.closed || c.items.size() != 0;
+            });
+            tasks.unblock();
+        }
+        if (c.items.size() != 0)
+        {
+            anything got = std::move(c.items.front());
+            c.items.pop_front();
+            c.changed.notify_all();
+            return got;
+        }
+        if (c.closed)
+        {
+            return make_any<ANY_TYPE_NONE, none>(none());
+        }
+        return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("the task pool stopped"s));
+    }
+
+    // (close c) stops sends to c, what is in it can still be taken
+    fn_ret builtin_close(state *s, args_view args)
+    {
+        chan_state &c = *any_ref<std::shared_ptr<chan_state>>(args[0]);
+        std::lock_guard<std::mutex> hold(c.lock);
+        c.closed = true;
+        c.changed.notify_all();
+        return make_any<ANY_TYPE_NONE, none>(none());
+    }
+
+    // the values of a frozen list or table, and the keys of a table, shared by the tasks of a pmap or preduce
+    struct task_items
+    {
+        anything from;
+        std::vector<anything> keys;
+        std::vector<anything> vals;
+    };
+
+    std::shared_ptr<task_items> task_split(const anything &from)
+    {
+        std::shared_ptr<task_items> ret = std::make_shared<task_items>();
+        ret->from = from;
+        if (is_a_any<ANY_TYPE_LIST>(from))
+        {
+            ret->vals = any_ref<std::vector<anything>>(from);
+            return ret;
+        }
+        for (std::pair<anything, anything> kvp: any_ref<table_type>(from))
+        {
+            ret->keys.push_back(kvp.first);
+            ret->vals.push_back(kvp.second);
+        }
+        return ret;
+    }
+
+    // four tasks a worker, so one slow chunk does not hold up the rest
+    uint64_t task_chunks(uint64_t size)
+    {
+        return std::min<uint64_t>(size, tasks.size()*4);
+    }
+
+    // (pmap f l) is the list of f of each item of l, worked out in tasks
+    // for a table it is a table with the same keys and f of each value
+    fn_ret builtin_pmap(state *s, args_view args)
+    {
+        anything fn = freeze(args[0]);
+        anything from = freeze(args[1]);
+        if (is_a_any<ANY_TYPE_ERROR>(fn) || is_a_any<ANY_TYPE_ERROR>(from))
+        {
+            return is_a_any<ANY_TYPE_ERROR>(fn) ? fn : from;
+        }
+        std::shared_ptr<task_items> items = task_split(from);
+        uint64_t size = items->vals.size();
+        uint64_t chunks = task_chunks(size);
+        std::shared_ptr<const spawn_image> image = s->spawn_snapshot();
+        std::vector<std::shared_ptr<task_state>> started;
+        for (uint64_t c = 0; c < chunks; c++)
+        {
+            uint64_t lo = size * c / chunks;
+            uint64_t hi = size * (c+1) / chunks;
+            started.push_back(task_start(image, [fn, items, lo, hi](state &child, bool &failed) {
+                std::vector<anything> out;
+                out.reserve(hi-lo);
+                for (uint64_t i = lo; i < hi && !failed; i++)
+                {
+                    out.push_back(child.call_value(fn, {items->vals[i]}, failed));
+                }
+                return make_any<ANY_TYPE_LIST, std::vector<anything>>(std::move(out));
+            }));
+        }
+        std::vector<anything> got;
+        got.reserve(size);
+        for (std::shared_ptr<task_state> &t: started)
+        {
+            anything part = task_result(t);
+            if (is_a_any<ANY_TYPE_ERROR>(part))
+            {
+                return part;
+            }
+            const std::vector<anything> &vals = any_ref<std::vector<anything>>(part);
+            got.insert(got.end(), vals.begin(), vals.end());
+        }
+        if (is_a_any<ANY_TYPE_LIST>(from))
+        {
+            return make_any<ANY_TYPE_LIST, std::vector<anything>>(std::move(got));
+        }
+        table_type ret;
+        for (uint64_t i = 0; i < size; i++)
+        {
+            ret.set(items->keys[i], got[i]);
+        }
+        return make_any<ANY_TYPE_TABLE, table_type>(std::move(ret));
+    }
+
+    // (preduce f l) folds the items of l with f, which has to be associative
+    // each task folds a run of items in order, then one more folds what they gave
+    fn_ret builtin_preduce(state *s, args_view args)
+    {
+        anything fn = freeze(args[0]);
+        anything from = freeze(args[1]);
+        if (is_a_any<ANY_TYPE_ERROR>(fn) || is_a_any<ANY_TYPE_ERROR>(from))
+        {
+            return is_a_any<ANY_TYPE_ERROR>(fn) ? fn : from;
+        }
+        std::shared_ptr<task_items> items = task_split(from);
+        uint64_t size = items->vals.size();
+        if (size == 0)
+        {
+            return make_any<ANY_TYPE_ERROR, errors::str_error>(errors::str_error("preduce of nothing"s));
+        }
+        uint64_t chunks = task_chunks(size);
+        std::shared_ptr<const spawn_image> image = s->spawn_snapshot();
+        std::vector<std::shared_ptr<task_state>> started;
+        for (uint64_t c = 0; c < chunks; c++)
+        {
+            uint64_t lo = size * c / chunks;
+            uint64_t hi = size * (c+1) / chunks;
+            started.push_back(task_start(image, [fn, items, lo, hi](state &child, bool &failed) {
+                anything acc = items->vals[lo];
+                for (uint64_t i = lo+1; i < hi && !failed; i++)
+                {
+                    acc = child.call_value(fn, {acc, items->vals[i]}, failed);
+                }
+                return acc;
+            }));
+        }
+        std::shared_ptr<task_items> parts = std::make_shared<task_items>();
+        for (std::shared_ptr<task_state> &t: started)
+        {
+            anything part = task_result(t);
+            if (is_a_any<ANY_TYPE_ERROR>(part))
+            {
+                return part;
+            }
+            parts->vals.push_back(part);
+        }
+        std::shared_ptr<task_state> last = task_start(image, [fn, parts](state &child, bool &failed) {
+            anything acc = parts->vals[0];
+            for (uint64_t i = 1; i < parts->vals.size() && !failed; i++)
+            {
+                acc = child.call_value(fn, {acc, parts->vals[i]}, failed);
+            }
+            return acc;
+        });
+        return task_result(last);
+    }
+
+    const uint64_t task_seq_types = (1 << ANY_TYPE_LIST) | (1 << ANY_TYPE_TABLE);
+
+    native_fn native_freeze = {"freeze", builtin_freeze, 1, 1, {}};
+    native_fn native_spawn = {"spawn", builtin_spawn, 1, native_variadic, {}};
+    native_fn native_join = {"join", builtin_join, 1, 1, {1 << ANY_TYPE_TASK}};
+    native_fn native_chan = {"chan", builtin_chan, 1, 1, {1 << ANY_TYPE_INT}};
+    native_fn native_send = {"send", builtin_send, 2, 2, {1 << ANY_TYPE_CHAN}};
+    native_fn native_recv = {"recv", builtin_recv, 1, 1, {1 << ANY_TYPE_CHAN}};
+    native_fn native_close = {"close", builtin_close, 1, 1, {1 << ANY_TYPE_CHAN}};
+    native_fn native_pmap = {"pmap", builtin_pmap, 2, 2, {0, task_seq_types}};
+    native_fn native_preduce = {"preduce", builtin_preduce, 2, 2, {0, task_seq_types}};
+}
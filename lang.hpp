@@ -11,6 +11,7 @@ namespace lang
         TOKEN_TYPE_FLOAT, // [0-9]+\.[0-9]+
         TOKEN_TYPE_OPEN, // ( [ {
         TOKEN_TYPE_CLOSE, // ) ] }
+        TOKEN_TYPE_DOUBLE, // [0-9]+(\.[0-9]+)?d
     };
 
     enum comp_stack_type
@@ -38,6 +39,78 @@ namespace lang
         OPCODE_TYPE_END_SPACE = 10,
         OPCODE_TYPE_NOP = 11,
         OPCODE_TYPE_FUNC_CALL_TOP = 12,
+        OPCODE_TYPE_LOAD_GLOBAL = 13,
+        OPCODE_TYPE_STORE_GLOBAL = 14,
+        OPCODE_TYPE_LOAD_LOCAL = 15,
+        OPCODE_TYPE_STORE_LOCAL = 16,
+        OPCODE_TYPE_ARGC = 17,
+        OPCODE_TYPE_STORE_GLOBAL_POP = 18,
+        OPCODE_TYPE_STORE_LOCAL_POP = 19,
+        OPCODE_TYPE_CALL_GLOBAL_TOP = 20, // helper is the global, extra the argument count
+        // FUNC_CALL 2 sites rewritten at run time once the builtin and operand types are seen
+        // extra counts how often the site fell back to FUNC_CALL
+        OPCODE_TYPE_INT_ADD = 21,
+        OPCODE_TYPE_INT_SUB = 22,
+        OPCODE_TYPE_INT_MUL = 23,
+        OPCODE_TYPE_INT_LT = 24,
+        OPCODE_TYPE_INT_GT = 25,
+        OPCODE_TYPE_INT_LTE = 26,
+        OPCODE_TYPE_INT_GTE = 27,
+        OPCODE_TYPE_INT_EQ = 28,
+        OPCODE_TYPE_RAT_ADD = 29,
+        OPCODE_TYPE_RAT_MUL = 30,
+        OPCODE_TYPE_STR_CONCAT = 31,
+        OPCODE_TYPE_TAIL_CALL = 32, // FUNC_CALL as the last thing a fn body does, reuses the frame
+        OPCODE_TYPE_DBL_ADD = 33,
+        OPCODE_TYPE_DBL_SUB = 34,
+        OPCODE_TYPE_DBL_MUL = 35,
+        OPCODE_TYPE_DBL_LT = 36,
+        OPCODE_TYPE_DBL_GT = 37,
+        OPCODE_TYPE_DBL_LTE = 38,
+        OPCODE_TYPE_DBL_GTE = 39,
+        OPCODE_TYPE_DBL_EQ = 40,
+        OPCODE_TYPE_COUNT, // not an op, new ops go above
+    };
+
+    // the ops of the register VM, a is where the result goes unless said otherwise
+    // an operand marked as maybe constant is a register, or an index into helpers when reg_const is set
+    enum reg_op_type
+    {
+        REG_OP_SPACE = 0, // a is how many registers a top level form needs
+        REG_OP_ENTER = 1, // first op of a fn, a is the argument count and b how many registers it needs
+        REG_OP_RET = 2, // a is the value returned, maybe constant
+        REG_OP_MOVE = 3, // b is maybe constant
+        REG_OP_LOAD_GLOBAL = 4, // b is the global
+        REG_OP_STORE_GLOBAL = 5, // a is the global, b the value, maybe constant
+        REG_OP_JMP = 6, // a is the place to go to
+        REG_OP_JMP_IF_NOT = 7, // a is the place to go to, b the condition, maybe constant
+        REG_OP_CALL = 8, // b is the first argument, c the argument count, d the register holding the function
+        REG_OP_CALL_GLOBAL = 9, // same as CALL, but d is the global holding the function
+        REG_OP_TAIL_CALL = 10,
+        REG_OP_TAIL_CALL_GLOBAL = 11,
+        // a call of a global with two arguments, b and c are the arguments, both maybe constant
+        // d is the global, e the first of two registers the arguments are copied to when a fn is called
+        REG_OP_CALL_GLOBAL2 = 12,
+        REG_OP_TAIL_CALL_GLOBAL2 = 13,
+        REG_OP_COUNT, // not an op, new ops go above
+    };
+
+    const uint32_t reg_const = uint32_t(1) << 31;
+
+    // set in the extra of a quickened op that came from a TAIL_CALL, so a deopt can go back to it
+    const uint64_t quick_from_tail = uint64_t(1) << 63;
+
+    enum quick_kind
+    {
+        QUICK_ADD,
+        QUICK_SUB,
+        QUICK_MUL,
+        QUICK_LT,
+        QUICK_GT,
+        QUICK_LTE,
+        QUICK_GTE,
+        QUICK_EQ,
+        QUICK_COUNT,
     };
 
     struct user_fn
@@ -45,10 +118,173 @@ namespace lang
         uint64_t op_place;
     };
 
+    // the start of every box make_box makes, the payload follows it
+    // strong counts the anythings holding the box and weak the gc lists holding it, plus one for all the strong ones
+    // the payload goes with the last strong reference and the memory with the last weak one
+    // the counts go through the same dispatch shared_ptr uses, plain adds until a second thread starts
+    struct box_head
+    {
+        _Atomic_word strong;
+        _Atomic_word weak;
+        void (*drop)(box_head *, bool); // destroys the payload, or frees the memory when the bool is set
+
+        box_head(void (*d)(box_head *, bool))
+            : strong(1), weak(1), drop(d)
+        {
+        }
+    };
+
+    void box_retain(box_head *h)
+    {
+        __gnu_cxx::__atomic_add_dispatch(&h->strong, 1);
+    }
+
+    void box_unweak(box_head *h)
+    {
+        if (__gnu_cxx::__exchange_and_add_dispatch(&h->weak, -1) == 1)
+        {
+            h->drop(h, true);
+        }
+    }
+
+    void box_release(box_head *h)
+    {
+        if (__gnu_cxx::__exchange_and_add_dispatch(&h->strong, -1) == 1)
+        {
+            h->drop(h, false);
+            box_unweak(h);
+        }
+    }
+
+    // 16 bytes, a heap type keeps its payload pointer in the same word as the immediates
     struct anything
     {
-        std::shared_ptr<void> val;
-        uint64_t type;
+        union
+        {
+            int64_t num = 0; // ANY_TYPE_INT when it fits in a machine word
+            bool flag; // ANY_TYPE_BOOL
+            uint64_t place; // ANY_TYPE_USER_FN
+            const native_fn *native; // ANY_TYPE_NATIVE, descriptors are never freed
+            double dbl; // ANY_TYPE_DOUBLE
+            void *ptr; // the payload when boxed is set, its box_head sits right before it
+        };
+        uint32_t type;
+        uint32_t boxed = 0; // only set for heap types (str, big int, rat, list, table ...), ptr holds a reference then
+
+        anything() = default;
+
+        anything(const anything &other)
+            : num(other.num), type(other.type), boxed(other.boxed)
+        {
+            if (boxed)
+            {
+                box_retain(head());
+            }
+        }
+
+        anything(anything &&other) noexcept
+            : num(other.num), type(other.type), boxed(other.boxed)
+        {
+            if (boxed)
+            {
+                other.boxed = 0;
+                other.num = 0;
+            }
+        }
+
+        // the old box is only let go once this holds the new value, letting it go may free a container other was in
+        anything &operator=(const anything &other)
+        {
+            if (other.boxed)
+            {
+                box_retain(other.head());
+            }
+            box_head *old = boxed ? head() : nullptr;
+            num = other.num;
+            type = other.type;
+            boxed = other.boxed;
+            if (old != nullptr)
+            {
+                box_release(old);
+            }
+            return *this;
+        }
+
+        anything &operator=(anything &&other) noexcept
+        {
+            if (this == &other)
+            {
+                return *this;
+            }
+            box_head *old = boxed ? head() : nullptr;
+            num = other.num;
+            type = other.type;
+            boxed = other.boxed;
+            if (other.boxed)
+            {
+                other.boxed = 0;
+                other.num = 0;
+            }
+            if (old != nullptr)
+            {
+                box_release(old);
+            }
+            return *this;
+        }
+
+        ~anything()
+        {
+            if (boxed)
+            {
+                box_release(head());
+            }
+        }
+
+        // the payload of a heap type, nullptr for everything else
+        void *val() const
+        {
+            return boxed ? ptr : nullptr;
+        }
+
+        box_head *head() const
+        {
+            return reinterpret_cast<box_head *>(static_cast<char *>(ptr) - sizeof(box_head));
+        }
+
+        uint64_t use_count() const
+        {
+            return boxed ? __atomic_load_n(&head()->strong, __ATOMIC_RELAXED) : 0;
+        }
+    };
+
+    static_assert(sizeof(anything) == 16, "vm_stack, globals, lists and tables are arrays of these");
+
+    // the arguments of a native call, still sitting on vm_stack
+    // only valid until the callee pushes to or pops from vm_stack
+    struct args_view
+    {
+        anything *first;
+        uint64_t count;
+        uint64_t size() const;
+        anything &operator[](uint64_t) const;
+        anything *begin() const;
+        anything *end() const;
+    };
+
+    using native_ptr = fn_ret (*)(state *, args_view);
+
+    const uint64_t native_variadic = -1;
+    const uint64_t native_typed_args = 4;
+
+    // a builtin the VM calls without copying its arguments
+    // the arity and leading argument types are checked before call is run
+    struct native_fn
+    {
+        const char *name;
+        native_ptr call;
+        uint64_t min_args;
+        uint64_t max_args; // native_variadic for no limit
+        uint64_t types[native_typed_args]; // bit 1 << any_type for each accepted type, 0 accepts any
     };
 
     struct none{
@@ -59,22 +295,106 @@ namespace lang
     {
         opcode_type type;
         uint64_t helper;
+        uint64_t extra = 0; // second operand of the fused ops the optimizer makes
+    };
+
+    // every pass of state::optimize can be turned off from the command line
+    struct opt_flags
+    {
+        bool peephole = true;
+        bool superinstructions = true;
+        bool fold = true;
+        bool jump_threading = true;
+        bool quicken = true; // not a compile pass, lets run rewrite call sites
+        bool jit = true; // not one either, lets run compile hot functions and loops to machine code
+        bool registers = false; // compile to reg_code and run it with reg_run instead of the stack VM
+    };
+
+    // one three-address instruction of the register VM
+    struct reg_op
+    {
+        reg_op_type type;
+        uint32_t a = 0;
+        uint32_t b = 0;
+        uint32_t c = 0;
+        uint32_t d = 0;
+        uint32_t e = 0;
+        opcode_type quick = OPCODE_TYPE_FUNC_CALL; // what a CALL_GLOBAL2 was specialized to, FUNC_CALL for nothing
+        uint32_t misses = 0; // how often the specialization was given up
     };
 
     struct token
     {
         uint64_t line; // generated is -1
         uint64_t col; // generated is -1
-        std::string token; // never empty
+        std::string_view token; // span into the source buffer, never empty
         token_type type; // the kind of token it is
     };
 
+    enum char_class
+    {
+        CHAR_CLASS_SPACE = 1, // also ; and ,
+        CHAR_CLASS_ALPHA = 2,
+        CHAR_CLASS_DIGIT = 4,
+        CHAR_CLASS_NAME = 8, // [a-zA-Z0-9-]
+        CHAR_CLASS_OPEN = 16,
+        CHAR_CLASS_CLOSE = 32,
+        CHAR_CLASS_NEWLINE = 64,
+    };
+
+    // scans a contiguous buffer, the tokens point into it so it has to outlive them
+    struct lexer
+    {
+        const char *cur;
+        const char *end;
+        bool is_repl; // a newline ends the input
+        uint64_t line = 1;
+        uint64_t col = 1;
+        bool next(tokens &);
+        bool at_index();
+    };
+
+    const uint64_t no_node = -1;
+
+    // nodes point at each other by index into the ast_arena that owns them
     struct node
     {
-        std::vector<token> tok;
-        std::vector<node> children;
+        uint64_t tok; // index into toks for a leaf, no_node for a call
+        uint64_t first_child;
+        uint64_t next_sibling;
+        uint64_t child_count;
+    };
+
+    // every node of one compile, all freed at once by clear
+    struct ast_arena
+    {
+        std::vector<node> nodes;
+        uint64_t add(uint64_t);
+        const node &child(const node &, uint64_t) const;
+        void clear();
     };
 
+    // one per active user function call
+    // the arguments and locals live on vm_stack starting at base, the function itself is at base-1
+    struct frame
+    {
+        uint64_t ret; // place to return to
+        uint64_t base;
+        uint64_t argc; // number of arguments the caller passed
+        uint64_t top; // end of the locals, set by BEGIN_SPACE
+    };
+
+    // the locals of the function being compiled, parameters come first
+    // inner functions do not see the locals of the function they are in
+    struct comp_scope
+    {
+        std::vector<std::string> locals;
+    };
+
+}
+#include "lang-table.hpp"
+namespace lang
+{
     struct state
     {
         tokens toks;
@@ -85,17 +405,81 @@ namespace lang
         };
         std::vector<anything> vm_stack;
         std::vector<anything> helpers;
-        std::vector<uint64_t> ret_stack;
-        node root;
+        std::vector<frame> ret_stack;
+        std::vector<comp_scope> scopes;
+        bool comp_tail = false; // the next node comp sees is in tail position of a fn body
+        uint64_t comp_errors = 0; // reported by comp, not all of them stop the compile
+        uint64_t max_depth = 100000; // user function calls that can be active at once
+        ast_arena tree;
+        uint64_t root = 0; // index of the root node in tree
+        std::unordered_map<std::string, uint64_t> global_slots; // name to index into global_vals
+        std::vector<std::string> global_names;
+        std::vector<anything> global_vals; // ANY_TYPE_UNBOUND until defined
         anything load_global(anything &);
         uint64_t root_slashes = 0;
+        uint64_t intern_global(const std::string &);
+        int64_t find_local(std::string_view);
         void set_var(std::string &, anything &);
+        opt_flags opts;
+        std::vector<void *> quick_fns = quick_builtins(globals[0]);
+        opcode_type quicken(const anything &, const anything &, const anything &);
         bool run(uint64_t, uint64_t);
-        void lex(std::istream &is, bool);
+        void optimize(uint64_t);
+        bool opt_fold_call(opcode_vec &, std::vector<bool> &, std::set<uint64_t> &, uint64_t);
+        void lex(const char *, const char *, bool);
+        bool lex_form(lexer &);
         bool comp();
+        bool comp(const node &);
         bool ast();
+        std::vector<reg_op> reg_code;
+        uint32_t reg_next = 0; // first free register of the fn or form being compiled
+        uint32_t reg_high = 0; // registers it needs so far
+        uint64_t reg_emit(reg_op_type, uint32_t, uint32_t = 0, uint32_t = 0, uint32_t = 0, uint32_t = 0);
+        uint32_t reg_alloc();
+        uint32_t reg_constant(const anything &);
+        void reg_to(const node &, uint32_t);
+        uint32_t reg_values(const node &, uint64_t);
+        uint32_t reg_call(const node &, uint32_t, bool);
+        uint32_t reg_expr(const node &, uint32_t);
+        bool reg_comp();
+        bool reg_run(uint64_t, uint64_t);
+        std::vector<std::vector<anything>> arg_pool; // reused argument vectors of std::function builtins
+        uint64_t arg_depth = 0;
+        std::vector<anything> &take_args(uint64_t);
+        std::vector<anything> &take_args(anything *, uint64_t);
+        fn_ret call_func(anything &, uint64_t);
+        fn_ret call_func(anything &, anything *, uint64_t);
+        fn_ret call_native(const native_fn *, uint64_t);
+        fn_ret call_native(const native_fn *, args_view);
+        void def_native(const native_fn &);
+        anything aux_index; // the index builtin of auxlib, builtin_index falls back on it
+        bool profiling = false; // run feeds profile while this is set
+        std::unique_ptr<profile_data> profile; // made by the first profile_start
+        void profile_start();
+        std::string profile_name(uint64_t, bool);
+        void profile_report(std::ostream &);
+        bool profile_stacks(const std::string &);
+        void profile_finish(uint64_t, uint64_t, uint64_t);
+        std::unique_ptr<jit_data> jit; // made by the first jit_entry
+        bool jit_compile(uint64_t, uint64_t, bool);
+        void *jit_entry(uint64_t, uint64_t);
+        void *jit_target(uint64_t, uint64_t);
+        uint64_t jit_run(void *);
+        void jit_report(std::ostream &);
+        uint64_t call_place = 0; // the ops call_value runs, first in opcodes and reg_code so nothing moves when it is used mid run
+        anything call_value(const anything &, const std::vector<anything> &, bool &);
+        std::shared_ptr<const spawn_image> spawn_snapshot();
+        std::shared_ptr<const spawn_image> spawn_last; // handed out again while code and globals are as they were
+        std::vector<anything> spawn_from; // the globals spawn_last froze, holding them makes any_mut copy a changed one
+        void spawn_load(const spawn_image &);
+        coro_state *coro_now = nullptr; // the coroutine running on this state, null for the main program
+        std::unique_ptr<coro_loop> loop; // made by the first async
+        bool loop_run(coro_state *);
+        state();
     };
 }
+#include "lang-mem.hpp"
+#include "lang-gc.hpp"
 #include "auxlib/auxlib.hpp"
 namespace lang
 {
@@ -111,390 +495,1231 @@ namespace lang
         return true;
     }
     
+    // bools, none, user functions and machine sized ints live inside the anything
+    // everything else is boxed in val
     template<typename T>
-    T any_fast(anything a)
+    T any_fast(const anything &a)
     {
-        return *std::static_pointer_cast<T>(a.val);
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            return a.flag;
+        }
+        else if constexpr (std::is_same<T, none>::value)
+        {
+            return none();
+        }
+        else if constexpr (std::is_same<T, user_fn>::value)
+        {
+            user_fn f;
+            f.op_place = a.place;
+            return f;
+        }
+        else if constexpr (std::is_same<T, const native_fn *>::value)
+        {
+            return a.native;
+        }
+        else if constexpr (std::is_same<T, double>::value)
+        {
+            return a.dbl;
+        }
+        else if constexpr (std::is_same<T, mpz_int>::value)
+        {
+            if (!a.boxed)
+            {
+                return mpz_int(a.num);
+            }
+            return *static_cast<T *>(a.ptr);
+        }
+        else
+        {
+            return *static_cast<T *>(a.ptr);
+        }
     }
 
+    // how auxlib gets at a box it may change, only valid for boxed values
+    // a shared or frozen box is copied first, as any_mut does, and call_func measures it once auxlib is done
+    // code in this repo reads through any_ref and changes through any_mut
     template<typename T>
     T *any_fast_ptr(anything &a)
     {
-        return std::static_pointer_cast<T>(a.val);
+        return &*any_mut<T>(a);
+    }
+
+    // borrows a boxed payload, any_fast copies it
+    // valid while a, or another anything sharing its box, is alive and unchanged
+    template<typename T>
+    const T &any_ref(const anything &a)
+    {
+        return *static_cast<const T *>(a.ptr);
+    }
+
+    bool is_small_int(const anything &a)
+    {
+        return a.type == ANY_TYPE_INT && !a.boxed;
+    }
+    
+    anything make_small_int(int64_t n)
+    {
+        anything a;
+        a.type = ANY_TYPE_INT;
+        a.num = n;
+        return a;
     }
     
+    // a box for v, tables and lists are also handed to the cycle collector unless they are frozen
+    // task and channel handles are used from every thread, so they are always frozen
+    template<typename T>
+    anything make_box(uint64_t type, T v, bool frozen = false)
+    {
+        static_assert(alignof(T) <= alignof(box_head), "the payload has to sit right after the box_head");
+        frozen = frozen || type == ANY_TYPE_TASK || type == ANY_TYPE_CHAN;
+        mem_alloc<mem_box<T>> alloc(type, frozen);
+        mem_box<T> *box = alloc.allocate(1);
+        try
+        {
+            new (box) mem_box<T>(type, std::move(v), frozen);
+        }
+        catch (...)
+        {
+            alloc.deallocate(box, 1);
+            throw;
+        }
+        anything a;
+        a.type = type;
+        a.ptr = &box->value;
+        a.boxed = 1;
+        if (frozen)
+        {
+            return a;
+        }
+        if constexpr (std::is_same<T, table_type>::value)
+        {
+            if (type == ANY_TYPE_TABLE)
+            {
+                gc_track(a);
+            }
+        }
+        else if constexpr (std::is_same<T, std::vector<anything>>::value)
+        {
+            if (type == ANY_TYPE_LIST)
+            {
+                gc_track(a);
+            }
+        }
+        return a;
+    }
+
+    // only valid for a box made by make_box with a payload of T
+    template<typename T>
+    mem_box<T> *box_of(const anything &a)
+    {
+        return reinterpret_cast<mem_box<T> *>(a.head());
+    }
+
+    template<typename T>
+    bool box_frozen(const anything &a)
+    {
+        return box_of<T>(a)->frozen;
+    }
+
+    // boxed values are shared by every copy of an anything, this is the only way to change one
+    // a box that is shared or frozen is copied first, so the other copies never see the change
+    // the box has to have come from make_any
+    //
+    //     any_mut<std::string>(a)->append("x");
+    template<typename T>
+    box_edit<T> any_mut(anything &a)
+    {
+        if (a.use_count() > 1 || box_frozen<T>(a))
+        {
+            a = make_box<T>(a.type, any_ref<T>(a));
+        }
+        return box_edit<T>(box_of<T>(a));
+    }
+
+    template<typename T>
+    void box_remeasure(const anything &a)
+    {
+        if (!box_frozen<T>(a))
+        {
+            box_of<T>(a)->remeasure();
+        }
+    }
+
+    // measures a box auxlib may have changed through any_fast_ptr again
+    // only the payloads that own memory outside their box can have changed size
+    void box_remeasure(const anything &a)
+    {
+        if (!a.boxed)
+        {
+            return;
+        }
+        switch (a.type)
+        {
+            case ANY_TYPE_INT: box_remeasure<mpz_int>(a); break;
+            case ANY_TYPE_RAT: box_remeasure<mpq_rational>(a); break;
+            case ANY_TYPE_STR: box_remeasure<std::string>(a); break;
+            case ANY_TYPE_INTS: box_remeasure<std::vector<int64_t>>(a); break;
+            case ANY_TYPE_DOUBLES: box_remeasure<std::vector<double>>(a); break;
+            case ANY_TYPE_BYTES: box_remeasure<std::vector<uint8_t>>(a); break;
+            default: break;
+        }
+    }
+
     template<any_type Tc, typename T>
     anything make_any(T v)
     {
         anything a;
-        a.val = std::make_shared<T>(v);
         a.type = Tc;
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            a.flag = v;
+        }
+        else if constexpr (std::is_same<T, none>::value)
+        {
+        }
+        else if constexpr (std::is_same<T, user_fn>::value)
+        {
+            a.place = v.op_place;
+        }
+        else if constexpr (std::is_same<T, const native_fn *>::value)
+        {
+            a.native = v;
+        }
+        else if constexpr (std::is_same<T, double>::value)
+        {
+            a.dbl = v;
+        }
+        else if constexpr (std::is_same<T, mpz_int>::value)
+        {
+            if (mpz_fits_slong_p(v.backend().data()))
+            {
+                a.num = mpz_get_si(v.backend().data());
+            }
+            else
+            {
+                a = make_box<T>(Tc, std::move(v));
+            }
+        }
+        else
+        {
+            a = make_box<T>(Tc, std::move(v));
+        }
         return a;
     }
+
     template<any_type T>
-    bool is_a_any(anything &a)
+    bool is_a_any(const anything &a)
     {
         return a.type == T;
     }
 
-    std::string walknode(node n)
+    std::string walknode(const state &s, const node &n)
     {
-        std::string ret = "[ ";
-        for (token t: n.tok)
+        if (n.tok != no_node)
         {
-            ret += t.token;
-            ret += " ";
+            return std::string(s.toks[n.tok].token);
         }
-        for (node c: n.children)
+        std::string ret = "[ ";
+        for (uint64_t c = n.first_child; c != no_node; c = s.tree.nodes[c].next_sibling)
         {
-            ret += walknode(c);
+            ret += walknode(s, s.tree.nodes[c]);
             ret += " ";
         }
         return ret + ']';
     }
 
-    template<any_type Tc, typename T>
-    anything get_table_type(table_type &table, anything &value)
+    uint64_t ast_arena::add(uint64_t tok)
     {
-        T cmp = any_fast<T>(value);
-        for (std::pair<anything, anything> kvp: table)
+        node n;
+        n.tok = tok;
+        n.first_child = no_node;
+        n.next_sibling = no_node;
+        n.child_count = 0;
+        nodes.push_back(n);
+        return nodes.size()-1;
+    }
+
+    // the index-th child of n, only ever used for the first few
+    const node &ast_arena::child(const node &n, uint64_t index) const
+    {
+        uint64_t c = n.first_child;
+        for (uint64_t i = 0; i < index; i++)
         {
-            if (is_a_any<Tc>(kvp.first))
-            {
-                T name = any_fast<T>(kvp.first);
-                if (cmp == name)
-                {
-                    return kvp.second;
-                }
-            }
+            c = nodes[c].next_sibling;
         }
-        return make_any<ANY_TYPE_ERROR, errors::str_error>("get table type error"s);
+        return nodes[c];
     }
 
-    anything get_table(table_type &table, anything &value)
+    void ast_arena::clear()
     {
-        uint64_t size = table.size();
-        if (is_a_any<ANY_TYPE_STR>(value))
+        std::vector<node>().swap(nodes);
+    }
+
+    template<any_type Tc, typename T>
+    anything get_table_type(table_type &table, anything &value)
+    {
+        anything *got = is_a_any<Tc>(value) ? table.find(value) : nullptr;
+        if (got == nullptr)
         {
-            return get_table_type<ANY_TYPE_STR, std::string>(table, value);
+            return make_any<ANY_TYPE_ERROR, errors::str_error>("get table type error"s);
         }
-        if (is_a_any<ANY_TYPE_INT>(value))
+        return *got;
+    }
+
+    anything get_table(const table_type &table, const anything &value)
+    {
+        const anything *got = table.find(value);
+        if (got == nullptr)
         {
-            return get_table_type<ANY_TYPE_INT, mpz_int>(table, value);
+            return make_any<ANY_TYPE_ERROR, errors::str_error>("get table error"s);
         }
-        if (is_a_any<ANY_TYPE_BOOL>(value))
+        return *got;
+    }
+
+    // the signature auxlib was written against
+    anything get_table(table_type &table, anything &value)
+    {
+        return get_table(static_cast<const table_type &>(table), static_cast<const anything &>(value));
+    }
+
+    // lhs followed by rhs, both strings, lhs is taken
+    // a temporary nothing else holds, such as an earlier concat, is appended to in place
+    anything str_concat(anything &lhs, const anything &rhs)
+    {
+        if (lhs.use_count() > 1 || box_frozen<std::string>(lhs))
         {
-            return get_table_type<ANY_TYPE_STR, std::string>(table, value);
+            // any_mut would copy lhs and then grow the copy, this allocates once
+            return make_any<ANY_TYPE_STR, std::string>(any_ref<std::string>(lhs) + any_ref<std::string>(rhs));
         }
-        if (is_a_any<ANY_TYPE_RAT>(value))
+        any_mut<std::string>(lhs)->append(any_ref<std::string>(rhs));
+        return std::move(lhs);
+    }
+
+    // globals only seeds the slots, once a name is interned global_vals holds its value
+    uint64_t state::intern_global(const std::string &name)
+    {
+        std::unordered_map<std::string, uint64_t>::iterator found = global_slots.find(name);
+        if (found != global_slots.end())
         {
-            return get_table_type<ANY_TYPE_RAT, mpq_rational>(table, value);
+            return found->second;
         }
-        if (is_a_any<ANY_TYPE_NONE>(value))
+        uint64_t slot = global_vals.size();
+        anything key = make_any<ANY_TYPE_STR, std::string>(name);
+        anything value;
+        value.type = ANY_TYPE_UNBOUND;
+        anything *got = globals[globals.size()-1].find(key);
+        if (got != nullptr)
         {
-            return get_table_type<ANY_TYPE_NONE, none>(table, value);
+            value = *got;
         }
-        return make_any<ANY_TYPE_ERROR, errors::str_error>("get table error"s);
+        global_slots[name] = slot;
+        global_names.push_back(name);
+        global_vals.push_back(value);
+        return slot;
     }
 
-    anything state::load_global(anything &value)
+    // index of name in the locals of the function being compiled, or -1
+    int64_t state::find_local(std::string_view name)
     {
-        uint64_t size = globals.size();
-        for (uint64_t i = 1; i <= size; i--)
+        if (scopes.size() == 0)
+        {
+            return -1;
+        }
+        std::vector<std::string> &locals = scopes[scopes.size()-1].locals;
+        uint64_t size = locals.size();
+        for (uint64_t i = 0; i < size; i++)
         {
-            return get_table(globals[size-i], value);
+            if (locals[i] == name)
+            {
+                return i;
+            }
         }
-        return make_any<ANY_TYPE_ERROR, errors::str_error>("load global error"s);
+        return -1;
     }
 
-        void state::set_var(std::string &sval, anything &value)
+    anything state::load_global(anything &value)
+    {
+        if (is_a_any<ANY_TYPE_STR>(value))
         {
-            uint64_t gsizem = globals.size()-1;
-            uint64_t size = globals[gsizem].size();
-            for (uint64_t i = 0; i < size; i++)
+            std::unordered_map<std::string, uint64_t>::iterator found = global_slots.find(any_ref<std::string>(value));
+            if (found != global_slots.end())
             {
-                std::pair<anything, anything> kvp = globals[gsizem][i];
-                if (is_a_any<ANY_TYPE_STR>(kvp.first))
+                anything &got = global_vals[found->second];
+                if (is_a_any<ANY_TYPE_UNBOUND>(got))
                 {
-                    std::string name = any_fast<std::string>(kvp.first);
-                    if (name == sval)
-                    {
-                        globals[gsizem][i].second = value;
-                        return;
-                    }
+                    return make_any<ANY_TYPE_ERROR, errors::str_error>("load global error"s);
                 }
+                return got;
             }
-            globals[gsizem].push_back(std::pair<anything, anything>(
-                std::pair<anything, anything>(make_any<ANY_TYPE_STR, std::string>(sval), value)
-            ));
         }
+        return get_table(globals[globals.size()-1], value);
+    }
 
-    bool state::run(uint64_t place, uint64_t brk)
+    void state::set_var(std::string &sval, anything &value)
+    {
+        global_vals[intern_global(sval)] = value;
+    }
+
+}
+#include "lang-quick.hpp"
+#include "lang-native.hpp"
+#include "lang-prof.hpp"
+#include "lang-number.hpp"
+#include "lang-array.hpp"
+#include "lang-jit.hpp"
+#include "lang-task.hpp"
+#include "lang-coro.hpp"
+namespace lang
+{
+    // builtins that live in this repo rather than in auxlib
+    state::state()
     {
-        // uint64_t size = opcodes.size();
-        while (place != brk)
+        call_place = opcodes.size();
+        opcode call;
+        call.type = OPCODE_TYPE_FUNC_CALL;
+        call.helper = 0;
+        opcodes.push_back(call);
+        reg_emit(REG_OP_SPACE, 0);
+        reg_emit(REG_OP_CALL, 0);
+        anything *got = globals[globals.size()-1].find(make_any<ANY_TYPE_STR, std::string>("index"));
+        if (got != nullptr)
         {
-            if (errors.size() > 0)
-            {
-                errors.top().show_error();
-                errors.pop();
-                return true;
-            }
+            aux_index = *got;
+        }
+        def_native(native_index);
+        def_native(native_list_set);
+        def_native(native_table_set);
+        def_native(native_profile);
+        def_native(native_mem_stats);
+        def_native(native_gc);
+        number_builtins_wrap(globals[globals.size()-1]);
+        quick_fns = quick_builtins(globals[0]);
+        def_native(native_to_double);
+        def_native(native_to_rat);
+        def_native(native_to_int);
+        def_native(native_freeze);
+        def_native(native_spawn);
+        def_native(native_join);
+        def_native(native_chan);
+        def_native(native_send);
+        def_native(native_recv);
+        def_native(native_close);
+        def_native(native_pmap);
+        def_native(native_preduce);
+        def_native(native_coro);
+        def_native(native_resume);
+        def_native(native_yield);
+        def_native(native_done);
+        def_native(native_collect);
+        def_native(native_async);
+        def_native(native_await);
+        def_native(native_sleep);
+        def_native(native_read_file);
+        def_native(native_read_cmd);
+        def_native(native_ints);
+        def_native(native_doubles);
+        def_native(native_bytes);
+        def_native(native_iota);
+        def_native(native_array_list);
+        def_native(native_array_size);
+        def_native(native_array_sum);
+        def_native(native_array_min);
+        def_native(native_array_max);
+        def_native(native_array_dot);
+        def_native(native_array_sort);
+        def_native(native_array_map);
+        def_native(native_array_simd);
+    }
+
+// the dispatch loop is threaded with computed goto when the compiler supports it
+// define LANG_NO_THREADED to get the portable switch instead
+#if defined(__GNUC__) && !defined(LANG_NO_THREADED)
+#define LANG_THREADED
+#endif
+
+#ifdef LANG_THREADED
+#define VM_CASE(type) label_##type:
+// a handler leaves through a plain goto, which destroys its locals where a computed goto would skip them
+// gcc copies the computed goto at vm_dispatch back into each handler, so the dispatch stays threaded
+#define VM_NEXT() \
+    goto vm_next
+#define VM_REDISPATCH() \
+    goto vm_dispatch
+#else
+#define VM_CASE(type) case type:
+#define VM_NEXT() \
+    place ++; \
+    if (place == brk) goto vm_done; \
+    continue
+#define VM_REDISPATCH() \
+    continue
+#endif
+#define VM_COUNT() \
+    if (profiled) \
+    { \
+        prof->ops[op->type] ++; \
+    }
+// goes into the compiled code for place to when there is some, last is handed on to jit_entry
+#define VM_JIT(to, last) \
+    if (jitted && (native = jit_entry(to, last)) != nullptr) \
+    { \
+        goto vm_jit; \
+    }
+// only handlers that can fail use this, there is no error check between instructions
+#define VM_FAIL(err) \
+    errors.push(err); \
+    goto vm_fail
 
-            // std::cout << "stack: "<< any_fast<string>(aux::to_string(vm_stack)) << std::endl;
-            opcode op = opcodes[place];
-            switch (op.type)
+    bool state::run(uint64_t place, uint64_t brk)
+    {
+        if (place == brk)
+        {
+            return false;
+        }
+        opcode *op = &opcodes[place];
+        profile_data *prof = profile.get();
+        // read once per run, so turning profiling on or off takes effect from the next form
+        const bool profiled = profiling && prof != nullptr;
+        uint64_t prof_depth = 0;
+        uint64_t prof_start = 0;
+        uint64_t prof_top = 0;
+        uint64_t prof_t0 = 0;
+        if (profiled)
+        {
+            prof_depth = prof->calls.size();
+            prof_start = profile_now();
+            prof_top = prof->top_child_ns;
+        }
+        // compiled code does not count ops or calls, so it is left alone while profiling
+        const bool jitted = opts.jit && !profiled;
+        void *native = nullptr;
+#ifdef LANG_THREADED
+        // in opcode_type order
+        static void *dispatch[] = {
+            &&label_OPCODE_TYPE_PUSH_VAL,
+            &&label_OPCODE_TYPE_PUSH_NAME,
+            &&label_OPCODE_TYPE_POP,
+            &&label_OPCODE_TYPE_FUNC_CALL,
+            &&label_OPCODE_TYPE_JMP_IF_NOT,
+            &&label_OPCODE_TYPE_JMP_IF,
+            &&label_OPCODE_TYPE_JMP,
+            &&label_OPCODE_TYPE_DEFUN,
+            &&label_OPCODE_TYPE_RET,
+            &&label_OPCODE_TYPE_BEGIN_SPACE,
+            &&label_OPCODE_TYPE_END_SPACE,
+            &&label_OPCODE_TYPE_NOP,
+            &&label_OPCODE_TYPE_FUNC_CALL_TOP,
+            &&label_OPCODE_TYPE_LOAD_GLOBAL,
+            &&label_OPCODE_TYPE_STORE_GLOBAL,
+            &&label_OPCODE_TYPE_LOAD_LOCAL,
+            &&label_OPCODE_TYPE_STORE_LOCAL,
+            &&label_OPCODE_TYPE_ARGC,
+            &&label_OPCODE_TYPE_STORE_GLOBAL_POP,
+            &&label_OPCODE_TYPE_STORE_LOCAL_POP,
+            &&label_OPCODE_TYPE_CALL_GLOBAL_TOP,
+            &&label_OPCODE_TYPE_INT_ADD,
+            &&label_OPCODE_TYPE_INT_SUB,
+            &&label_OPCODE_TYPE_INT_MUL,
+            &&label_OPCODE_TYPE_INT_LT,
+            &&label_OPCODE_TYPE_INT_GT,
+            &&label_OPCODE_TYPE_INT_LTE,
+            &&label_OPCODE_TYPE_INT_GTE,
+            &&label_OPCODE_TYPE_INT_EQ,
+            &&label_OPCODE_TYPE_RAT_ADD,
+            &&label_OPCODE_TYPE_RAT_MUL,
+            &&label_OPCODE_TYPE_STR_CONCAT,
+            &&label_OPCODE_TYPE_TAIL_CALL,
+            &&label_OPCODE_TYPE_DBL_ADD,
+            &&label_OPCODE_TYPE_DBL_SUB,
+            &&label_OPCODE_TYPE_DBL_MUL,
+            &&label_OPCODE_TYPE_DBL_LT,
+            &&label_OPCODE_TYPE_DBL_GT,
+            &&label_OPCODE_TYPE_DBL_LTE,
+            &&label_OPCODE_TYPE_DBL_GTE,
+            &&label_OPCODE_TYPE_DBL_EQ,
+        };
+        static_assert(sizeof(dispatch) / sizeof(*dispatch) == OPCODE_TYPE_COUNT, "every opcode needs a label");
+        // while profiling every op goes through vm_count first, so the table run uses has no check for it
+        void *counted[OPCODE_TYPE_COUNT];
+        void **table = dispatch;
+        if (profiled)
+        {
+            std::fill(counted, counted + OPCODE_TYPE_COUNT, &&vm_count);
+            table = counted;
+        }
+        goto vm_dispatch;
+    vm_next:
+        place ++;
+        if (place == brk)
+        {
+            goto vm_done;
+        }
+        op = &opcodes[place];
+    vm_dispatch:
+        goto *table[op->type];
+    vm_count:
+        prof->ops[op->type] ++;
+        goto *dispatch[op->type];
+#else
+        while (true)
+        {
+            op = &opcodes[place];
+            VM_COUNT();
+            switch (op->type)
             {
-                case OPCODE_TYPE_NOP:
+#endif
+                VM_CASE(OPCODE_TYPE_NOP)
                 {
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_BEGIN_SPACE:
+                VM_CASE(OPCODE_TYPE_ARGC)
                 {
-                    break;
+                    frame &f = ret_stack[ret_stack.size()-1];
+                    if (f.argc != op->helper)
+                    {
+                        VM_FAIL(errors::str_error("function takes "s + std::to_string(op->helper)
+                            + " arguments, got " + std::to_string(f.argc)));
+                    }
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_BEGIN_SPACE)
+                {
+                    // make room for the locals that are not parameters
+                    frame &f = ret_stack[ret_stack.size()-1];
+                    anything empty = make_any<ANY_TYPE_NONE, none>(none());
+                    vm_stack.resize(vm_stack.size() + op->helper, empty);
+                    f.top = vm_stack.size();
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_END_SPACE:
+                VM_CASE(OPCODE_TYPE_END_SPACE)
                 {
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_RET:
+                VM_CASE(OPCODE_TYPE_RET)
                 {
-                    place = ret_stack[ret_stack.size()-1];
+                    frame f = ret_stack[ret_stack.size()-1];
                     ret_stack.pop_back();
-                    break;
+                    anything got;
+                    if (vm_stack.size() > f.top)
+                    {
+                        got = vm_stack[vm_stack.size()-1];
+                    }
+                    else
+                    {
+                        got = make_any<ANY_TYPE_NONE, none>(none());
+                    }
+                    vm_stack.erase(vm_stack.begin() + (f.base-1), vm_stack.end());
+                    vm_stack.push_back(got);
+                    place = f.ret;
+                    if (profiled)
+                    {
+                        prof->leave();
+                    }
+                    VM_JIT(place+1, no_place);
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_PUSH_VAL:
+                VM_CASE(OPCODE_TYPE_PUSH_VAL)
                 {
-                    vm_stack.push_back(helpers[op.helper]);
-                    break;
+                    vm_stack.push_back(helpers[op->helper]);
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_PUSH_NAME:
+                VM_CASE(OPCODE_TYPE_PUSH_NAME)
                 {
-                    anything value = load_global(helpers[op.helper]);
+                    anything value = load_global(helpers[op->helper]);
                     if (is_a_any<ANY_TYPE_ERROR>(value))
                     {
-                        std::string unkname = any_fast<std::string>(aux::to_string({helpers[op.helper]}));
-                        errors.push(errors::str_error("cannot load global "s + unkname));
-                        break;  
+                        std::string unkname = any_ref<std::string>(aux::to_string({helpers[op->helper]}));
+                        VM_FAIL(errors::str_error("cannot load global "s + unkname));
                     }
                     vm_stack.push_back(value);
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_FUNC_CALL:
+                VM_CASE(OPCODE_TYPE_LOAD_GLOBAL)
                 {
-                    anything fncall = vm_stack[vm_stack.size()-1-op.helper];
-                    // std::cout << int64_t(vm_stack.size()-1-op.helper) << std::endl;
-                    if (int64_t(vm_stack.size()-1-op.helper) < 0)
+                    anything &value = global_vals[op->helper];
+                    if (is_a_any<ANY_TYPE_UNBOUND>(value))
                     {
-                        errors.push(errors::str_error("ran out of stack in function call"s));
+                        VM_FAIL(errors::str_error("cannot load global "s + global_names[op->helper]));
+                    }
+                    vm_stack.push_back(value);
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_STORE_GLOBAL)
+                {
+                    global_vals[op->helper] = vm_stack[vm_stack.size()-1];
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_STORE_GLOBAL_POP)
+                {
+                    global_vals[op->helper] = std::move(vm_stack[vm_stack.size()-1]);
+                    vm_stack.pop_back();
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_LOAD_LOCAL)
+                {
+                    vm_stack.push_back(vm_stack[ret_stack[ret_stack.size()-1].base + op->helper]);
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_STORE_LOCAL)
+                {
+                    vm_stack[ret_stack[ret_stack.size()-1].base + op->helper] = vm_stack[vm_stack.size()-1];
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_STORE_LOCAL_POP)
+                {
+                    vm_stack[ret_stack[ret_stack.size()-1].base + op->helper] = std::move(vm_stack[vm_stack.size()-1]);
+                    vm_stack.pop_back();
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_CALL_GLOBAL_TOP)
+                {
+                    // LOAD_GLOBAL followed by FUNC_CALL_TOP, or by a FUNC_CALL with no arguments
+                    anything &fncall = global_vals[op->helper];
+                    uint64_t argc = op->extra;
+                    if (vm_stack.size() < argc)
+                    {
+                        VM_FAIL(errors::str_error("ran out of stack in function call"s));
+                    }
+                    if (is_a_any<ANY_TYPE_NATIVE>(fncall))
+                    {
+                        if (profiled)
+                        {
+                            prof_t0 = profile_now();
+                        }
+                        // a native that runs code can add globals and move global_vals, so fncall is not read after
+                        const native_fn *native = fncall.native;
+                        fn_ret got = call_native(native, argc);
+                        if (profiled)
+                        {
+                            prof->builtin(uint64_t(native), native, place, profile_now() - prof_t0);
+                        }
+                        if (is_a_any<ANY_TYPE_ERROR>(got))
+                        {
+                            VM_FAIL(any_ref<errors::str_error>(got));
+                        }
+                        if (errors.size() > 0)
+                        {
+                            goto vm_fail;
+                        }
+                        vm_stack.resize(vm_stack.size()-argc);
+                        vm_stack.push_back(std::move(got));
+                        gc_safepoint();
+                    }
+                    else if (is_a_any<ANY_TYPE_FUNC>(fncall))
+                    {
+                        if (profiled)
+                        {
+                            prof_t0 = profile_now();
+                        }
+                        uint64_t key = uint64_t(fncall.val());
+                        fn_ret got = call_func(fncall, argc);
+                        if (profiled)
+                        {
+                            prof->builtin(key, nullptr, place, profile_now() - prof_t0);
+                        }
+                        if (is_a_any<ANY_TYPE_ERROR>(got))
+                        {
+                            VM_FAIL(any_ref<errors::str_error>(got));
+                        }
+                        if (errors.size() > 0)
+                        {
+                            goto vm_fail;
+                        }
+                        vm_stack.push_back(std::move(got));
+                        gc_safepoint();
+                    }
+                    else if (is_a_any<ANY_TYPE_USER_FN>(fncall))
+                    {
+                        if (ret_stack.size() >= max_depth)
+                        {
+                            VM_FAIL(errors::str_error("more than "s + std::to_string(max_depth) + " nested function calls"));
+                        }
+                        vm_stack.insert(vm_stack.end()-argc, fncall);
+                        frame f;
+                        f.ret = place;
+                        f.base = vm_stack.size()-argc;
+                        f.argc = argc;
+                        f.top = vm_stack.size();
+                        ret_stack.push_back(f);
+                        if (profiled)
+                        {
+                            prof->enter(fncall.place, place);
+                        }
+                        place = fncall.place;
+                        VM_JIT(place+1, jit_fn_last(opcodes, place));
+                    }
+                    else if (is_a_any<ANY_TYPE_UNBOUND>(fncall))
+                    {
+                        VM_FAIL(errors::str_error("cannot load global "s + global_names[op->helper]));
+                    }
+                    else
+                    {
+                        VM_FAIL(errors::str_error("cannot call a "s + aux::get_type(fncall)));
+                    }
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_INT_ADD)
+                VM_CASE(OPCODE_TYPE_INT_SUB)
+                VM_CASE(OPCODE_TYPE_INT_MUL)
+                VM_CASE(OPCODE_TYPE_INT_LT)
+                VM_CASE(OPCODE_TYPE_INT_GT)
+                VM_CASE(OPCODE_TYPE_INT_LTE)
+                VM_CASE(OPCODE_TYPE_INT_GTE)
+                VM_CASE(OPCODE_TYPE_INT_EQ)
+                {
+                    anything *args = &vm_stack[vm_stack.size()-3]; // the builtin then its two arguments
+                    if (args[0].val() != quick_fns[quick_kind_of(op->type)]
+                        || !is_a_any<ANY_TYPE_INT>(args[1]) || !is_a_any<ANY_TYPE_INT>(args[2]))
+                    {
+                        goto vm_deopt;
+                    }
+                    if (!quick_int(op->type, args[1], args[2], args[0]))
+                    {
+                        // bignums and overflow keep the site but take the builtin
+                        goto vm_generic_call;
+                    }
+                    vm_stack.pop_back();
+                    vm_stack.pop_back();
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_RAT_ADD)
+                VM_CASE(OPCODE_TYPE_RAT_MUL)
+                {
+                    anything *args = &vm_stack[vm_stack.size()-3];
+                    if (args[0].val() != quick_fns[quick_kind_of(op->type)]
+                        || !is_a_any<ANY_TYPE_RAT>(args[1]) || !is_a_any<ANY_TYPE_RAT>(args[2]))
+                    {
+                        goto vm_deopt;
+                    }
+                    const mpq_rational &lhs = any_ref<mpq_rational>(args[1]);
+                    const mpq_rational &rhs = any_ref<mpq_rational>(args[2]);
+                    if (op->type == OPCODE_TYPE_RAT_ADD)
+                    {
+                        args[0] = make_any<ANY_TYPE_RAT, mpq_rational>(lhs + rhs);
+                    }
+                    else
+                    {
+                        args[0] = make_any<ANY_TYPE_RAT, mpq_rational>(lhs * rhs);
+                    }
+                    vm_stack.pop_back();
+                    vm_stack.pop_back();
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_STR_CONCAT)
+                {
+                    anything *args = &vm_stack[vm_stack.size()-3];
+                    if (args[0].val() != quick_fns[QUICK_ADD]
+                        || !is_a_any<ANY_TYPE_STR>(args[1]) || !is_a_any<ANY_TYPE_STR>(args[2]))
+                    {
+                        goto vm_deopt;
+                    }
+                    args[0] = str_concat(args[1], args[2]);
+                    vm_stack.pop_back();
+                    vm_stack.pop_back();
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_DBL_ADD)
+                VM_CASE(OPCODE_TYPE_DBL_SUB)
+                VM_CASE(OPCODE_TYPE_DBL_MUL)
+                VM_CASE(OPCODE_TYPE_DBL_LT)
+                VM_CASE(OPCODE_TYPE_DBL_GT)
+                VM_CASE(OPCODE_TYPE_DBL_LTE)
+                VM_CASE(OPCODE_TYPE_DBL_GTE)
+                VM_CASE(OPCODE_TYPE_DBL_EQ)
+                {
+                    anything *args = &vm_stack[vm_stack.size()-3];
+                    quick_kind kind = quick_kind_of(op->type);
+                    if (args[0].val() != quick_fns[kind]
+                        || !is_a_any<ANY_TYPE_DOUBLE>(args[1]) || !is_a_any<ANY_TYPE_DOUBLE>(args[2]))
+                    {
+                        goto vm_deopt;
+                    }
+                    args[0] = double_op(kind, args[1].dbl, args[2].dbl);
+                    vm_stack.pop_back();
+                    vm_stack.pop_back();
+                    VM_NEXT();
+                }
+            vm_deopt:
+                {
+                    // the guard failed, go back to the generic call and stop quickening once it keeps happening
+                    uint64_t from_tail = op->extra & quick_from_tail;
+                    op->type = from_tail ? OPCODE_TYPE_TAIL_CALL : OPCODE_TYPE_FUNC_CALL;
+                    op->extra = ((op->extra & ~quick_from_tail) + 1) | from_tail;
+                    VM_REDISPATCH();
+                }
+            vm_jit:
+                {
+                    place = jit_run(native);
+                    if (errors.size() > 0)
+                    {
+                        goto vm_fail;
+                    }
+                    if (place == brk)
+                    {
+                        goto vm_done;
+                    }
+                    op = &opcodes[place];
+                    VM_REDISPATCH();
+                }
+                VM_CASE(OPCODE_TYPE_FUNC_CALL)
+            vm_generic_call:
+                {
+                    if (vm_stack.size() < op->helper+1)
+                    {
+                        VM_FAIL(errors::str_error("ran out of stack in function call"s));
+                    }
+                    anything &fncall = vm_stack[vm_stack.size()-1-op->helper];
+                    if (is_a_any<ANY_TYPE_FUNC>(fncall))
+                    {
+                        if (op->helper == 2 && (op->type == OPCODE_TYPE_FUNC_CALL || op->type == OPCODE_TYPE_TAIL_CALL)
+                            && (op->extra & ~quick_from_tail) < 4 && opts.quicken)
+                        {
+                            opcode_type quick = quicken(fncall, vm_stack[vm_stack.size()-2], vm_stack[vm_stack.size()-1]);
+                            if (quick != OPCODE_TYPE_FUNC_CALL)
+                            {
+                                if (op->type == OPCODE_TYPE_TAIL_CALL)
+                                {
+                                    op->extra |= quick_from_tail;
+                                }
+                                op->type = quick;
+                                VM_REDISPATCH();
+                            }
+                        }
+                        uint64_t key = uint64_t(fncall.val());
+                        if (profiled)
+                        {
+                            prof_t0 = profile_now();
+                        }
+                        fn_ret got = call_func(fncall, op->helper);
+                        if (profiled)
+                        {
+                            prof->builtin(key, nullptr, place, profile_now() - prof_t0);
+                        }
+                        if (is_a_any<ANY_TYPE_ERROR>(got))
+                        {
+                            VM_FAIL(any_ref<errors::str_error>(got));
+                        }
+                        if (errors.size() > 0)
+                        {
+                            goto vm_fail;
+                        }
+                        vm_stack[vm_stack.size()-1] = std::move(got);
+                        gc_safepoint();
                     }
-                    if (is_a_any<ANY_TYPE_FUNC>(fncall))
+                    else if (is_a_any<ANY_TYPE_NATIVE>(fncall))
                     {
-                        std::vector<anything> args(op.helper);
-                        for (uint64_t i = 1; i <= op.helper; i++)
+                        if (profiled)
+                        {
+                            prof_t0 = profile_now();
+                        }
+                        // a native that calls back into the VM can grow vm_stack, so fncall is not read after
+                        const native_fn *native = fncall.native;
+                        fn_ret got = call_native(native, op->helper);
+                        if (profiled)
                         {
-                            args[op.helper-i] = vm_stack[vm_stack.size()-1];
-                            vm_stack.pop_back();
+                            prof->builtin(uint64_t(native), native, place, profile_now() - prof_t0);
                         }
-                        fn_type fn = any_fast<fn_type>(fncall);
-                        fn_ret got = fn(this, args);
                         if (is_a_any<ANY_TYPE_ERROR>(got))
                         {
-                            errors.push(any_fast<errors::str_error>(got));
-                            break;
+                            VM_FAIL(any_ref<errors::str_error>(got));
                         }
-                        vm_stack[vm_stack.size()-1] = got;
+                        if (errors.size() > 0)
+                        {
+                            goto vm_fail;
+                        }
+                        vm_stack.resize(vm_stack.size()-op->helper);
+                        vm_stack[vm_stack.size()-1] = std::move(got);
+                        gc_safepoint();
                     }
                     else if (is_a_any<ANY_TYPE_USER_FN>(fncall))
                     {
-                        std::vector<anything> args(op.helper);
-                        for (uint64_t i = 1; i <= op.helper; i++)
+                        // the arguments stay where they are and become the first locals
+                        if (ret_stack.size() >= max_depth)
                         {
-                            args[op.helper-i] = vm_stack[vm_stack.size()-1];
-                            vm_stack.pop_back();
+                            VM_FAIL(errors::str_error("more than "s + std::to_string(max_depth) + " nested function calls"));
                         }
-                        // std::cout << "calling user fn" << std::endl;
-                        vm_stack.pop_back();
-                        ret_stack.push_back(place);
-                        user_fn fn = any_fast<user_fn>(fncall);
-                        place = fn.op_place;
-                        // std::cout << vm_stack.size() << std::endl;
+                        frame f;
+                        f.ret = place;
+                        f.base = vm_stack.size()-op->helper;
+                        f.argc = op->helper;
+                        f.top = vm_stack.size();
+                        ret_stack.push_back(f);
+                        if (profiled)
+                        {
+                            prof->enter(fncall.place, place);
+                        }
+                        place = fncall.place;
+                        VM_JIT(place+1, jit_fn_last(opcodes, place));
                     }
                     else 
                     {
-                        // std::cout << fncall.type << std::endl;
-                        errors.push(errors::str_error("cannot call a "s + aux::get_type(fncall)));
+                        VM_FAIL(errors::str_error("cannot call a "s + aux::get_type(fncall)));
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_FUNC_CALL_TOP:
+                VM_CASE(OPCODE_TYPE_TAIL_CALL)
                 {
-                    anything fncall = vm_stack[vm_stack.size()-1];
-                    // std::cout <<vm_stack.size()-1 << std::endl;
-                        // std::cout << fncall.type << std::endl;
-                    // vm_stack.pop_back();
-                    if (int64_t(vm_stack.size()-1-op.helper) < 0)
+                    if (vm_stack.size() < op->helper+1)
                     {
-                        errors.push(errors::str_error("ran out of stack in function call"s));
-                        break;
+                        VM_FAIL(errors::str_error("ran out of stack in function call"s));
+                    }
+                    uint64_t from = vm_stack.size()-1-op->helper;
+                    if (!is_a_any<ANY_TYPE_USER_FN>(vm_stack[from]))
+                    {
+                        // builtins return right away, the RET after this op does the rest
+                        goto vm_generic_call;
+                    }
+                    // the callee and its arguments replace the function, arguments and locals of this frame
+                    frame &f = ret_stack[ret_stack.size()-1];
+                    uint64_t target = vm_stack[from].place;
+                    std::move(vm_stack.begin()+from, vm_stack.end(), vm_stack.begin()+(f.base-1));
+                    vm_stack.resize(f.base+op->helper);
+                    f.argc = op->helper;
+                    f.top = vm_stack.size();
+                    if (profiled)
+                    {
+                        prof->leave();
+                        prof->enter(target, place);
+                    }
+                    place = target;
+                    VM_JIT(place+1, jit_fn_last(opcodes, place));
+                    VM_NEXT();
+                }
+                VM_CASE(OPCODE_TYPE_FUNC_CALL_TOP)
+                {
+                    if (vm_stack.size() < op->helper+1)
+                    {
+                        VM_FAIL(errors::str_error("ran out of stack in function call"s));
                     }
+                    anything fncall = vm_stack[vm_stack.size()-1];
                     if (is_a_any<ANY_TYPE_FUNC>(fncall))
                     {
                         vm_stack.pop_back();
-                        std::vector<anything> args(op.helper);
-                        for (uint64_t i = 1; i <= op.helper; i++)
+                        if (profiled)
+                        {
+                            prof_t0 = profile_now();
+                        }
+                        fn_ret got = call_func(fncall, op->helper);
+                        if (profiled)
+                        {
+                            prof->builtin(uint64_t(fncall.val()), nullptr, place, profile_now() - prof_t0);
+                        }
+                        if (is_a_any<ANY_TYPE_ERROR>(got))
+                        {
+                            VM_FAIL(any_ref<errors::str_error>(got));
+                        }
+                        if (errors.size() > 0)
+                        {
+                            goto vm_fail;
+                        }
+                        vm_stack.push_back(std::move(got));
+                        gc_safepoint();
+                    }
+                    else if (is_a_any<ANY_TYPE_NATIVE>(fncall))
+                    {
+                        vm_stack.pop_back();
+                        if (profiled)
+                        {
+                            prof_t0 = profile_now();
+                        }
+                        fn_ret got = call_native(fncall.native, op->helper);
+                        if (profiled)
                         {
-                            args[op.helper-i] = vm_stack[vm_stack.size()-1];
-                            vm_stack.pop_back();
+                            prof->builtin(uint64_t(fncall.native), fncall.native, place, profile_now() - prof_t0);
                         }
-                        fn_type fn = any_fast<fn_type>(fncall);
-                        fn_ret got = fn(this, args);
                         if (is_a_any<ANY_TYPE_ERROR>(got))
                         {
-                            errors.push(any_fast<errors::str_error>(got));
-                            break;
+                            VM_FAIL(any_ref<errors::str_error>(got));
+                        }
+                        if (errors.size() > 0)
+                        {
+                            goto vm_fail;
                         }
-                        vm_stack.push_back(got);
+                        vm_stack.resize(vm_stack.size()-op->helper);
+                        vm_stack.push_back(std::move(got));
+                        gc_safepoint();
                     }
                     else 
                     {
-                        std::cout << fncall.type << std::endl;
-                        errors.push(errors::str_error("cannot call a "s + aux::get_type(fncall)));
+                        VM_FAIL(errors::str_error("cannot call a "s + aux::get_type(fncall)));
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_POP:
+                VM_CASE(OPCODE_TYPE_POP)
                 {
                     vm_stack.pop_back();
-                    // std::cout << "pop" << std::endl;
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_JMP_IF:
+                VM_CASE(OPCODE_TYPE_JMP_IF)
                 {
-                    anything val = vm_stack[vm_stack.size()-1];
+                    anything &val = vm_stack[vm_stack.size()-1];
+                    bool jump = !is_a_any<ANY_TYPE_BOOL>(val) || val.flag;
                     vm_stack.pop_back();
-                    if (is_a_any<ANY_TYPE_BOOL>(val))
-                    {
-                        if (any_fast<bool>(val))
-                        {
-                            uint64_t target = op.helper;
-                            place = target;
-                        }
-                    }
-                    else
+                    if (jump)
                     {
-                        uint64_t target = op.helper;
-                        place = target;
+                        place = op->helper;
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_JMP_IF_NOT:
+                VM_CASE(OPCODE_TYPE_JMP_IF_NOT)
                 {
-                    anything val = vm_stack[vm_stack.size()-1];
+                    anything &val = vm_stack[vm_stack.size()-1];
+                    bool jump = !is_a_any<ANY_TYPE_BOOL>(val) || !val.flag;
                     vm_stack.pop_back();
-                    if (is_a_any<ANY_TYPE_BOOL>(val))
-                    {
-                        if (!any_fast<bool>(val))
-                        {
-                            uint64_t target = op.helper;
-                            place = target;
-                        }
-                    }
-                    else
+                    if (jump)
                     {
-                        uint64_t target = op.helper;
-                        place = target;
+                        place = op->helper;
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_DEFUN:
+                VM_CASE(OPCODE_TYPE_DEFUN)
                 {
                     user_fn f;
-                    f.op_place = op.helper;
+                    f.op_place = op->helper;
                     vm_stack.push_back(make_any<ANY_TYPE_USER_FN, user_fn>(f));
-                    break;
+                    VM_NEXT();
                 }
-                case OPCODE_TYPE_JMP:
+                VM_CASE(OPCODE_TYPE_JMP)
                 {
-                    uint64_t target = op.helper;
-                    place = target;
-                    break;
+                    // a jump back is the end of a while loop, the loop is from where it goes to up to here
+                    if (op->helper < place)
+                    {
+                        VM_JIT(op->helper+1, place);
+                    }
+                    place = op->helper;
+                    VM_NEXT();
+                }
+#ifndef LANG_THREADED
+                default:
+                {
+                    VM_FAIL(errors::str_error("unknown opcode "s + std::to_string(op->type)));
                 }
             }
-            place ++;
         }
-        if (errors.size() > 0)
+#endif
+    vm_done:
+        if (profiled)
         {
-            errors.top().show_error();
-            errors.pop();
-            return true;
+            profile_finish(prof_depth, prof_start, prof_top);
         }
         return false;
+    vm_fail:
+        if (profiled)
+        {
+            profile_finish(prof_depth, prof_start, prof_top);
+        }
+        errors.top().show_error();
+        errors.pop();
+        return true;
     }
 
+#undef VM_CASE
+#undef VM_COUNT
+#undef VM_NEXT
+#undef VM_FAIL
+#undef VM_JIT
+
     bool state::ast()
     {
-        std::vector<node> nodes(1);
-        for (token t: toks)
+        tree.clear();
+        tree.nodes.reserve(toks.size()+1);
+        root = tree.add(no_node);
+        std::vector<uint64_t> open = {root}; // calls still being filled in
+        std::vector<uint64_t> last = {no_node}; // the last child of each of them so far
+        uint64_t toksize = toks.size();
+        for (uint64_t i = 0; i < toksize; i++)
         {
-            if (t.type == TOKEN_TYPE_OPEN)
+            token_type type = toks[i].type;
+            if (type == TOKEN_TYPE_CLOSE)
             {
-                nodes.push_back(node());
+                if (open.size() == 1)
+                {
+                    std::cout << "unexpected " << toks[i].token << " at " << toks[i].line << ":" << toks[i].col << std::endl;
+                    return true;
+                }
+                open.pop_back();
+                last.pop_back();
+                continue;
             }
-            else if (t.type == TOKEN_TYPE_CLOSE)
+            uint64_t n = tree.add(type == TOKEN_TYPE_OPEN ? no_node : i);
+            uint64_t parent = open[open.size()-1];
+            uint64_t &prev = last[last.size()-1];
+            if (prev == no_node)
             {
-                uint64_t nodesize = nodes.size();
-                nodes[nodesize-2].children.push_back(nodes[nodesize-1]);
-                nodes.pop_back();
+                tree.nodes[parent].first_child = n;
             }
             else
             {
-                uint64_t nodesize = nodes.size();
-                node next;
-                next.tok = {t};
-                // std::cout << t.token << std::endl;
-                nodes[nodesize-1].children.push_back(next);
+                tree.nodes[prev].next_sibling = n;
             }
+            prev = n;
+            tree.nodes[parent].child_count ++;
+            if (type == TOKEN_TYPE_OPEN)
+            {
+                open.push_back(n);
+                last.push_back(no_node);
+            }
+        }
+        if (open.size() != 1)
+        {
+            std::cout << "missing " << open.size()-1 << " closing parens" << std::endl;
+            return true;
         }
-        root = nodes[0];
         return false;
     }
 
     bool state::comp()
     {
-        uint64_t toksize = root.tok.size();
-        // std::cout << walknode(root) << std::endl;
-        // std::cout << root.children.size() << "\n";
-        if (toksize == 0)
+        if (comp(tree.nodes[root]))
+        {
+            // a form that stops part way can leave the fn scopes and slashes of its inner forms open
+            root_slashes = 0;
+            scopes.clear();
+            return true;
+        }
+        return false;
+    }
+
+    bool state::comp(const node &croot)
+    {
+        // std::cout << walknode(*this, croot) << std::endl;
+        bool tail = comp_tail;
+        comp_tail = false;
+        if (croot.tok == no_node)
         {
-            uint64_t size = root.children.size();
+            uint64_t size = croot.child_count;
             if (size == 0)
             {
                 std::cout << "cannot have empty call" << std::endl;
+                comp_errors ++;
+                return true;
             }
-            node croot = root;
             std::string name = "";
             uint64_t i = 0;
             uint64_t count_slash = 0;
-            for (node n: croot.children)
+            for (uint64_t c = croot.first_child; c != no_node; c = tree.nodes[c].next_sibling)
             {
-                if (i == 0 && n.tok.size() > 0 && n.tok[0].type == TOKEN_TYPE_NAME)
+                const node &n = tree.nodes[c];
+                if (i == 0 && n.tok != no_node && toks[n.tok].type == TOKEN_TYPE_NAME)
                 {
-                    if (special_funcs.count(n.tok[0].token) != 0)
+                    if (special_funcs.count(std::string(toks[n.tok].token)) != 0)
                     {
-                        name = n.tok[0].token;
+                        name = toks[n.tok].token;
                         break;
                     }
                 }
-                root = n;
-                state::comp();
+                if (state::comp(n))
+                {
+                    return true;
+                }
                 i ++;
             }
             if (name == "")
             {
                 
                 opcode op;
-                op.type = OPCODE_TYPE_FUNC_CALL;
+                op.type = tail && root_slashes == 0 ? OPCODE_TYPE_TAIL_CALL : OPCODE_TYPE_FUNC_CALL;
                 op.helper = size-1-root_slashes*2;
                 // std::cout << root_slashes << "\t" << size << std::endl;
                 root_slashes = 0;
@@ -502,56 +1727,105 @@ namespace lang
             }
             else if (name == "def")
             {
-                if (croot.children.size() == 3)
+                if (croot.child_count == 3)
                 {
-                    opcode op;
-                    op.type = OPCODE_TYPE_PUSH_NAME;
-                    op.helper = helpers.size();
-                    opcodes.push_back(op);
-                    helpers.push_back(make_any<ANY_TYPE_STR, std::string>("def-str"s));
-                    
-                    node ch1 = croot.children[1];
-                    if (ch1.tok.size() == 0 || ch1.tok[0].type != TOKEN_TYPE_NAME)
+                    const node &ch1 = tree.child(croot, 1);
+                    if (ch1.tok == no_node || toks[ch1.tok].type != TOKEN_TYPE_NAME)
                     {
                         std::cout << "def takes 2 arguments, the first must be a name" << std::endl;
+                        comp_errors ++;
                         return true;
                     }
-                    
-                    op.type = OPCODE_TYPE_PUSH_VAL;
-                    op.helper = helpers.size();
-                    opcodes.push_back(op);
-                    helpers.push_back(make_any<ANY_TYPE_STR, std::string>(ch1.tok[0].token));
 
-                    root = croot.children[2];
-                    state::comp();
+                    if (state::comp(tree.child(croot, 2)))
+                    {
+                        return true;
+                    }
 
-                    op.type = OPCODE_TYPE_FUNC_CALL;
-                    op.helper = 2;
+                    // the value is left on the stack as the result of the def
+                    // inside of a fn def makes a local unless the name already is one
+                    std::string defname(toks[ch1.tok].token);
+                    opcode op;
+                    if (scopes.size() > 0)
+                    {
+                        int64_t local = find_local(defname);
+                        if (local < 0)
+                        {
+                            local = scopes[scopes.size()-1].locals.size();
+                            scopes[scopes.size()-1].locals.push_back(defname);
+                        }
+                        op.type = OPCODE_TYPE_STORE_LOCAL;
+                        op.helper = local;
+                    }
+                    else
+                    {
+                        op.type = OPCODE_TYPE_STORE_GLOBAL;
+                        op.helper = intern_global(defname);
+                    }
                     opcodes.push_back(op);
                 }
                 else
                 {
                     std::cout << "def takes 2 arguments" << std::endl;
+                    comp_errors ++;
                     root_slashes = 0;
                     return true;
                 }
             }
             else if (name == "fn")
             {
-                if (croot.children.size() != 2)
+                uint64_t fnsize = croot.child_count;
+                if (fnsize != 2 && fnsize != 3)
                 {
                     std::cout << "fn takes 2 or 3 args" << std::endl;
+                    comp_errors ++;
                     root_slashes = 0;
                     return true;
                 }
+                // (fn body) or (fn (params ...) body)
+                comp_scope scope;
+                if (fnsize == 3)
+                {
+                    const node &params = tree.child(croot, 1);
+                    for (uint64_t c = params.first_child; c != no_node; c = tree.nodes[c].next_sibling)
+                    {
+                        const node &p = tree.nodes[c];
+                        if (p.tok == no_node || toks[p.tok].type != TOKEN_TYPE_NAME)
+                        {
+                            std::cout << "fn parameters must be names" << std::endl;
+                            comp_errors ++;
+                            root_slashes = 0;
+                            return true;
+                        }
+                        scope.locals.push_back(std::string(toks[p.tok].token));
+                    }
+                }
+                uint64_t argc = scope.locals.size();
+                scopes.push_back(scope);
+
                 uint64_t beginpos = opcodes.size();
 
                 opcode op;
                 op.type = OPCODE_TYPE_JMP;
                 opcodes.push_back(op);
 
-                root = croot.children[1];
-                state::comp();
+                op.type = OPCODE_TYPE_ARGC;
+                op.helper = argc;
+                opcodes.push_back(op);
+
+                uint64_t spacepos = opcodes.size();
+                op.type = OPCODE_TYPE_BEGIN_SPACE;
+                op.helper = 0;
+                opcodes.push_back(op);
+
+                comp_tail = true;
+                if (state::comp(tree.child(croot, fnsize-1)))
+                {
+                    return true;
+                }
+
+                opcodes[spacepos].helper = scopes[scopes.size()-1].locals.size() - argc;
+                scopes.pop_back();
 
                 op.type = OPCODE_TYPE_RET;
                 op.helper = 0;
@@ -566,17 +1840,20 @@ namespace lang
             }
             else if (name == "while")
             {
-                if (croot.children.size() != 3)
+                if (croot.child_count != 3)
                 {
-                    std::cout << "def takes 2 arguments" << std::endl;
+                    std::cout << "while takes 2 arguments" << std::endl;
+                    comp_errors ++;
                     return true;
                 }
 
                 uint64_t beginpos = opcodes.size();
 
                 
-                root = croot.children[1];
-                state::comp();
+                if (state::comp(tree.child(croot, 1)))
+                {
+                    return true;
+                }
 
                 opcode op;
                 op.type = OPCODE_TYPE_JMP_IF_NOT;
@@ -584,8 +1861,10 @@ namespace lang
 
                 uint64_t contpos = opcodes.size();
 
-                root = croot.children[2];
-                state::comp();
+                if (state::comp(tree.child(croot, 2)))
+                {
+                    return true;
+                }
 
                 op.type = OPCODE_TYPE_POP;
                 op.helper = 0;
@@ -602,17 +1881,26 @@ namespace lang
                 uint64_t breakpos = opcodes.size();
                 opcodes[contpos-1].helper = breakpos-1;
 
+                // a while is none, as it is in reg_comp, so it can be an argument like any other form
+                op.type = OPCODE_TYPE_PUSH_VAL;
+                op.helper = helpers.size();
+                opcodes.push_back(op);
+                helpers.push_back(make_any<ANY_TYPE_NONE, none>(none()));
             }
             else if (name == "if")
             {
-                if (croot.children.size() != 3)
+                // (if cond then) or (if cond then else), the value is that of the branch taken or none
+                if (croot.child_count != 3 && croot.child_count != 4)
                 {
-                    std::cout << "def takes 2 arguments" << std::endl;
+                    std::cout << "if takes 2 or 3 arguments" << std::endl;
+                    comp_errors ++;
                     root_slashes = 0;
                     return true;
                 }
-                root = croot.children[1];
-                state::comp();
+                if (state::comp(tree.child(croot, 1)))
+                {
+                    return true;
+                }
 
                 opcode op;
                 op.type = OPCODE_TYPE_JMP_IF_NOT;
@@ -620,211 +1908,327 @@ namespace lang
 
                 uint64_t contpos = opcodes.size();
 
-                root = croot.children[2];
-                state::comp();
+                comp_tail = tail;
+                if (state::comp(tree.child(croot, 2)))
+                {
+                    return true;
+                }
 
-                op.type = OPCODE_TYPE_POP;
-                op.helper = 0;
+                op.type = OPCODE_TYPE_JMP;
                 opcodes.push_back(op);
 
-                uint64_t breakpos = opcodes.size();
-                opcodes[contpos-1].helper = breakpos-1;
-            }
-        }
-        else
-        {
-            uint64_t rootsize = root.tok.size();
-            for (uint64_t i = 0; i < rootsize; i++)
-            {
-                token t = root.tok[i];
-                if (t.type == TOKEN_TYPE_NAME)
-                {
-                    if (t.token == "#")
-                    {
-                        root_slashes ++;
-                        opcode op;
-
-                        op.type = OPCODE_TYPE_PUSH_NAME;
-                        op.helper = helpers.size();
-                        opcodes.push_back(op);
-                        helpers.push_back(make_any<ANY_TYPE_STR, std::string>("index"));
+                uint64_t elsepos = opcodes.size();
+                opcodes[contpos-1].helper = elsepos-1;
 
-                        op.type = OPCODE_TYPE_FUNC_CALL_TOP;
-                        op.helper = 2;
-                        opcodes.push_back(op);
-                    }
-                    else
+                if (croot.child_count == 4)
+                {
+                    comp_tail = tail;
+                    if (state::comp(tree.child(croot, 3)))
                     {
-                        opcode op;
-                        op.type = OPCODE_TYPE_PUSH_NAME;
-                        op.helper = helpers.size();
-                        opcodes.push_back(op);
-                        helpers.push_back(make_any<ANY_TYPE_STR, std::string>(t.token));
+                        return true;
                     }
                 }
-                else if (t.type == TOKEN_TYPE_INT)
+                else
                 {
-                    opcode op;
                     op.type = OPCODE_TYPE_PUSH_VAL;
                     op.helper = helpers.size();
                     opcodes.push_back(op);
-                    helpers.push_back(make_any<ANY_TYPE_INT, mpz_int>(mpz_int(t.token)));
+                    helpers.push_back(make_any<ANY_TYPE_NONE, none>(none()));
                 }
-                else if (t.type == TOKEN_TYPE_STR)
+
+                opcodes[elsepos-1].helper = opcodes.size()-1;
+            }
+        }
+        else
+        {
+            const token &t = toks[croot.tok];
+            if (t.type == TOKEN_TYPE_NAME)
+            {
+                if (t.token == "#")
                 {
+                    root_slashes ++;
                     opcode op;
-                    op.type = OPCODE_TYPE_PUSH_VAL;
-                    op.helper = helpers.size();
+
+                    op.type = OPCODE_TYPE_LOAD_GLOBAL;
+                    op.helper = intern_global("index");
                     opcodes.push_back(op);
-                    helpers.push_back(make_any<ANY_TYPE_STR, std::string>(t.token));
-                }
-                else if (t.type == TOKEN_TYPE_FLOAT)
-                {
-                    opcode op;
-                    op.type = OPCODE_TYPE_PUSH_VAL;
-                    op.helper = helpers.size();
+
+                    op.type = OPCODE_TYPE_FUNC_CALL_TOP;
+                    op.helper = 2;
                     opcodes.push_back(op);
-                    helpers.push_back(make_any<ANY_TYPE_RAT, mpq_rational>(strtorat(t.token)));
                 }
                 else
                 {
-                    std::cout << "unknown token past ast" << t.token << std::endl;
-                    root_slashes = 0;
-                    return true;
+                    opcode op;
+                    int64_t local = find_local(t.token);
+                    if (local >= 0)
+                    {
+                        op.type = OPCODE_TYPE_LOAD_LOCAL;
+                        op.helper = local;
+                    }
+                    else
+                    {
+                        op.type = OPCODE_TYPE_LOAD_GLOBAL;
+                        op.helper = intern_global(std::string(t.token));
+                    }
+                    opcodes.push_back(op);
                 }
             }
+            else if (t.type == TOKEN_TYPE_INT)
+            {
+                opcode op;
+                op.type = OPCODE_TYPE_PUSH_VAL;
+                op.helper = helpers.size();
+                opcodes.push_back(op);
+                helpers.push_back(make_any<ANY_TYPE_INT, mpz_int>(mpz_int(std::string(t.token))));
+            }
+            else if (t.type == TOKEN_TYPE_STR)
+            {
+                opcode op;
+                op.type = OPCODE_TYPE_PUSH_VAL;
+                op.helper = helpers.size();
+                opcodes.push_back(op);
+                helpers.push_back(make_any<ANY_TYPE_STR, std::string>(std::string(t.token)));
+            }
+            else if (t.type == TOKEN_TYPE_DOUBLE)
+            {
+                opcode op;
+                op.type = OPCODE_TYPE_PUSH_VAL;
+                op.helper = helpers.size();
+                opcodes.push_back(op);
+                helpers.push_back(make_any<ANY_TYPE_DOUBLE, double>(strtod(std::string(t.token).c_str(), nullptr)));
+            }
+            else if (t.type == TOKEN_TYPE_FLOAT)
+            {
+                opcode op;
+                op.type = OPCODE_TYPE_PUSH_VAL;
+                op.helper = helpers.size();
+                opcodes.push_back(op);
+                helpers.push_back(make_any<ANY_TYPE_RAT, mpq_rational>(strtorat(std::string(t.token))));
+            }
+            else
+            {
+                std::cout << "unknown token past ast" << t.token << std::endl;
+                root_slashes = 0;
+                return true;
+            }
         }
         // root_slashes = 0;
         return false;
     }
 
-    void state::lex(std::istream &in, bool is_repl)
+    constexpr std::array<uint8_t, 256> make_char_classes()
     {
-        tokens *ptoks = &toks; // this is so that it can be captured by the lambda
-        uint64_t line = 1; // start at line 1
-        uint64_t col = 1; // col 1
-        uint64_t *line_ptr = &line;
-        uint64_t *col_ptr = &col;
-        std::istream *is = &in;
-        std::function<char()> input = [is, line_ptr, col_ptr]() mutable -> char
+        std::array<uint8_t, 256> ret = {};
+        for (int c = 'a'; c <= 'z'; c++)
         {
-            char ret = is->get();
-            if (ret == '\n' || ret == '\r') // newlines and returns are the accepted newline charactors
-            {
-                *line_ptr += 1;
-                *col_ptr = 1; 
-            }
-            else
-            {
-                *col_ptr += 1;
-            }
-            return ret;
-        };
-        std::function<void(std::string, token_type)> push = [ptoks, line, col](std::string tok, token_type t) -> void
+            ret[c] |= CHAR_CLASS_ALPHA | CHAR_CLASS_NAME;
+            ret[c - 'a' + 'A'] |= CHAR_CLASS_ALPHA | CHAR_CLASS_NAME;
+        }
+        for (int c = '0'; c <= '9'; c++)
         {
-            token ctok; // no constructor
-            ctok.line = line;
-            ctok.col = col;
-            ctok.token = tok;
-            ctok.type = t;
-            ptoks->push_back(ctok);
-        };
-        char got = input(); // no need for putback when each case is liable for its own input call
-        while (1)
+            ret[c] |= CHAR_CLASS_DIGIT | CHAR_CLASS_NAME;
+        }
+        ret['-'] |= CHAR_CLASS_NAME;
+        ret[' '] |= CHAR_CLASS_SPACE;
+        ret['\t'] |= CHAR_CLASS_SPACE;
+        ret[';'] |= CHAR_CLASS_SPACE;
+        ret[','] |= CHAR_CLASS_SPACE;
+        ret['\n'] |= CHAR_CLASS_SPACE | CHAR_CLASS_NEWLINE;
+        ret['\r'] |= CHAR_CLASS_SPACE | CHAR_CLASS_NEWLINE;
+        ret['('] |= CHAR_CLASS_OPEN;
+        ret['{'] |= CHAR_CLASS_OPEN;
+        ret['['] |= CHAR_CLASS_OPEN;
+        ret[')'] |= CHAR_CLASS_CLOSE;
+        ret['}'] |= CHAR_CLASS_CLOSE;
+        ret[']'] |= CHAR_CLASS_CLOSE;
+        return ret;
+    }
+
+    constexpr std::array<uint8_t, 256> char_classes = make_char_classes();
+
+    uint8_t char_class_of(char c)
+    {
+        return char_classes[uint8_t(c)];
+    }
+
+    // appends the next token to toks, or two for a /index, and returns false at the end of the input
+    bool lexer::next(tokens &toks)
+    {
+        while (cur != end)
         {
-            if (got == EOF) // return ret upon the end of the file
+            uint8_t cls = char_class_of(*cur);
+            if (cls & CHAR_CLASS_SPACE)
             {
-                return;
-            }
-            if (got == ' ' || got == '\t' || got == '\n' || got == '\r' || got == ';' || got == ',')
-            {
-                if (is_repl && (got == '\n' || got == '\r'))
+                if (cls & CHAR_CLASS_NEWLINE)
                 {
-                    return;
+                    if (is_repl)
+                    {
+                        cur = end;
+                        return false;
+                    }
+                    // \r\n is one newline
+                    if (*cur == '\n' || cur+1 == end || cur[1] != '\n')
+                    {
+                        line ++;
+                    }
+                    col = 0;
                 }
-                got = input();
+                col ++;
+                cur ++;
+                continue;
             }
-            if (got == '\'')
+            const char *start = cur;
+            token ctok;
+            ctok.line = line;
+            ctok.col = col;
+            if (*cur == '\'' || *cur == '/')
             {
-                got = input();
-                std::string str;
-                while (isalnum(got)  || got == '-') // [a-zA-Z0-9]+
+                // 'name is a string and a/name is an index
+                bool is_index = *cur == '/';
+                cur ++;
+                while (cur != end && (char_class_of(*cur) & CHAR_CLASS_NAME))
                 {
-                    str += got;
-                    got = input();
+                    cur ++;
                 }
-                push(str, TOKEN_TYPE_STR);
-            }
-            if (got == '/')
-            {
-                got = input();
-                std::string str;
-                while (isalnum(got)  || got == '-') // [a-zA-Z0-9]+
+                ctok.token = std::string_view(start+1, cur-start-1);
+                ctok.type = TOKEN_TYPE_STR;
+                toks.push_back(ctok);
+                if (is_index)
                 {
-                    str += got;
-                    got = input();
+                    ctok.token = "#";
+                    ctok.type = TOKEN_TYPE_NAME;
+                    toks.push_back(ctok);
                 }
-                token top = toks[toks.size()-1];
-                push(str, TOKEN_TYPE_STR);
-                push("#", TOKEN_TYPE_NAME);
             }
-            if (isalpha(got)) // name, do, and end
+            else if (cls & CHAR_CLASS_ALPHA)
             {
-                std::string str;
-                while (isalnum(got)  || got == '-') // [a-zA-Z0-9]+
+                while (cur != end && (char_class_of(*cur) & CHAR_CLASS_NAME))
                 {
-                    str += got;
-                    got = input();
+                    cur ++;
                 }
-                push(str, TOKEN_TYPE_NAME);
+                ctok.token = std::string_view(start, cur-start);
+                ctok.type = TOKEN_TYPE_NAME;
+                toks.push_back(ctok);
             }
-            if (got == '\"')
+            else if (*cur == '\"')
             {
-                got = input();
-                std::string str;
-                while (got != '\"')
+                cur ++;
+                const char *text = cur;
+                while (cur != end && *cur != '\"')
+                {
+                    if (*cur == '\n')
+                    {
+                        // columns restart after a newline inside of the string
+                        line ++;
+                        col = 1;
+                        start = cur+1;
+                    }
+                    cur ++;
+                }
+                ctok.token = std::string_view(text, cur-text);
+                ctok.type = TOKEN_TYPE_STR;
+                toks.push_back(ctok);
+                if (cur != end)
                 {
-                    str += got;
-                    got = input();
+                    cur ++;
                 }
-                got = input();
-                push(str, TOKEN_TYPE_STR);
             }
-            if (isdigit(got)) // int and float
+            else if (cls & CHAR_CLASS_DIGIT)
             {
-                std::string str;
-                while (isdigit(got)) // [0-9]+
+                while (cur != end && (char_class_of(*cur) & CHAR_CLASS_DIGIT))
                 {
-                    str += got;
-                    got = input();
+                    cur ++;
                 }
-                if (got == '.')
+                ctok.type = TOKEN_TYPE_INT;
+                if (cur != end && *cur == '.')
                 {
-                    str += got;
-                    got = input();
-                    while (isdigit(got)) // [0-9]+
+                    cur ++;
+                    while (cur != end && (char_class_of(*cur) & CHAR_CLASS_DIGIT))
                     {
-                        str += got;
-                        got = input();
+                        cur ++;
                     }
-                    push(str, TOKEN_TYPE_FLOAT);
+                    ctok.type = TOKEN_TYPE_FLOAT;
                 }
-                else
+                ctok.token = std::string_view(start, cur-start);
+                // 1.5d and 2d are doubles, the d is left out of the token
+                if (cur != end && *cur == 'd' && (cur+1 == end || !(char_class_of(cur[1]) & CHAR_CLASS_NAME)))
                 {
-                    push(str, TOKEN_TYPE_INT);
+                    ctok.type = TOKEN_TYPE_DOUBLE;
+                    cur ++;
                 }
+                toks.push_back(ctok);
+            }
+            else if (cls & (CHAR_CLASS_OPEN | CHAR_CLASS_CLOSE))
+            {
+                cur ++;
+                ctok.token = std::string_view(start, 1);
+                ctok.type = (cls & CHAR_CLASS_OPEN) ? TOKEN_TYPE_OPEN : TOKEN_TYPE_CLOSE;
+                toks.push_back(ctok);
+            }
+            else
+            {
+                std::cout << "unknown charactor '" << *cur << "' at " << line << ":" << col << std::endl;
+                cur ++;
+                col ++;
+                continue;
+            }
+            col += cur-start;
+            return true;
+        }
+        return false;
+    }
+
+    // true when the next thing in the input is a /index of whatever came before
+    bool lexer::at_index()
+    {
+        const char *peek = cur;
+        while (peek != end && (char_class_of(*peek) & CHAR_CLASS_SPACE))
+        {
+            if (is_repl && (char_class_of(*peek) & CHAR_CLASS_NEWLINE))
+            {
+                return false;
             }
-            if ("({["s.find(got) != std::string::npos)
+            peek ++;
+        }
+        return peek != end && *peek == '/';
+    }
+
+    void state::lex(const char *begin, const char *end, bool is_repl)
+    {
+        lexer lx = {begin, end, is_repl};
+        while (lx.next(toks))
+        {
+        }
+    }
+
+    // replaces toks with the next top level form and any /index after it
+    // returns false once the input is used up
+    bool state::lex_form(lexer &lx)
+    {
+        toks.clear();
+        int64_t depth = 0;
+        uint64_t seen = 0;
+        while (lx.next(toks))
+        {
+            uint64_t size = toks.size();
+            for (; seen < size; seen++)
             {
-                push(""s+got, TOKEN_TYPE_OPEN);
-                got = input();
+                if (toks[seen].type == TOKEN_TYPE_OPEN)
+                {
+                    depth ++;
+                }
+                else if (toks[seen].type == TOKEN_TYPE_CLOSE)
+                {
+                    depth --;
+                }
             }
-            if (")}]"s.find(got) != std::string::npos)
+            if (depth <= 0 && !lx.at_index())
             {
-                push(""s+got, TOKEN_TYPE_CLOSE);
-                got = input();
+                break;
             }
         }
+        return toks.size() != 0;
     }
 
     mpq_rational strtorat(std::string str)
@@ -850,4 +2254,7 @@ namespace lang
         }
         return mpq_rational(num, den);
     }
-}
\ No newline at end of file
+}
+#include "lang-opt.hpp"
+#include "lang-cache.hpp"
+#include "lang-reg.hpp"
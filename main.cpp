@@ -1,55 +1,477 @@
 // #include "lang-lib.hpp"
 #include "lang.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
-uint64_t feval(lang::state &state, std::istream &is, bool repl_mode, uint64_t start)
+// seconds spent in each phase, filled in by feval and frun for --stats
+struct run_stats
+{
+    double load = 0; // reading a .slxc
+    double lex = 0;
+    double ast = 0;
+    double comp = 0; // includes optimize
+    double run = 0;
+    uint64_t forms = 0;
+    std::chrono::steady_clock::time_point mark = std::chrono::steady_clock::now();
+
+    // the time since the last lap, or since the stats were made
+    double lap()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double ret = std::chrono::duration<double>(now - mark).count();
+        mark = now;
+        return ret;
+    }
+};
+
+// where the code of the next form goes
+uint64_t code_end(const lang::state &state)
+{
+    return state.opts.registers ? state.reg_code.size() : state.opcodes.size();
+}
+
+// lexes, compiles and runs one top level form at a time
+// so only the tokens and tree of the current form are ever held
+// image, when given, records the code of each form for the .slxc cache
+uint64_t feval(lang::state &state, const char *begin, const char *end, bool repl_mode, uint64_t start,
+    lang::cache_image *image = nullptr, run_stats *stats = nullptr)
 {
     bool broken = false;
+    lang::lexer lx = {begin, end, repl_mode};
+
+    if (stats != nullptr)
+    {
+        stats->lap();
+    }
+    while (state.lex_form(lx))
+    {
+        if (stats != nullptr)
+        {
+            stats->lex += stats->lap();
+            stats->forms ++;
+        }
+        broken = state.ast();
+        if (stats != nullptr)
+        {
+            stats->ast += stats->lap();
+        }
+        if (!broken)
+        {
+            // std::cout << lang::walknode(state, state.tree.nodes[state.root]) << std::endl;
+            broken = state.opts.registers ? state.reg_comp() : state.comp();
+        }
+        state.tree.clear();
+        state.toks.clear();
+        if (broken)
+        {
+            return code_end(state);
+        }
+        if (state.opts.registers)
+        {
+            // reg_code is not optimized or cached, it is run as it comes out of reg_comp
+            if (stats != nullptr)
+            {
+                stats->comp += stats->lap();
+            }
+            broken = state.reg_run(start, state.reg_code.size());
+            state.vm_stack.clear();
+            state.ret_stack.clear();
+            if (stats != nullptr)
+            {
+                stats->run += stats->lap();
+            }
+            start = state.reg_code.size();
+            if (broken)
+            {
+                return start;
+            }
+            continue;
+        }
+        // the root compiles as a call, its FUNC_CALL is not wanted
+        state.opcodes.pop_back();
+        state.optimize(start);
+        if (image != nullptr)
+        {
+            image->ops.insert(image->ops.end(), state.opcodes.begin()+start, state.opcodes.end());
+            image->forms.push_back(image->ops.size());
+        }
+        if (stats != nullptr)
+        {
+            stats->comp += stats->lap();
+        }
+        broken = state.run(start, state.opcodes.size());
+        state.vm_stack.clear();
+        state.ret_stack.clear();
+        if (stats != nullptr)
+        {
+            stats->run += stats->lap();
+        }
+        start = state.opcodes.size();
+        if (broken)
+        {
+            return start;
+        }
+    }
+    if (image != nullptr)
+    {
+        image->complete = true;
+    }
+    return start;
+}
 
-    state.lex(is, repl_mode);
+// runs the forms of a loaded cache the way feval would have
+uint64_t frun(lang::state &state, lang::cache_image &image, run_stats *stats = nullptr)
+{
+    state.opcodes = image.ops;
+    uint64_t start = state.call_place+1;
+    if (stats != nullptr)
+    {
+        stats->load += stats->lap();
+    }
+    for (uint64_t end: image.forms)
+    {
+        if (stats != nullptr)
+        {
+            stats->forms ++;
+        }
+        bool broken = state.run(start, end);
+        state.vm_stack.clear();
+        state.ret_stack.clear();
+        start = end;
+        if (broken)
+        {
+            break;
+        }
+    }
+    if (stats != nullptr)
+    {
+        stats->run += stats->lap();
+    }
+    return start;
+}
+
+// maps a whole file read only, an empty file gives an empty range and nothing to unmap
+bool map_file(const std::string &path, const char *&data, uint64_t &size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    size = info.st_size;
+    data = "";
+    if (size != 0)
+    {
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        data = static_cast<const char *>(mapped);
+    }
+    close(fd);
+    return true;
+}
+
+void unmap_file(const char *data, uint64_t size)
+{
+    if (size != 0)
+    {
+        munmap(const_cast<char *>(data), size);
+    }
+}
+
+// VmHWM starts over at exec, ru_maxrss can still hold the peak of the process that forked us
+uint64_t peak_rss_kb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return std::stoull(line.substr(6));
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// one line of json on stderr so it does not mix with what the script prints
+void show_stats(const lang::state &state, const run_stats &stats)
+{
+    std::ostringstream out;
+    out << "{\"forms\": " << stats.forms
+        << ", \"opcodes\": " << code_end(state)
+        << ", \"load\": " << stats.load
+        << ", \"lex\": " << stats.lex
+        << ", \"ast\": " << stats.ast
+        << ", \"comp\": " << stats.comp
+        << ", \"run\": " << stats.run
+        << ", \"peak_rss_kb\": " << peak_rss_kb()
+        << "}";
+    std::cerr << out.str() << std::endl;
+}
 
-    if (state.toks.size() == 0)
+// --cache keeps the compiled code in file + "c" and reuses it while the source is unchanged
+uint64_t run_file(lang::state &state, const std::string &file, const char *src, uint64_t size, bool use_cache,
+    run_stats *stats)
+{
+    if (!use_cache || state.opts.registers)
+    {
+        return feval(state, src, src + size, false, code_end(state), nullptr, stats);
+    }
+    // folding depends on the globals at the time a form is compiled, which a later run may not share,
+    // so a cached file is always compiled without it, and the same goes for one loaded from the cache
+    if (state.opts.fold)
+    {
+        std::cerr << "--cache compiles without fold, give --no-fold as well to get the same code without --cache"
+            << std::endl;
+        state.opts.fold = false;
+    }
+    std::string cache_file = file + "c";
+    uint64_t hash = lang::cache_hash(src, src + size);
+    lang::cache_image image;
+    const char *cached;
+    uint64_t cached_size;
+    if (map_file(cache_file, cached, cached_size))
+    {
+        bool loaded = lang::cache_load(state, image, hash, size, cached, cached + cached_size);
+        unmap_file(cached, cached_size);
+        if (loaded)
+        {
+            return frun(state, image, stats);
+        }
+    }
+    // the image starts with the op of call_value, so its places are the ones run used
+    image.ops = state.opcodes;
+    uint64_t start = feval(state, src, src + size, false, code_end(state), &image, stats);
+    // feval stops at the first form that does not compile, so a complete image compiled cleanly
+    if (image.complete)
     {
-        return start;
+        lang::cache_save(state, image, hash, size, cache_file);
     }
+    return start;
+}
 
-    state.ast();
-    state.toks = {};
-    
-    // std::cout << lang::walknode(state.root) << std::endl;
+// why the command line was not understood and how slanex is run, the caller exits after this
+void usage(const std::string &why)
+{
+    std::cerr << why << std::endl;
+    std::cerr << "usage: slx [flags] [file]" << std::endl;
+}
 
-    broken = state.comp();
-    if (broken)
+// the count given after the flag at argv[i], false when there is none or it is not a plain decimal number
+bool flag_count(int argc, char **argv, int &i, uint64_t &out)
+{
+    if (i+1 >= argc)
     {
-        state.root = lang::node();
-        return state.opcodes.size();
+        return false;
     }
-    state.root = lang::node();
-    state.opcodes.pop_back();
-    broken = state.run(start, state.opcodes.size());
-    state.vm_stack = {};
-    if (broken)
+    i ++;
+    const char *text = argv[i];
+    // strtoull takes leading spaces and a minus sign, a count has neither
+    if (*text < '0' || *text > '9')
     {
-        return state.opcodes.size();
+        return false;
     }
-    return state.opcodes.size();
+    char *end;
+    errno = 0;
+    uint64_t got = strtoull(text, &end, 10);
+    if (*end != '\0' || errno != 0)
+    {
+        return false;
+    }
+    out = got;
+    return true;
 }
 
 int main(int argc, char** argv)
 {
     lang::state state;     
     uint64_t start = 0;
-    if (argc <= 1)
+    std::string file;
+    bool use_cache = false;
+    bool use_stats = false;
+    bool use_profile = false;
+    bool use_mem_stats = false;
+    bool use_jit_report = false;
+    std::string profile_file;
+    for (int i = 1; i < argc; i++)
     {
+        std::string arg = argv[i];
+        if (arg == "--no-opt")
+        {
+            // only the compile passes, so it does not undo --no-jit or --reg given before it
+            state.opts.peephole = false;
+            state.opts.superinstructions = false;
+            state.opts.fold = false;
+            state.opts.jump_threading = false;
+        }
+        else if (arg == "--no-peephole")
+        {
+            state.opts.peephole = false;
+        }
+        else if (arg == "--no-super")
+        {
+            state.opts.superinstructions = false;
+        }
+        else if (arg == "--no-fold")
+        {
+            state.opts.fold = false;
+        }
+        else if (arg == "--no-jump-thread")
+        {
+            state.opts.jump_threading = false;
+        }
+        else if (arg == "--no-quicken")
+        {
+            state.opts.quicken = false;
+        }
+        else if (arg == "--jit")
+        {
+            state.opts.jit = true;
+        }
+        else if (arg == "--no-jit")
+        {
+            state.opts.jit = false;
+        }
+        else if (arg == "--reg")
+        {
+            // the register VM, which has no jit and is not profiled
+            state.opts.registers = true;
+        }
+        else if (arg == "--jit-report")
+        {
+            use_jit_report = true;
+        }
+        else if (arg == "--cache")
+        {
+            use_cache = true;
+        }
+        else if (arg == "--stats")
+        {
+            use_stats = true;
+        }
+        else if (arg == "--profile")
+        {
+            use_profile = true;
+        }
+        else if (arg == "--profile-stacks")
+        {
+            // collapsed stacks for flamegraph.pl, implies --profile
+            if (i+1 >= argc)
+            {
+                usage("--profile-stacks needs a file to write the stacks to");
+                return 1;
+            }
+            i ++;
+            use_profile = true;
+            profile_file = argv[i];
+        }
+        else if (arg == "--mem-stats")
+        {
+            use_mem_stats = true;
+        }
+        else if (arg == "--max-depth")
+        {
+            if (!flag_count(argc, argv, i, state.max_depth))
+            {
+                usage("--max-depth needs a count of nested calls");
+                return 1;
+            }
+        }
+        else if (arg == "--threads")
+        {
+            // workers that run spawned tasks, 0 for one per core
+            // each worker is a thread started up front, so a typo like 10000 is refused rather than tried
+            if (!flag_count(argc, argv, i, lang::tasks.threads) || lang::tasks.threads > 1024)
+            {
+                usage("--threads needs a count of workers up to 1024, 0 for one per core");
+                return 1;
+            }
+        }
+        else if (arg == "--simd")
+        {
+            // the kernels the array builtins run, avx2, sse2 or plain, the widest this cpu has by default
+            if (i+1 >= argc)
+            {
+                usage("--simd needs avx2, sse2 or plain");
+                return 1;
+            }
+            i ++;
+            if (!lang::array_level_named(argv[i], lang::array_simd))
+            {
+                std::cerr << "no " << argv[i] << " kernels on this cpu" << std::endl;
+            }
+        }
+        else
+        {
+            file = arg;
+        }
+    }
+    if (use_profile)
+    {
+        state.profile_start();
+    }
+    start = code_end(state);
+    if (file == "")
+    {
+        std::string line;
         while (1)
         {
             std::cout << ">>>";
-            start = feval(state, std::cin, true, start);
+            if (!std::getline(std::cin, line))
+            {
+                break;
+            }
+            start = feval(state, line.data(), line.data() + line.size(), true, start);
             std::cout << std::endl;
         }
     }
     else
     {
-        std::ifstream f(argv[1]);
-        start = feval(state, f, false, start); 
+        // the tokens point straight into the mapped file
+        const char *src;
+        uint64_t size;
+        if (!map_file(file, src, size))
+        {
+            std::cout << "cannot open " << file << std::endl;
+            return 1;
+        }
+        run_stats stats;
+        start = run_file(state, file, src, size, use_cache, use_stats ? &stats : nullptr);
+        unmap_file(src, size);
+        if (use_stats)
+        {
+            show_stats(state, stats);
+        }
     }
-}
\ No newline at end of file
+    if (use_profile)
+    {
+        state.profile_report(std::cerr);
+        if (profile_file != "" && !state.profile_stacks(profile_file))
+        {
+            std::cerr << "cannot write " << profile_file << std::endl;
+        }
+    }
+    if (use_jit_report)
+    {
+        state.jit_report(std::cerr);
+    }
+    if (use_mem_stats)
+    {
+        lang::mem_report(state, std::cerr);
+    }
+}